@@ -19,6 +19,7 @@
 
 #include "scene.h"
 #include "parser.h"
+#include "timer.h"
 
 // runs the raytrace over all tests and saves the corresponding images
 int main(int argc, char** argv)
@@ -28,10 +29,15 @@ int main(int argc, char** argv)
 
     auto args = parseCmdline(argc, argv,
     {
-        "01_raytrace", "raytrace a scene", {},
+        "01_raytrace", "raytrace a scene",
+        {
+            {"packet_size", "p", "trace primary rays in packet_size^2 packets (at most 8; 0: off, default: scene setting)", typeid(int), true, json(-1)},
+            {"frames", "f", "render a turntable of this many frames, rotating all surfaces about the y axis", typeid(int), true, json(1)},
+            {"png_level", "", "PNG compression level, from 0 (uncompressed) and 1 (fastest) to 9 (smallest)", typeid(int), true, json(6)}
+        },
         {
             {"scene_filename", "",  "scene filename",   typeid(string), false, json("scene.json")},
-            {"image_filename", "",  "image filename",   typeid(string), true,  json("")}
+            {"image_filename", "",  "image filename (.pfm and .ppm images are written band by band while rendering)", typeid(string), true,  json("")}
         }
     });
 
@@ -61,11 +67,61 @@ int main(int argc, char** argv)
                            args["image_filename"].get<string>() :
                            scene_filename.substr(0, scene_filename.size()-5)+".png";
 
-    auto image = scene->raytrace();
-    
-    message("\nAverage Ray-Primitive Intersections : %f \n", static_cast<float>(primitives_intersected) / static_cast<float>(rays_traced));
-    message("writing to png...\n");
-    image.save(image_filename);
+    if (args["packet_size"].get<int>() >= 0)
+        scene->setPacketSize(args["packet_size"]);
+
+    int pngLevel = args["png_level"];
+    int frames = args["frames"];
+    if (frames > 1)
+    {
+        // every frame rotates the original placement, so the error does not accumulate;
+        // the accelerator is refit rather than rebuilt between frames
+        std::vector<Transform> placement;
+        for (auto surface : scene->surfaces())
+            placement.push_back(surface->transform());
+
+        string stem = image_filename.substr(0, image_filename.find_last_of('.'));
+        for (auto frame : range(frames))
+        {
+            if (frame > 0)
+            {
+                Transform spin(Eigen::Affine3f(Eigen::AngleAxisf(2.0f * M_PI * frame / frames,
+                                                                 Vector3f::UnitY())).matrix());
+                for (auto i : range(int(placement.size())))
+                    scene->surfaces()[i]->setTransform(spin * placement[i]);
+                scene->refitAccelerator();
+            }
+
+            message("\nrendering frame %d of %d...\n", frame + 1, frames);
+            auto image = scene->raytrace();
+            string frame_filename = tfm::format("%s_%04d.png", stem, frame);
+            Timer timer;
+            if (!image.save(frame_filename, 1.0f, pngLevel))
+                error("Could not write %s.\n", frame_filename);
+            message("saved %s in %s\n", frame_filename, timer.elapsedString());
+        }
+    }
+    else if (ImageWriter::supports(image_filename))
+    {
+        // never holds the whole image in memory
+        ImageWriter writer(image_filename, scene->imageWidth(), scene->imageHeight());
+        if (!scene->raytrace(writer))
+            error("Could not write %s.\n", image_filename);
+    }
+    else
+    {
+        auto image = scene->raytrace();
+        Timer timer;
+        if (!image.save(image_filename, 1.0f, pngLevel))
+            error("Could not write %s.\n", image_filename);
+        message("saved %s in %s\n", image_filename, timer.elapsedString());
+    }
+
+    message("\nAverage Ray-Primitive Intersections : %f \n", static_cast<float>(rayStats.primitivesIntersected) / static_cast<float>(rayStats.raysTraced));
+    message("Average Acceleration Nodes Visited : %f \n", static_cast<float>(rayStats.nodesVisited) / static_cast<float>(rayStats.raysTraced));
+    message("Shadow Rays : %d, Average Primitive Tests : %f, Average Nodes Visited : %f \n", rayStats.shadowRaysTraced,
+            static_cast<float>(rayStats.shadowPrimitivesTested) / static_cast<float>(rayStats.shadowRaysTraced),
+            static_cast<float>(rayStats.shadowNodesVisited) / static_cast<float>(rayStats.shadowRaysTraced));
 
     delete scene;
     message("done\n");
@@ -19,6 +19,8 @@
 
 #include "scene.h"
 #include "sphere.h"
+#include "quad.h"
+#include <random>
 
 // runs the raytrace over all tests and saves the corresponding images
 int main(int argc, char** argv)
@@ -55,5 +57,64 @@ int main(int argc, char** argv)
         warning("Sphere intersection incorrect! Should hit sphere\n");
     }
 
+    // Spheres with a similarity transform build their local ray from the
+    // center and scale only, and quads use their cached inverse transform.
+    // Compare them against intersecting the untransformed surface with the ray
+    // in object space, which keeps the ray parameter. Rays are aimed at the
+    // inner part of the surface and hit it at least 60 (sphere) or 6 (quad)
+    // degrees away from grazing, where both solutions are well conditioned.
+    message("Testing transformed against object-space intersection...\n");
+
+    const float tolerance = 1e-5f;      // relative to max(1, t)
+    Transform xform(Eigen::Affine3f(Eigen::Translation3f(1.0f, -2.0f, 0.5f) *
+                                    Eigen::AngleAxisf(0.7f, Vector3f(1.0f, 2.0f, -1.0f).normalized()) *
+                                    Eigen::Scaling(1.7f)).matrix());
+    Transform toLocal = xform.inverse();
+    Sphere worldSphere(sphereScene), localSphere(sphereScene);
+    Quad worldQuad(sphereScene), localQuad(sphereScene);
+    worldSphere.setTransform(xform);
+    worldQuad.setTransform(xform);
+
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> pos(-5.0f, 5.0f), inner(-0.5f, 0.5f);
+    Normal3f quadNormal = xform * Normal3f(0.0f, 0.0f, 1.0f);
+    float maxError = 0.0f;
+    int mismatches = 0;
+    for (auto surface : {std::make_pair((Surface *)&worldSphere, (Surface *)&localSphere),
+                         std::make_pair((Surface *)&worldQuad, (Surface *)&localQuad)})
+    {
+        bool quad = surface.first == &worldQuad;
+        for (int r = 0; r < 100000; ++r)
+        {
+            Point3f target = xform * Point3f(inner(rng), inner(rng), quad ? 0.0f : inner(rng));
+            Point3f o(pos(rng), pos(rng), pos(rng));
+            Ray3f ray(o, (target - o).normalized());
+            if (quad && std::abs(ray.d.dot(quadNormal)) < 0.1f)
+                continue;
+
+            Intersection3f world, local;
+            bool hitWorld = surface.first->intersect(0, ray, world);
+            bool hitLocal = surface.second->intersect(0, toLocal.transformSegment(ray), local);
+            if (hitWorld != hitLocal)
+            {
+                ++mismatches;
+                continue;
+            }
+            if (!hitWorld)
+                continue;
+
+            float scale = std::max(1.0f, world.t);
+            maxError = std::max(maxError, std::abs(world.t - local.t) / scale);
+            maxError = std::max(maxError, (world.p - xform * local.p).cwiseAbs().maxCoeff() / scale);
+        }
+    }
+
+    message("%d rays disagree on hitting, maximum relative error in t and hit point is %g (tolerance %g)\n",
+            mismatches, maxError, tolerance);
+    if (mismatches > 0 || maxError > tolerance)
+        warning("Result incorrect!\n\n");
+    else
+        message("Result correct!\n\n");
+
     return 0;
 }
@@ -0,0 +1,171 @@
+/*
+This file is part of Dirt, the Dartmouth introductory ray tracer, used in
+Dartmouth's COSC 77/177 Computer Graphics course.
+
+Copyright (c) 2016 by Wojciech Jarosz
+
+Dirt is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License Version 3
+as published by the Free Software Foundation.
+
+Dirt is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "transform.h"
+#include "timer.h"
+#include <Eigen/Geometry>
+#include <random>
+
+namespace
+{
+
+// the homogeneous reference: full 4x4 products with a division by w
+Point3f referencePoint(const Eigen::Matrix4f & m, const Point3f & p)
+{
+    Eigen::Vector4f r = m * Eigen::Vector4f(p.x(), p.y(), p.z(), 1.0f);
+    return Point3f(r.head<3>() / r.w());
+}
+
+Normal3f referenceNormal(const Eigen::Matrix4f & m, const Normal3f & n)
+{
+    Eigen::Vector4f r = m.inverse().transpose() * Eigen::Vector4f(n.x(), n.y(), n.z(), 0.0f);
+    return Normal3f(r.head<3>()).normalized();
+}
+
+// checks the scalar and batch transformations of xform against the homogeneous reference
+bool testTransform(const Transform & xform, const std::vector<Point3f> & points,
+                   const std::vector<Normal3f> & normals, const std::vector<Box3f> & boxes)
+{
+    const Eigen::Matrix4f & m = xform.getMatrix();
+    std::vector<Point3f> batchPoints(points.size());
+    std::vector<Normal3f> batchNormals(normals.size());
+    std::vector<Box3f> batchBoxes(boxes.size());
+    xform.transformPoints(points.data(), batchPoints.data(), points.size());
+    xform.transformNormals(normals.data(), batchNormals.data(), normals.size());
+    xform.transformBoxes(boxes.data(), batchBoxes.data(), boxes.size());
+
+    float pointError = 0.0f, normalError = 0.0f;
+    size_t boxErrors = 0;
+    for (auto i : range(int(points.size())))
+    {
+        Point3f ref = referencePoint(m, points[i]);
+        float scale = std::max(1.0f, ref.cwiseAbs().maxCoeff());
+        pointError = std::max(pointError, (xform * points[i] - ref).cwiseAbs().maxCoeff() / scale);
+        pointError = std::max(pointError, (batchPoints[i] - ref).cwiseAbs().maxCoeff() / scale);
+
+        Normal3f nref = referenceNormal(m, normals[i]);
+        normalError = std::max(normalError, (xform * normals[i] - nref).cwiseAbs().maxCoeff());
+        normalError = std::max(normalError, (batchNormals[i] - nref).cwiseAbs().maxCoeff());
+
+        // the box must contain all its transformed corners, and the batch
+        // version must match the scalar one exactly
+        Box3f box = xform * boxes[i];
+        Box3f slack = box;
+        Vector3f eps = 1e-5f * Vector3f::Ones().cwiseMax(box.max().cwiseAbs()).cwiseMax(box.min().cwiseAbs());
+        slack.min() -= eps;
+        slack.max() += eps;
+        for (auto c : range(8))
+        {
+            Point3f corner = boxes[i].corner(Box3f::CornerType(c));
+            if (!slack.contains(referencePoint(m, corner)))
+                boxErrors++;
+        }
+        if (batchBoxes[i].min() != box.min() || batchBoxes[i].max() != box.max())
+            boxErrors++;
+    }
+
+    message("max point error: %g, max normal error: %g, box errors: %d\n", pointError, normalError, boxErrors);
+    return pointError < 1e-5f && normalError < 1e-5f && boxErrors == 0;
+}
+
+} // namespace
+
+
+// compares the affine and projective paths of Transform, and its batch
+// versions, against full homogeneous products, and times them
+int main(int argc, char** argv)
+{
+    message("Testing batch transformations...\n");
+
+    const int n = 1 << 16;
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> pos(-10.0f, 10.0f), ext(0.05f, 3.0f), dir(-1.0f, 1.0f);
+
+    std::vector<Point3f> points(n);
+    std::vector<Normal3f> normals(n);
+    std::vector<Box3f> boxes(n);
+    for (auto i : range(n))
+    {
+        points[i] = Point3f(pos(rng), pos(rng), pos(rng));
+        normals[i] = Normal3f(dir(rng), dir(rng), dir(rng)).normalized();
+        Vector3f e(ext(rng), ext(rng), ext(rng));
+        boxes[i] = Box3f(points[i] - e, points[i] + e);
+    }
+
+    // rotation, non-uniform scale and translation
+    Eigen::Matrix4f affine = Eigen::Matrix4f::Identity();
+    affine.topLeftCorner<3,3>() = Eigen::AngleAxisf(0.7f, Vector3f(1, 2, 3).normalized()).matrix() *
+                                  Vector3f(2.0f, 0.5f, -1.5f).asDiagonal();
+    affine.topRightCorner<3,1>() = Vector3f(1.0f, -2.0f, 3.0f);
+    Transform affineXform(affine);
+
+    // a perspective transform, kept away from w = 0 for the test points
+    Eigen::Matrix4f projective = affine;
+    projective.row(3) << 0.01f, 0.02f, -0.01f, 1.0f;
+    Transform projectiveXform(projective);
+
+    bool correct = affineXform.isAffine() && !projectiveXform.isAffine();
+    message("affine transform:\n");
+    correct = testTransform(affineXform, points, normals, boxes) && correct;
+    message("projective transform:\n");
+    correct = testTransform(projectiveXform, points, normals, boxes) && correct;
+
+    // timing
+    const int repeats = 100;
+    std::vector<Point3f> outPoints(n);
+    std::vector<Normal3f> outNormals(n);
+    std::vector<Box3f> outBoxes(n);
+    Timer timer;
+    for (int r = 0; r < repeats; ++r)
+        for (auto i : range(n))
+            outPoints[i] = referencePoint(affine, points[i]);
+    double tHomogeneous = timer.lap();
+    for (int r = 0; r < repeats; ++r)
+        for (auto i : range(n))
+            outPoints[i] = affineXform * points[i];
+    double tScalar = timer.lap();
+    for (int r = 0; r < repeats; ++r)
+        affineXform.transformPoints(points.data(), outPoints.data(), n);
+    double tBatch = timer.lap();
+    for (int r = 0; r < repeats; ++r)
+        affineXform.transformNormals(normals.data(), outNormals.data(), n);
+    double tNormals = timer.lap();
+    for (int r = 0; r < repeats; ++r)
+        for (auto i : range(n))
+            outBoxes[i] = affineXform * boxes[i];
+    double tBoxes = timer.lap();
+    for (int r = 0; r < repeats; ++r)
+        affineXform.transformBoxes(boxes.data(), outBoxes.data(), n);
+    double tBatchBoxes = timer.lap();
+
+    double ns = 1e6 / (double(repeats) * n);
+    message("homogeneous points:  %6.2f ns/point\n", tHomogeneous * ns);
+    message("operator* points:    %6.2f ns/point\n", tScalar * ns);
+    message("transformPoints:     %6.2f ns/point\n", tBatch * ns);
+    message("transformNormals:    %6.2f ns/normal\n", tNormals * ns);
+    message("operator* boxes:     %6.2f ns/box\n", tBoxes * ns);
+    message("transformBoxes:      %6.2f ns/box\n", tBatchBoxes * ns);
+
+    if (correct)
+        message("Result correct!\n\n");
+    else
+        warning("Result incorrect!\n\n");
+
+    return 0;
+}
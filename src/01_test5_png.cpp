@@ -0,0 +1,130 @@
+/*
+This file is part of Dirt, the Dartmouth introductory ray tracer, used in
+Dartmouth's COSC 77/177 Computer Graphics course.
+
+Copyright (c) 2016 by Wojciech Jarosz
+
+Dirt is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License Version 3
+as published by the Free Software Foundation.
+
+Dirt is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pngencoder.h"
+#include "parallel.h"
+#include <cstdio>
+#include <random>
+
+// a private copy of the decoder, since image.cpp keeps its copy static
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_STATIC
+#define STBI_ONLY_PNG
+#if defined(__GNUC__) || defined(__GNUG__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#include <stb_image.h>
+#if defined(__GNUC__) || defined(__GNUG__)
+#pragma GCC diagnostic pop
+#endif
+
+// local functions
+namespace
+{
+
+// Fill an image with noise, gradients, flat areas and repeated blocks, so the
+// encoder uses every row filter as well as literals, short and long matches
+std::vector<uint8_t> makeImage(int width, int height, std::mt19937 & rng)
+{
+    std::vector<uint8_t> rgb(size_t(width) * height * 3);
+    std::uniform_int_distribution<int> byte(0, 255);
+    for (auto y : range(height))
+    {
+        for (auto x : range(width))
+        {
+            uint8_t * p = &rgb[(size_t(y) * width + x) * 3];
+            for (auto c : range(3))
+            {
+                switch ((x / 37 + y / 23) % 4)
+                {
+                case 0: p[c] = uint8_t(byte(rng)); break;
+                case 1: p[c] = uint8_t(x * (c + 1) + y); break;
+                case 2: p[c] = uint8_t(64 * c); break;
+                default: p[c] = uint8_t((x % 5) * 50 + (y % 3) * c); break;
+                }
+            }
+        }
+    }
+    return rgb;
+}
+
+// write the image at the given level and check that stb_image decodes exactly the same pixels
+bool roundTrip(const std::vector<uint8_t> & rgb, int width, int height, int level, ThreadPool & pool)
+{
+    const string filename = "01_test5_png.png";
+    if (!writePNG(filename, width, height, rgb.data(), level, pool))
+    {
+        warning("Could not write a %dx%d image at level %d!\n", width, height, level);
+        return false;
+    }
+
+    int w, h, n;
+    uint8_t * decoded = stbi_load(filename.c_str(), &w, &h, &n, 3);
+    std::remove(filename.c_str());
+    if (!decoded)
+    {
+        warning("Could not decode a %dx%d image at level %d: %s!\n", width, height, level, stbi_failure_reason());
+        return false;
+    }
+
+    bool same = w == width && h == height && n == 3 &&
+                std::equal(rgb.begin(), rgb.end(), decoded);
+    stbi_image_free(decoded);
+    if (!same)
+        warning("Decoded %dx%d image at level %d differs!\n", width, height, level);
+    return same;
+}
+
+} // namespace
+
+
+// writes PNG files of various sizes at all compression levels and decodes
+// them with stb_image, which has to give back exactly the original pixels
+int main(int argc, char** argv)
+{
+    message("Testing the PNG encoder...\n");
+
+    // single pixels, rows and columns, widths that do not divide the 256 KiB
+    // row groups, and images large enough to be split into several groups
+    const int sizes[][2] = {{1, 1}, {1, 300}, {7, 1}, {1001, 1}, {257, 129}, {1001, 300}, {2000, 333}};
+    const int levels[] = {0, 1, 2, 6, 9};
+
+    ThreadPool pool;
+    std::mt19937 rng(5);
+    int failures = 0, tests = 0;
+    for (auto size : sizes)
+    {
+        std::vector<uint8_t> rgb = makeImage(size[0], size[1], rng);
+        for (auto level : levels)
+        {
+            ++tests;
+            if (!roundTrip(rgb, size[0], size[1], level, pool))
+                ++failures;
+        }
+    }
+
+    message("%d of %d images decoded correctly\n\n", tests - failures, tests);
+    if (failures == 0)
+        message("Result correct!\n\n");
+    else
+        warning("Result incorrect!\n\n");
+
+    return 0;
+}
@@ -0,0 +1,84 @@
+/*
+This file is part of Dirt, the Dartmouth introductory ray tracer, used in
+Dartmouth's COSC 77/177 Computer Graphics course.
+
+Copyright (c) 2016 by Wojciech Jarosz
+
+Dirt is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License Version 3
+as published by the Free Software Foundation.
+
+Dirt is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "bbh.h"
+#include "scene.h"
+#include "sphere.h"
+#include <random>
+
+// builds a BBH over the same random spheres with 1 and with several threads
+// and checks that the resulting node arrays are identical
+int main(int argc, char** argv)
+{
+    message("Testing parallel BBH construction...\n");
+
+    Scene scene;
+    const int numSpheres = 100000;
+
+    auto build = [&](const string & splitMethod, int threads)
+    {
+        json j = {{"type", "bbh"}, {"splitMethod", splitMethod}, {"buildThreads", threads}};
+        BBH * bbh = new BBH(scene, j);
+
+        // same seed for every build, so every tree sees the same spheres
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<float> pos(-100.0f, 100.0f), rad(0.1f, 2.0f);
+        for (int i = 0; i < numSpheres; ++i)
+        {
+            json s = {{"radius", rad(rng)},
+                      {"transform", {{"o", {pos(rng), pos(rng), 0.1f * pos(rng)}}}}};
+            bbh->addSurface(new Sphere(scene, s));
+        }
+        bbh->build();
+        return bbh;
+    };
+
+    bool correct = true;
+    for (string method : {"sah", "middle", "equal"})
+    {
+        BBH * serial = build(method, 1);
+        BBH * parallel = build(method, 4);
+
+        bool same = serial->m_nodes.size() == parallel->m_nodes.size();
+        for (size_t i = 0; same && i < serial->m_nodes.size(); ++i)
+        {
+            const auto & a = serial->m_nodes[i];
+            const auto & b = parallel->m_nodes[i];
+            same = a.bounds.min() == b.bounds.min() && a.bounds.max() == b.bounds.max() &&
+                   a.nPrimitives == b.nPrimitives && a.axis == b.axis &&
+                   a.primitivesOffset == b.primitivesOffset;
+        }
+
+        if (same)
+            message("\"%s\": parallel tree matches serial tree (%d nodes)\n\n", method, serial->m_nodes.size());
+        else
+            warning("\"%s\": parallel tree differs from serial tree!\n\n", method);
+        correct = correct && same;
+
+        delete serial;
+        delete parallel;
+    }
+
+    if (correct)
+        message("Result correct!\n\n");
+    else
+        warning("Result incorrect!\n\n");
+
+    return 0;
+}
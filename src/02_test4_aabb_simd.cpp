@@ -0,0 +1,234 @@
+/*
+This file is part of Dirt, the Dartmouth introductory ray tracer, used in
+Dartmouth's COSC 77/177 Computer Graphics course.
+
+Copyright (c) 2016 by Wojciech Jarosz
+
+Dirt is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License Version 3
+as published by the Free Software Foundation.
+
+Dirt is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "bbh.h"
+#include "timer.h"
+#include <random>
+
+namespace
+{
+
+// hits of the prepared scalar test, used as the reference for the wide tests
+int scalarMask(const Box3f * boxes, int n, const PreparedRay & ray, float * tNear)
+{
+    int mask = 0;
+    for (auto i : range(n))
+    {
+        float minT = ray.mint, maxT = ray.maxt;
+        if (aabbIntersect(boxes[i], ray, minT, maxT))
+        {
+            mask |= 1 << i;
+            tNear[i] = minT;
+        }
+    }
+    return mask;
+}
+
+// rays that are parallel to some of the slabs, including ones that lie exactly on a slab plane
+bool testDegenerateRays()
+{
+    Box3f box(Vector3f(-1, -1, -1), Vector3f(1, 1, 1));
+    struct Case { Point3f o; Vector3f d; bool hit; float tNear; };
+    const Case cases[] =
+    {
+        {Point3f(0.5f, 0.5f, -5), Vector3f(0, 0, 1), true, 4.0f},
+        {Point3f(0.5f, 0.5f, -5), Vector3f(-0.0f, -0.0f, 1), true, 4.0f},
+        {Point3f(0.5f, 0.5f, 5), Vector3f(0, 0, -1), true, 4.0f},
+        {Point3f(1, 0.5f, -5), Vector3f(0, 0, 1), true, 4.0f},          // on the x = 1 plane
+        {Point3f(-1, -1, -5), Vector3f(-0.0f, 0, 1), true, 4.0f},       // on an edge
+        {Point3f(2, 0.5f, -5), Vector3f(0, 0, 1), false, 0.0f},
+        {Point3f(0.5f, -3, 0), Vector3f(0, 1, 0), true, 2.0f},
+        {Point3f(0.5f, -3, 0), Vector3f(0, -1, 0), false, 0.0f},        // points away
+    };
+
+    bool correct = true;
+    for (const Case & c : cases)
+    {
+        Ray3f ray(c.o, c.d);
+        PreparedRay pray(ray);
+
+        Box4f box4;
+        Box8f box8;
+        box4.set(2, box);
+        box8.set(5, box);
+        float tNear[8];
+
+        float minT = ray.mint, maxT = ray.maxt;
+        bool hit1 = aabbIntersect(box, pray, minT, maxT);
+        bool hit4 = aabbIntersect4(box4, pray, ray.maxt, tNear) == (c.hit ? 1 << 2 : 0);
+        float t4 = tNear[2];
+        bool hit8 = aabbIntersect8(box8, pray, ray.maxt, tNear) == (c.hit ? 1 << 5 : 0);
+        float t8 = tNear[5];
+
+        bool ok = hit1 == c.hit && hit4 && hit8 &&
+                  (!c.hit || (minT == c.tNear && t4 == c.tNear && t8 == c.tNear));
+        if (!ok)
+            warning("degenerate ray o = (%s), d = (%s) handled incorrectly\n",
+                    c.o.transpose(), c.d.transpose());
+        correct = correct && ok;
+    }
+    return correct;
+}
+
+} // namespace
+
+
+// compares the prepared scalar, 4-wide, and 8-wide slab tests against each
+// other and against aabbIntersect, and reports how long each of them takes
+int main(int argc, char** argv)
+{
+    message("Testing SIMD Ray - AABB intersection...\n");
+#if defined(DIRT_AVX)
+    message("8-wide test uses AVX\n");
+#elif defined(DIRT_SSE)
+    message("8-wide test uses 2x SSE\n");
+#else
+    message("SIMD tests use the portable fallback\n");
+#endif
+
+    bool correct = testDegenerateRays();
+
+    const int numBoxes = 4096;
+    const int numRays = 4096;
+
+    std::mt19937 rng(13);
+    std::uniform_real_distribution<float> pos(-10.0f, 10.0f), ext(0.05f, 3.0f), dir(-1.0f, 1.0f);
+
+    std::vector<Box3f> boxes(numBoxes);
+    std::vector<Box4f, AlignedAllocator<Box4f>> boxes4(numBoxes / 4);
+    std::vector<Box8f, AlignedAllocator<Box8f>> boxes8(numBoxes / 8);
+    for (auto i : range(numBoxes))
+    {
+        Vector3f c(pos(rng), pos(rng), pos(rng));
+        Vector3f e(ext(rng), ext(rng), ext(rng));
+        boxes[i] = Box3f(c - e, c + e);
+        boxes4[i / 4].set(i % 4, boxes[i]);
+        boxes8[i / 8].set(i % 8, boxes[i]);
+    }
+
+    std::vector<Ray3f> rays;
+    for (auto i : range(numRays))
+    {
+        Vector3f d(dir(rng), dir(rng), dir(rng));
+        // make some of the rays axis-aligned
+        if (i % 16 == 0)
+            d.x() = 0.0f;
+        if (i % 32 == 0)
+            d.y() = -0.0f;
+        rays.push_back(Ray3f(Point3f(pos(rng), pos(rng), pos(rng)), d.normalized(), 0.0f, 15.0f));
+    }
+
+    // correctness: the wide tests must agree exactly with the prepared scalar test
+    // and the scalar test must agree with aabbIntersect up to round-off
+    size_t mismatches = 0, legacyMismatches = 0;
+    for (const Ray3f & ray : rays)
+    {
+        PreparedRay pray(ray);
+        for (auto b : range(numBoxes / 8))
+        {
+            float tRef[8], t4[8], t8[8];
+            int ref = scalarMask(&boxes[8 * b], 8, pray, tRef);
+            int m4 = aabbIntersect4(boxes4[2 * b], pray, ray.maxt, t4) |
+                     (aabbIntersect4(boxes4[2 * b + 1], pray, ray.maxt, t4 + 4) << 4);
+            int m8 = aabbIntersect8(boxes8[b], pray, ray.maxt, t8);
+            if (m4 != ref || m8 != ref)
+                mismatches++;
+            for (auto i : range(8))
+                if ((ref & (1 << i)) && (t4[i] != tRef[i] || t8[i] != tRef[i]))
+                    mismatches++;
+
+            for (auto i : range(8))
+            {
+                float minT, maxT;
+                bool legacy = aabbIntersect(boxes[8 * b + i], ray, minT, maxT) &&
+                              minT <= ray.maxt && maxT >= ray.mint;
+                if (legacy != bool(ref & (1 << i)))
+                    legacyMismatches++;
+            }
+        }
+    }
+
+    // allow for grazing hits that round differently in the two formulations
+    size_t numTests = size_t(numRays) * numBoxes;
+    message("SIMD/scalar mismatches: %d, scalar/aabbIntersect mismatches: %d of %d tests\n",
+            mismatches, legacyMismatches, numTests);
+    correct = correct && mismatches == 0 && legacyMismatches * 100000 < numTests;
+
+    // timing
+    const int repeats = 4;
+    size_t hitsLegacy = 0, hitsScalar = 0, hits4 = 0, hits8 = 0;
+    Timer timer;
+    for (int r = 0; r < repeats; ++r)
+        for (const Ray3f & ray : rays)
+            for (const Box3f & box : boxes)
+            {
+                float minT, maxT;
+                if (aabbIntersect(box, ray, minT, maxT) && minT <= ray.maxt && maxT >= ray.mint)
+                    hitsLegacy++;
+            }
+    double tLegacy = timer.lap();
+
+    for (int r = 0; r < repeats; ++r)
+        for (const Ray3f & ray : rays)
+        {
+            PreparedRay pray(ray);
+            for (const Box3f & box : boxes)
+            {
+                float minT = pray.mint, maxT = pray.maxt;
+                if (aabbIntersect(box, pray, minT, maxT))
+                    hitsScalar++;
+            }
+        }
+    double tScalar = timer.lap();
+
+    for (int r = 0; r < repeats; ++r)
+        for (const Ray3f & ray : rays)
+        {
+            PreparedRay pray(ray);
+            float tNear[4];
+            for (const Box4f & box : boxes4)
+                hits4 += __builtin_popcount(aabbIntersect4(box, pray, pray.maxt, tNear));
+        }
+    double t4 = timer.lap();
+
+    for (int r = 0; r < repeats; ++r)
+        for (const Ray3f & ray : rays)
+        {
+            PreparedRay pray(ray);
+            float tNear[8];
+            for (const Box8f & box : boxes8)
+                hits8 += __builtin_popcount(aabbIntersect8(box, pray, pray.maxt, tNear));
+        }
+    double t8 = timer.lap();
+
+    double ns = 1e6 / (double(repeats) * numTests);
+    message("aabbIntersect:       %6.2f ns/box (%d hits)\n", tLegacy * ns, hitsLegacy);
+    message("prepared scalar:     %6.2f ns/box (%d hits)\n", tScalar * ns, hitsScalar);
+    message("aabbIntersect4:      %6.2f ns/box (%d hits)\n", t4 * ns, hits4);
+    message("aabbIntersect8:      %6.2f ns/box (%d hits)\n", t8 * ns, hits8);
+
+    correct = correct && hitsScalar == hits4 && hits4 == hits8;
+
+    if (correct)
+        message("Result correct!\n\n");
+    else
+        warning("Result incorrect!\n\n");
+
+    return 0;
+}
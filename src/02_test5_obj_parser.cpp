@@ -0,0 +1,235 @@
+/*
+This file is part of Dirt, the Dartmouth introductory ray tracer, used in
+Dartmouth's COSC 77/177 Computer Graphics course.
+
+Copyright (c) 2016 by Wojciech Jarosz
+
+Dirt is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License Version 3
+as published by the Free Software Foundation.
+
+Dirt is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "obj.h"
+#include "scene.h"
+#include <cstdio>
+#include <fstream>
+#include <random>
+
+// local functions
+namespace
+{
+
+// Write a grid of quads and triangles with positions, texture coordinates
+// and normals, large enough to be split into many parser chunks. With
+// relative = true, faces refer to their vertices with negative indices.
+void writeGrid(const string & filename, int n, bool relative)
+{
+    std::ofstream os(filename);
+    for (auto y : range(n))
+    {
+        for (auto x : range(n))
+        {
+            os << "v " << x * 0.1f << " " << y * 0.1f << " " << 0.001f * ((x * y) % 17) << "\n";
+            os << "vt " << float(x) / n << " " << float(y) / n << "\n";
+            os << "vn 0 0 1\n";
+        }
+    }
+    for (auto y : range(n - 1))
+    {
+        for (auto x : range(n - 1))
+        {
+            int c[4] = {y * n + x + 1, y * n + x + 2, (y + 1) * n + x + 2, (y + 1) * n + x + 1};
+            int numCorners = (x + y) % 2 ? 4 : 3;
+            os << "f";
+            for (auto k : range(numCorners))
+            {
+                int i = relative ? c[k] - n * n - 1 : c[k];
+                os << (k % 2 ? "\t" : " ") << i << "/" << i << "/" << i;
+            }
+            os << "\n";
+        }
+    }
+}
+
+WavefrontOBJ * load(const Scene & scene, const string & filename, const string & parser, bool compact = false)
+{
+    json j = {{"filename", filename}, {"parser", parser}, {"cache", false}, {"compact", compact}};
+    return new WavefrontOBJ(scene, j);
+}
+
+template <typename T>
+bool sameArray(const DataBuffer<T> & a, const DataBuffer<T> & b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (auto i : range(int(a.size())))
+        if (a[i] != b[i])
+            return false;
+    return true;
+}
+
+bool sameMesh(const Mesh & a, const Mesh & b)
+{
+    return sameArray(a.vertexPositions(), b.vertexPositions()) &&
+           sameArray(a.vertexNormals(), b.vertexNormals()) &&
+           sameArray(a.vertexTexCoords(), b.vertexTexCoords()) &&
+           sameArray(a.faceIndices(), b.faceIndices());
+}
+
+// compact storage has to give the same faces, and normals and texture coordinates within quantization error
+bool similarMesh(const Mesh & a, const Mesh & compact)
+{
+    if (a.numPrimitives() != compact.numPrimitives() || a.numVertices() != compact.numVertices() ||
+        !compact.faceIndices().empty() || !compact.vertexNormals().empty() || !compact.vertexTexCoords().empty())
+        return false;
+    for (auto i : range(int(a.numPrimitives())))
+        if (a.face(i) != compact.face(i))
+            return false;
+    for (auto i : range(int(a.numVertices())))
+    {
+        Normal3f n = a.normal(i).normalized(), nc = compact.normal(i).normalized();
+        if ((n - nc).norm() > 1e-4f || (a.texCoord(i) - compact.texCoord(i)).cwiseAbs().maxCoeff() > 1e-4f)
+            return false;
+    }
+    return compact.memoryUsage() < a.memoryUsage();
+}
+
+// the closest hit of ray with any triangle of mesh
+bool closestHit(const Mesh & mesh, Ray3f ray, Intersection3f & its)
+{
+    bool hit = false;
+    for (auto i : range(int(mesh.numPrimitives())))
+    {
+        if (mesh.intersect(i, ray, its))
+        {
+            hit = true;
+            ray.maxt = its.t;
+        }
+    }
+    return hit;
+}
+
+// rays cast down onto the grid of n x n vertices written by writeGrid have to
+// hit the same points with and without compact storage, with the same
+// interpolated texture coordinates and shading normals up to quantization error
+bool similarHits(const Mesh & a, const Mesh & compact, int n)
+{
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<float> pos(0.0f, (n - 1) * 0.1f);
+    for (int i = 0; i < 200; ++i)
+    {
+        Ray3f ray(Point3f(pos(rng), pos(rng), 5.0f), Vector3f(0.0f, 0.0f, -1.0f));
+        Intersection3f its, itsCompact;
+        // every other grid cell is a single triangle, so some rays miss
+        bool hit = closestHit(a, ray, its);
+        if (hit != closestHit(compact, ray, itsCompact))
+            return false;
+        if (!hit)
+            continue;
+        if (its.t != itsCompact.t || (its.uv - itsCompact.uv).cwiseAbs().maxCoeff() > 1e-4f ||
+            (its.sn - itsCompact.sn).norm() > 1e-4f)
+            return false;
+
+        // the grid's texture coordinates are its positions scaled to [0,1)
+        if ((its.uv - Point2f(its.p.x(), its.p.y()) / (n * 0.1f)).cwiseAbs().maxCoeff() > 1e-3f)
+            return false;
+    }
+    return true;
+}
+
+} // namespace
+
+// loads the same OBJ geometry with the stream parser and with the parallel
+// parser, using absolute as well as relative (negative) indices, and checks
+// that all resulting mesh arrays are identical; then checks compact storage
+// against full-precision storage
+int main(int argc, char** argv)
+{
+    message("Testing the OBJ parsers...\n");
+
+    Scene scene;
+    const string absoluteFile = "02_test5_absolute.obj", relativeFile = "02_test5_relative.obj";
+    const string polygonFile = "02_test5_polygon.obj", digitsFile = "02_test5_digits.obj";
+    writeGrid(absoluteFile, 200, false);
+    writeGrid(relativeFile, 200, true);
+    {
+        std::ofstream os(polygonFile);
+        os << "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0.5 1.5 0\nv 0 1 0\nf -5 -4 -3 -2 -1\n";
+    }
+    {
+        // long mantissas and exponents, which a naive decimal conversion rounds differently than strtof
+        std::ofstream os(digitsFile);
+        os << "v 1.00000661611557 -1.99999994039535522 0.333333333333333333333\n"
+              "v 123.456789 16777217 2.5e-3\n"
+              "v 1e-12 -7.000000 12345678.9e10\n"
+              "f 1 2 3\n";
+    }
+
+    WavefrontOBJ * reference = load(scene, absoluteFile, "stream");
+    WavefrontOBJ * absolute = load(scene, absoluteFile, "parallel");
+    WavefrontOBJ * relative = load(scene, relativeFile, "parallel");
+    WavefrontOBJ * polygon = load(scene, polygonFile, "parallel");
+    WavefrontOBJ * compact = load(scene, absoluteFile, "parallel", true);
+    WavefrontOBJ * digitsReference = load(scene, digitsFile, "stream");
+    WavefrontOBJ * digits = load(scene, digitsFile, "parallel");
+
+    bool correct = true;
+    if (!sameMesh(*reference, *absolute))
+    {
+        warning("Parallel parser differs from stream parser!\n\n");
+        correct = false;
+    }
+    if (!sameMesh(*digitsReference, *digits))
+    {
+        warning("Parallel parser converts long numbers differently than stream parser!\n\n");
+        correct = false;
+    }
+    if (!sameMesh(*reference, *relative))
+    {
+        warning("Relative indices give a different mesh than absolute indices!\n\n");
+        correct = false;
+    }
+    if (!similarMesh(*reference, *compact))
+    {
+        warning("Compact storage differs from full-precision storage!\n\n");
+        correct = false;
+    }
+    if (!similarHits(*reference, *compact, 200))
+    {
+        warning("Hits with compact storage differ from hits with full-precision storage!\n\n");
+        correct = false;
+    }
+    if (polygon->numPrimitives() != 3 || polygon->numVertices() != 5)
+    {
+        warning("Pentagon split into %d triangles with %d vertices (should be 3 and 5)!\n\n",
+                polygon->numPrimitives(), polygon->numVertices());
+        correct = false;
+    }
+
+    delete reference;
+    delete absolute;
+    delete relative;
+    delete polygon;
+    delete compact;
+    delete digitsReference;
+    delete digits;
+    std::remove(absoluteFile.c_str());
+    std::remove(relativeFile.c_str());
+    std::remove(polygonFile.c_str());
+    std::remove(digitsFile.c_str());
+
+    if (correct)
+        message("Result correct!\n\n");
+    else
+        warning("Result incorrect!\n\n");
+
+    return 0;
+}
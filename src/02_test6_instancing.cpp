@@ -0,0 +1,79 @@
+/*
+This file is part of Dirt, the Dartmouth introductory ray tracer, used in
+Dartmouth's COSC 77/177 Computer Graphics course.
+
+Copyright (c) 2016 by Wojciech Jarosz
+
+Dirt is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License Version 3
+as published by the Free Software Foundation.
+
+Dirt is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "scene.h"
+#include <random>
+
+// traces random rays through a scene of instanced quads and spheres and
+// through the same scene built from standalone surfaces, and checks that
+// both find the same hits; the quad prototype uses its own accelerator
+int main(int argc, char** argv)
+{
+    message("Testing instancing...\n");
+
+    json prototypes = json::array({
+        {{"name", "ball"}, {"type", "sphere"}, {"radius", 0.5f}},
+        {{"name", "tile"}, {"type", "quad"}, {"width", 0.6f}, {"accelerator", {{"type", "bvh4"}}}}
+    });
+
+    json flat = json::array(), instanced = json::array();
+    std::mt19937 rng(11);
+    std::uniform_real_distribution<float> pos(-5.0f, 5.0f), angle(0.0f, 360.0f), scale(0.5f, 2.0f);
+    for (auto i : range(200))
+    {
+        json xform = json::array({{{"scale", scale(rng)}},
+                                  {{"axis", {pos(rng), pos(rng), pos(rng)}}, {"angle", angle(rng)}},
+                                  {{"translate", {pos(rng), pos(rng), pos(rng)}}}});
+        json surface = i % 2 ? json(prototypes[1]) : json(prototypes[0]);
+        surface.erase("name");
+        surface.erase("accelerator");
+        surface["transform"] = xform;
+        flat.push_back(surface);
+        instanced.push_back({{"type", "instance"}, {"prototype", i % 2 ? "tile" : "ball"}, {"transform", xform}});
+    }
+
+    json camera = {{"transform", {{"o", {0, 0, 10}}}}};
+    Scene flatScene(json{{"camera", camera}, {"accelerator", {{"type", "bbh"}}}, {"surfaces", flat}});
+    Scene instancedScene(json{{"camera", camera}, {"accelerator", {{"type", "bbh"}}},
+                              {"prototypes", prototypes}, {"surfaces", instanced}});
+
+    int numRays = 20000, mismatches = 0, hits = 0;
+    std::uniform_real_distribution<float> dir(-1.0f, 1.0f);
+    for (int i = 0; i < numRays; ++i)
+    {
+        Ray3f ray(Point3f(pos(rng), pos(rng), pos(rng)), Vector3f(dir(rng), dir(rng), dir(rng)).normalized());
+        Intersection3f a, b;
+        bool hitA = flatScene.intersect(ray, a), hitB = instancedScene.intersect(ray, b);
+        bool occA = flatScene.occluded(ray), occB = instancedScene.occluded(ray);
+        hits += hitA;
+        // rays grazing an edge may legitimately hit in one scene and miss in the other
+        if (hitA != hitB || occA != occB ||
+            (hitA && (std::abs(a.t - b.t) > 1e-3f * max(1.0f, a.t) || (a.p - b.p).norm() > 1e-3f * max(1.0f, a.t) ||
+                      (a.gn - b.gn).norm() > 1e-3f)))
+            ++mismatches;
+    }
+
+    message("%d of %d rays hit, %d differ\n\n", hits, numRays, mismatches);
+    if (hits > 0 && mismatches <= numRays / 1000)
+        message("Result correct!\n\n");
+    else
+        warning("Result incorrect!\n\n");
+
+    return 0;
+}
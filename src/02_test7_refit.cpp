@@ -0,0 +1,131 @@
+/*
+This file is part of Dirt, the Dartmouth introductory ray tracer, used in
+Dartmouth's COSC 77/177 Computer Graphics course.
+
+Copyright (c) 2016 by Wojciech Jarosz
+
+Dirt is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License Version 3
+as published by the Free Software Foundation.
+
+Dirt is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "scene.h"
+#include <random>
+
+// moves the surfaces of scenes with different acceleration structures over
+// several frames, refitting instead of rebuilding, and checks that random
+// rays find the same hits as with the naive accelerator; before that, checks
+// that the flattened and the pointer BBH do the same work per ray
+int main(int argc, char** argv)
+{
+    message("Testing acceleration structure refitting...\n");
+
+    json surfaces = json::array();
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> pos(-5.0f, 5.0f), angle(0.0f, 360.0f);
+    for (auto i : range(300))
+    {
+        json surface = i % 2 ? json{{"type", "quad"}, {"width", 0.3f}} : json{{"type", "sphere"}, {"radius", 0.15f}};
+        surface["transform"] = json::array({{{"axis", {pos(rng), pos(rng), pos(rng)}}, {"angle", angle(rng)}},
+                                            {{"translate", {pos(rng), pos(rng), pos(rng)}}}});
+        surfaces.push_back(surface);
+    }
+
+    // rebuildThreshold 0 only refits, the default also rebuilds the subtrees that degrade
+    std::vector<json> accelerators = {
+        {{"type", "bbh"}, {"rebuildThreshold", 0}},
+        {{"type", "bbh"}},
+        {{"type", "bbh"}, {"flatten", false}},
+        {{"type", "bvh4"}},
+        {{"type", "bvh8"}}
+    };
+    json camera = {{"transform", {{"o", {0, 0, 10}}}}};
+    Scene reference(json{{"camera", camera}, {"surfaces", surfaces}});
+    std::vector<std::unique_ptr<Scene>> scenes;
+    for (auto & accelerator : accelerators)
+        scenes.emplace_back(new Scene(json{{"camera", camera}, {"accelerator", accelerator}, {"surfaces", surfaces}}));
+
+    int numRays = 5000, mismatches = 0, hits = 0;
+    std::uniform_real_distribution<float> dir(-1.0f, 1.0f), move(-1.0f, 1.0f);
+
+    // the same tree traversed flattened and recursively; middle splits leave
+    // several primitives per leaf, whose own bounds both have to test
+    Scene flattened(json{{"camera", camera}, {"accelerator", {{"type", "bbh"}, {"splitMethod", "middle"}}},
+                         {"surfaces", surfaces}});
+    Scene pointers(json{{"camera", camera},
+                        {"accelerator", {{"type", "bbh"}, {"splitMethod", "middle"}, {"flatten", false}}},
+                        {"surfaces", surfaces}});
+    RayStats linear, recursive;
+    for (int i = 0; i < numRays; ++i)
+    {
+        Ray3f ray(Point3f(pos(rng), pos(rng), pos(rng)), Vector3f(dir(rng), dir(rng), dir(rng)).normalized());
+        Intersection3f its;
+        RayStats before = rayStats;
+        flattened.intersect(ray, its);
+        flattened.occluded(ray);
+        linear += rayStats - before;
+        before = rayStats;
+        pointers.intersect(ray, its);
+        pointers.occluded(ray);
+        recursive += rayStats - before;
+    }
+    if (linear.primitivesIntersected != recursive.primitivesIntersected ||
+        linear.nodesVisited != recursive.nodesVisited ||
+        linear.shadowPrimitivesTested != recursive.shadowPrimitivesTested ||
+        linear.shadowNodesVisited != recursive.shadowNodesVisited)
+    {
+        warning("Flattened BBH intersected %d primitives in %d nodes, the pointer BBH %d in %d!\n",
+                linear.primitivesIntersected, linear.nodesVisited,
+                recursive.primitivesIntersected, recursive.nodesVisited);
+        ++mismatches;
+    }
+    for (auto frame : range(4))
+    {
+        // scatter the surfaces a bit further every frame, so the original trees degrade
+        std::vector<Transform> offsets;
+        for (size_t i = 0; i < reference.surfaces().size(); ++i)
+            offsets.push_back(Transform(Eigen::Affine3f(Eigen::Translation3f(
+                (frame + 1) * Vector3f(move(rng), move(rng), move(rng)))).matrix()));
+
+        for (auto i : range(int(offsets.size())))
+        {
+            reference.surfaces()[i]->setTransform(offsets[i] * reference.surfaces()[i]->transform());
+            for (auto & scene : scenes)
+                scene->surfaces()[i]->setTransform(offsets[i] * scene->surfaces()[i]->transform());
+        }
+        reference.refitAccelerator();
+        for (auto & scene : scenes)
+            scene->refitAccelerator();
+
+        for (int i = 0; i < numRays; ++i)
+        {
+            Ray3f ray(Point3f(pos(rng), pos(rng), pos(rng)), Vector3f(dir(rng), dir(rng), dir(rng)).normalized());
+            Intersection3f a;
+            bool hitA = reference.intersect(ray, a), occA = reference.occluded(ray);
+            hits += hitA;
+            for (auto & scene : scenes)
+            {
+                Intersection3f b;
+                bool hitB = scene->intersect(ray, b), occB = scene->occluded(ray);
+                if (hitA != hitB || occA != occB || (hitA && (std::abs(a.t - b.t) > 1e-5f * max(1.0f, a.t))))
+                    ++mismatches;
+            }
+        }
+    }
+
+    message("%d of %d rays hit, %d differ\n\n", hits, 4 * numRays, mismatches);
+    if (hits > 0 && mismatches == 0)
+        message("Result correct!\n\n");
+    else
+        warning("Result incorrect!\n\n");
+
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+This file is part of Dirt, the Dartmouth introductory ray tracer, used in
+Dartmouth's COSC 77/177 Computer Graphics course.
+
+Copyright (c) 2016 by Wojciech Jarosz
+
+Dirt is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License Version 3
+as published by the Free Software Foundation.
+
+Dirt is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "bbh.h"
+#include "scene.h"
+#include "sphere.h"
+#include <random>
+
+// depth of every node of a flattened BBH
+static std::vector<int> nodeDepths(const BBH & bbh)
+{
+    std::vector<int> depth(bbh.m_nodes.size(), 0);
+    for (auto i : range(int(bbh.m_nodes.size())))
+        if (bbh.m_nodes[i].nPrimitives == 0)
+            depth[i + 1] = depth[bbh.m_nodes[i].secondChildOffset] = depth[i] + 1;
+    return depth;
+}
+
+// builds BBHs over spheres that shrink and cluster geometrically towards the
+// origin, where every split-middle split peels off a single sphere, and
+// checks that the trees, also after rebuilding a deep subtree, stay within
+// the traversal stacks and find the same hits as the naive accelerator
+int main(int argc, char** argv)
+{
+    message("Testing BBH depth on clustered primitives...\n");
+
+    Scene scene;
+
+    // accelerators own their surfaces, so every one gets its own spheres
+    auto addSpheres = [&](Accelerator & accelerator)
+    {
+        for (auto i : range(140))
+        {
+            float x = std::ldexp(1.0f, -i);
+            accelerator.addSurface(new Sphere(scene, json{{"radius", 0.25f * x}, {"transform", {{"o", {x, x, 0.0f}}}}}));
+        }
+        accelerator.build();
+    };
+
+    Accelerator naive(scene);
+    addSpheres(naive);
+
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> pos(-3.0f, 3.0f), dir(-1.0f, 1.0f);
+    std::vector<Ray3f> rays;
+    for (int r = 0; r < 10000; ++r)
+    {
+        // aim at the largest spheres
+        Point3f o(pos(rng), pos(rng), pos(rng));
+        Point3f target(std::ldexp(1.0f, -(r % 4)), std::ldexp(1.0f, -(r % 4)), 0.0f);
+        rays.push_back(Ray3f(o, (target + 0.1f * std::ldexp(1.0f, -(r % 4)) * Vector3f(dir(rng), dir(rng), dir(rng)) - o).normalized()));
+    }
+
+    // the tree matches the depth limit and the hits of the naive accelerator
+    auto check = [&](const BBH & bbh, const string & name)
+    {
+        std::vector<int> depths = nodeDepths(bbh);
+        int depth = *std::max_element(depths.begin(), depths.end()), mismatches = 0, hits = 0;
+        for (auto & ray : rays)
+        {
+            HitRecord a, b;
+            bool hitA = naive.findHit(ray, a), hitB = bbh.findHit(ray, b);
+            hits += hitA;
+            if (hitA != hitB || naive.occluded(ray) != bbh.occluded(ray) ||
+                (hitA && std::abs(a.t - b.t) > 1e-5f * max(1.0f, a.t)))
+                ++mismatches;
+        }
+        message("%s: depth %d, %d of %d rays hit, %d differ\n", name, depth, hits, rays.size(), mismatches);
+        return depth <= BBH::maxTreeDepth && hits > 0 && mismatches == 0;
+    };
+
+    bool correct = true;
+    for (string method : {"sah", "middle", "equal"})
+    {
+        BBH bbh(scene, json{{"type", "bbh"}, {"splitMethod", method}, {"maxPrimsInNode", 1}});
+        addSpheres(bbh);
+        correct = check(bbh, "\"" + method + "\"") && correct;
+    }
+
+    // rebuild the first subtree that is as deep as the split methods go
+    {
+        BBH bbh(scene, json{{"type", "bbh"}, {"splitMethod", "middle"}, {"maxPrimsInNode", 1}});
+        addSpheres(bbh);
+        std::vector<float> cost;
+        std::vector<uint32_t> subtreeSize;
+        bbh.refitNodes(cost, subtreeSize);
+        std::vector<int> depths = nodeDepths(bbh);
+        for (auto i : range(int(depths.size())))
+            if (depths[i] == BBH::maxSplitDepth && bbh.m_nodes[i].nPrimitives == 0)
+            {
+                bbh.rebuildSubtrees({uint32_t(i)}, subtreeSize);
+                break;
+            }
+        correct = check(bbh, "rebuilt \"middle\"") && correct;
+    }
+
+    if (correct)
+        message("Result correct!\n\n");
+    else
+        warning("Result incorrect!\n\n");
+
+    return 0;
+}
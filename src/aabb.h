@@ -0,0 +1,216 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer, used in
+    Dartmouth's COSC 77/177 Computer Graphics course.
+
+    Copyright (c) 2016 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common.h"
+#include "vector.h"
+#include "box.h"
+#include "ray.h"
+#include "simd.h"
+#include <cmath>
+#include <limits>
+
+
+//! Ray data that slab tests need, computed once per ray
+/*!
+    Holds the reciprocal of the (unnormalized) direction and the sign of each
+    of its components. A zero component gives an infinite reciprocal with the
+    sign of the zero, so the ray is parallel to that pair of slabs. The slab
+    tests below order their min/max operations so that the NaN produced when
+    such a ray lies exactly on a slab plane (0 * inf) is ignored rather than
+    propagated.
+*/
+struct PreparedRay
+{
+    Point3f o;              //!< ray origin
+    Vector3f invDir;        //!< component-wise reciprocal of the ray direction
+    int dirIsNeg[3];        //!< 1 if the direction component is negative (or -0)
+    float mint;             //!< start of the ray segment
+    float maxt;             //!< end of the ray segment
+
+    PreparedRay() = default;
+
+    PreparedRay(const Ray3f & ray) :
+        o(ray.o), invDir(1.0f / ray.d.x(), 1.0f / ray.d.y(), 1.0f / ray.d.z()),
+        mint(ray.mint), maxt(ray.maxt)
+    {
+        for (auto i : range(3))
+            dirIsNeg[i] = std::signbit(ray.d[i]) ? 1 : 0;
+    }
+};
+
+
+//! Ray-AABB slab test using a \ref PreparedRay
+/*!
+    \param minT, maxT
+        On input the ray interval to consider, on output the part of it that
+        lies within the box.
+    \return \c true if the interval overlaps the box
+*/
+inline bool aabbIntersect(const Box3f & bounds, const PreparedRay & ray, float & minT, float & maxT)
+{
+    for (auto i : range(3))
+    {
+        float t0 = (bounds[ray.dirIsNeg[i]][i] - ray.o[i]) * ray.invDir[i];
+        float t1 = (bounds[1 - ray.dirIsNeg[i]][i] - ray.o[i]) * ray.invDir[i];
+        // written so that a NaN t0 or t1 leaves the interval unchanged
+        minT = t0 > minT ? t0 : minT;
+        maxT = t1 < maxT ? t1 : maxT;
+    }
+    return minT <= maxT;
+}
+
+
+//! Bounding boxes of N children stored as a structure of arrays
+/*!
+    bounds[0] holds the minimum and bounds[1] the maximum corner, each as one
+    array of N lanes per axis, so a single SIMD slab test covers all boxes.
+    Unused lanes hold an empty (inverted) box that no ray can hit.
+*/
+template <int N>
+struct alignas(N * sizeof(float)) BoxN
+{
+    float bounds[2][3][N];
+
+    BoxN()
+    {
+        for (auto i : range(N))
+            setEmpty(i);
+    }
+
+    void set(int i, const Box3f & box)
+    {
+        for (auto a : range(3))
+        {
+            bounds[0][a][i] = box.min()[a];
+            bounds[1][a][i] = box.max()[a];
+        }
+    }
+
+    void setEmpty(int i)
+    {
+        for (auto a : range(3))
+        {
+            bounds[0][a][i] = std::numeric_limits<float>::infinity();
+            bounds[1][a][i] = -std::numeric_limits<float>::infinity();
+        }
+    }
+
+    Box3f get(int i) const
+    {
+        return Box3f(Vector3f(bounds[0][0][i], bounds[0][1][i], bounds[0][2][i]),
+                     Vector3f(bounds[1][0][i], bounds[1][1][i], bounds[1][2][i]));
+    }
+};
+
+typedef BoxN<4> Box4f;
+typedef BoxN<8> Box8f;
+
+
+//! Portable slab test of all N boxes against the interval [ray.mint, maxt]
+/*!
+    \param tNear
+        Receives the entry distance for every box
+    \return A bit mask with bit i set if box i is hit
+*/
+template <int N>
+inline int aabbIntersectN(const BoxN<N> & boxes, const PreparedRay & ray, float maxt, float * tNear)
+{
+    int mask = 0;
+    for (auto i : range(N))
+    {
+        float t0 = ray.mint, t1 = maxt;
+        for (auto a : range(3))
+        {
+            float n = (boxes.bounds[ray.dirIsNeg[a]][a][i] - ray.o[a]) * ray.invDir[a];
+            float f = (boxes.bounds[1 - ray.dirIsNeg[a]][a][i] - ray.o[a]) * ray.invDir[a];
+            t0 = n > t0 ? n : t0;
+            t1 = f < t1 ? f : t1;
+        }
+        tNear[i] = t0;
+        if (t0 <= t1)
+            mask |= 1 << i;
+    }
+    return mask;
+}
+
+//! Test a ray against 4 boxes at once (SSE when available)
+inline int aabbIntersect4(const Box4f & boxes, const PreparedRay & ray, float maxt, float * tNear)
+{
+#if defined(DIRT_SSE)
+    __m128 tmin = _mm_set1_ps(ray.mint);
+    __m128 tmax = _mm_set1_ps(maxt);
+    for (auto a : range(3))
+    {
+        __m128 o = _mm_set1_ps(ray.o[a]);
+        __m128 inv = _mm_set1_ps(ray.invDir[a]);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(boxes.bounds[ray.dirIsNeg[a]][a]), o), inv);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(boxes.bounds[1 - ray.dirIsNeg[a]][a]), o), inv);
+        // minps/maxps return the second operand if either is NaN
+        tmin = _mm_max_ps(t0, tmin);
+        tmax = _mm_min_ps(t1, tmax);
+    }
+    _mm_storeu_ps(tNear, tmin);
+    return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+#else
+    return aabbIntersectN<4>(boxes, ray, maxt, tNear);
+#endif
+}
+
+//! Test a ray against 8 boxes at once (AVX when available, otherwise SSE or scalar)
+inline int aabbIntersect8(const Box8f & boxes, const PreparedRay & ray, float maxt, float * tNear)
+{
+#if defined(DIRT_AVX)
+    __m256 tmin = _mm256_set1_ps(ray.mint);
+    __m256 tmax = _mm256_set1_ps(maxt);
+    for (auto a : range(3))
+    {
+        __m256 o = _mm256_set1_ps(ray.o[a]);
+        __m256 inv = _mm256_set1_ps(ray.invDir[a]);
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(boxes.bounds[ray.dirIsNeg[a]][a]), o), inv);
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(boxes.bounds[1 - ray.dirIsNeg[a]][a]), o), inv);
+        tmin = _mm256_max_ps(t0, tmin);
+        tmax = _mm256_min_ps(t1, tmax);
+    }
+    _mm256_storeu_ps(tNear, tmin);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ));
+#elif defined(DIRT_SSE)
+    int mask = 0;
+    for (int half = 0; half < 2; ++half)
+    {
+        __m128 tmin = _mm_set1_ps(ray.mint);
+        __m128 tmax = _mm_set1_ps(maxt);
+        for (auto a : range(3))
+        {
+            __m128 o = _mm_set1_ps(ray.o[a]);
+            __m128 inv = _mm_set1_ps(ray.invDir[a]);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(boxes.bounds[ray.dirIsNeg[a]][a] + 4*half), o), inv);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(boxes.bounds[1 - ray.dirIsNeg[a]][a] + 4*half), o), inv);
+            tmin = _mm_max_ps(t0, tmin);
+            tmax = _mm_min_ps(t1, tmax);
+        }
+        _mm_storeu_ps(tNear + 4*half, tmin);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) << (4*half);
+    }
+    return mask;
+#else
+    return aabbIntersectN<8>(boxes, ray, maxt, tNear);
+#endif
+}
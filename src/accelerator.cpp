@@ -25,7 +25,26 @@ void Accelerator::addSurface(Surface *surface)
 
     // add all the primitives within surface to the list of primitives
     for (int prim : range(surface->numPrimitives()))
+    {
         m_primitives.push_back(new Primitive(surface, prim));
+        m_primBounds.push_back(surface->worldBBox(prim));
+    }
+}
+
+void Accelerator::permutePrimitives(const std::vector<uint32_t> & order)
+{
+    std::vector<Primitive *> primitives(order.size());
+    BoundsTable bounds;
+    bounds.bounds.resize(order.size());
+    bounds.centroids.resize(order.size());
+    for (auto i : range(int(order.size())))
+    {
+        primitives[i] = m_primitives[order[i]];
+        bounds.bounds[i] = m_primBounds.bounds[order[i]];
+        bounds.centroids[i] = m_primBounds.centroids[order[i]];
+    }
+    m_primitives.swap(primitives);
+    std::swap(m_primBounds, bounds);
 }
 
 void Accelerator::clear()
@@ -39,6 +58,7 @@ void Accelerator::clear()
         delete primitive;
     m_primitives.clear();
     m_primitives.shrink_to_fit();
+    m_primBounds.clear();
 }
 
 void Accelerator::build()
@@ -46,7 +66,16 @@ void Accelerator::build()
     // nothing to do here for naive accelerator
 }
 
-bool Accelerator::intersect(const Ray3f & _ray, Intersection3f & its) const
+void Accelerator::refit()
+{
+    for (auto i : range(int(m_primitives.size())))
+    {
+        m_primBounds.bounds[i] = m_primitives[i]->worldBBox();
+        m_primBounds.centroids[i] = m_primBounds.bounds[i].center();
+    }
+}
+
+bool Accelerator::findHit(const Ray3f & _ray, HitRecord & hit) const
 {
     // copy the ray so we can modify the tmax values as we traverse
     Ray3f ray = _ray;
@@ -58,13 +87,31 @@ bool Accelerator::intersect(const Ray3f & _ray, Intersection3f & its) const
     // foreach primitive
     for (auto primitive : m_primitives)
     {
-        if (primitive->intersect(ray, its))
+        if (primitive->findHit(ray, hit))
         {
             hitSomething = true;
-            ray.maxt = its.t;
+            ray.maxt = hit.t;
         }
     }
 
-    // record closest intersection
     return hitSomething;
 }
+
+bool Accelerator::occluded(const Ray3f & ray) const
+{
+    for (auto primitive : m_primitives)
+        if (primitive->occluded(ray))
+            return true;
+    return false;
+}
+
+uint64_t Accelerator::intersectPacket(const Ray3f * rays, int n, Intersection3f * its) const
+{
+    if (n > maxPacketRays)
+        throw DirtException("Packets hold at most %d rays, not %d.", maxPacketRays, n);
+    uint64_t mask = 0;
+    for (auto i : range(n))
+        if (intersect(rays[i], its[i]))
+            mask |= uint64_t(1) << i;
+    return mask;
+}
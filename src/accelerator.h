@@ -54,6 +54,14 @@ public:
     //! Build the acceleration structure.
     virtual void build();
 
+    //! Update the acceleration structure after its surfaces moved or deformed
+    /*!
+        The surfaces must still have the same number of primitives. The base
+        class recomputes the cached primitive bounds; trees then refit their
+        node bounds instead of rebuilding.
+    */
+    virtual void refit();
+
     //! Intersect a ray against all surfaces registered with the Accelerator
     /*!
         Detailed information about the intersection, if any, will be stored
@@ -61,7 +69,41 @@ public:
 
         \return \c true If an intersection was found
     */
-    virtual bool intersect(const Ray3f & ray, Intersection3f & its) const;
+    bool intersect(const Ray3f & ray, Intersection3f & its) const
+    {
+        HitRecord hit;
+        if (!findHit(ray, hit))
+            return false;
+
+        // only the closest hit needs a full intersection record
+        hit.surface->computeHitDetails(ray, hit, its);
+        return true;
+    }
+
+    //! Find the closest hit without computing its intersection record
+    /*!
+        Acceleration structures implement this; \ref intersect() completes
+        the record of the hit found.
+    */
+    virtual bool findHit(const Ray3f & ray, HitRecord & hit) const;
+
+    //! Return whether any surface blocks the ray within [ray.mint, ray.maxt]
+    /*!
+        Unlike \ref intersect(), this stops at the first hit found and does not
+        compute an intersection record, which is all shadow rays need.
+    */
+    virtual bool occluded(const Ray3f & ray) const;
+
+    static constexpr int maxPacketRays = 64;    //!< number of bits in the mask returned by intersectPacket()
+
+    //! Intersect a packet of up to \ref maxPacketRays coherent rays
+    /*!
+        Fills in its[i] for every ray that hits something and returns a bit
+        mask of those rays. The result is identical to calling \ref intersect()
+        on each ray, which is what the default implementation does. Throws a
+        DirtException for packets of more than \ref maxPacketRays rays.
+    */
+    virtual uint64_t intersectPacket(const Ray3f * rays, int n, Intersection3f * its) const;
 
 protected:
 
@@ -85,8 +127,69 @@ protected:
         {
             return surface->intersect(primitiveIndex, ray, its);
         }
+
+        //! Test whether the ray hits the specific primitive in surface
+        bool occluded(const Ray3f & ray) const
+        {
+            return surface->occluded(primitiveIndex, ray);
+        }
+
+        //! Find the hit with the specific primitive, without computing an intersection record
+        bool findHit(const Ray3f & ray, HitRecord & hit) const
+        {
+            return surface->findHit(primitiveIndex, ray, hit);
+        }
+    };
+
+    //! Test primitive \a i during traversal
+    /*!
+        For closest-hit queries (\a AnyHit false), records the hit in \a hit
+        and shrinks ray.maxt to it. Any-hit queries only answer whether the
+        primitive blocks the ray.
+    */
+    template <bool AnyHit>
+    bool hitPrimitive(uint32_t i, Ray3f & ray, HitRecord & hit) const
+    {
+        if (AnyHit)
+            return m_primitives[i]->occluded(ray);
+        if (!m_primitives[i]->findHit(ray, hit))
+            return false;
+        ray.maxt = hit.t;
+        return true;
+    }
+
+    //! World-space bounds and centroids of all primitives
+    /*!
+        Computed once when a surface is added, and stored as a structure of
+        arrays indexed like \ref m_primitives, so that builders and traversal
+        never recompute primitive bounds.
+    */
+    struct BoundsTable
+    {
+        std::vector<Box3f> bounds;          //!< world-space bounding box of each primitive
+        std::vector<Point3f> centroids;     //!< center of each bounding box
+
+        size_t size() const { return bounds.size(); }
+
+        void push_back(const Box3f & b)
+        {
+            bounds.push_back(b);
+            centroids.push_back(b.center());
+        }
+
+        void clear()
+        {
+            bounds.clear();
+            bounds.shrink_to_fit();
+            centroids.clear();
+            centroids.shrink_to_fit();
+        }
     };
 
+    //! Reorder \ref m_primitives and \ref m_primBounds so that entry i becomes the old entry order[i]
+    void permutePrimitives(const std::vector<uint32_t> & order);
+
     std::vector<Surface *> m_surfaces;      //!< All surfaces registered with the Accelerator
     std::vector<Primitive *> m_primitives;  //!< All primitives registered with the Accelerator
+    BoundsTable m_primBounds;               //!< Cached world-space bounds of m_primitives
 };
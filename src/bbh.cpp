@@ -19,6 +19,10 @@
 
 
 #include "bbh.h"
+#include "timer.h"
+#include "parallel.h"
+#include <cmath>
+#include <limits>
 
 bool aabbIntersect(const Box3f &bounds, const Ray3f &ray, float& minT, float& maxT)
 {
@@ -64,12 +68,20 @@ bool aabbIntersect(const Box3f &bounds, const Ray3f &ray, float& minT, float& ma
     minT = max(max(tmin[0],tmin[1]),tmin[2]);
     maxT = min(min(tmax[0],tmax[1]),tmax[2]);
     
-    return minT < maxT;
+    // flat boxes (e.g. around an axis-aligned quad) have minT == maxT
+    return minT <= maxT;
 }
 
-BBH::BBH(const Scene & scene, const json & j) : Accelerator(scene, j)
+BBH::BBH(const Scene & scene, const json & j) : Accelerator(scene, j), totalNodes(0)
 {
     Parser::get(j, maxPrimsInNode, "maxPrimsInNode");
+    Parser::get(j, flatten, "flatten");
+    Parser::get(j, sahBins, "sahBins");
+    Parser::get(j, traversalCost, "traversalCost");
+    Parser::get(j, intersectionCost, "intersectionCost");
+    Parser::get(j, buildThreads, "buildThreads");
+    Parser::get(j, rebuildThreshold, "rebuildThreshold");
+    sahBins = clamp(sahBins, 2, int(maxSahBins));
     maxPrimsInNode = std::min(255, maxPrimsInNode);
     string sm("sah");
     Parser::get(j, sm, "splitMethod");
@@ -110,30 +122,524 @@ void BBH::build()
         // Choose split dimension
         // Partition primitives into two sets and build children
         // Recursively call the function on both children
-    put_your_code_here("Assignment 2: Insert your BBH::build() code here \n");
-    int type = 0;
-    if(this->splitMethod == this->SPLIT_MIDDLE)
-        type = 1;
-    
-    message("There are: %d primitives",m_primitives.size());
-    BBHNode *node = CreateNode(m_primitives,type,0);
-    this->TreeRoot = node;
-    
-    
-    message("root is here");
-    
-    
-    
-        
-    
+    if (m_primitives.empty())
+        return;
+
+    buildTree();
+
+    if (flatten)
+    {
+        // lay the tree out depth-first in one array
+        m_nodes.clear();
+        m_nodes.reserve(totalNodes);
+        flattenTree(TreeRoot);
+
+        deleteTree(TreeRoot);
+        TreeRoot = nullptr;
+
+        // the baseline refit() compares against; bounds are unchanged
+        std::vector<uint32_t> subtreeSize;
+        refitNodes(m_buildCost, subtreeSize);
+
+        message("flattened BBH: %d nodes (%s)\n", m_nodes.size(),
+                memString(m_nodes.size() * sizeof(LinearBBHNode)));
+    }
+}
+
+void BBH::refit()
+{
+    Timer timer;
+    Accelerator::refit();
+
+    if (!flatten)
+    {
+        if (TreeRoot)
+            refitTree(TreeRoot);
+        message("refit BBH in %s\n", timer.elapsedString());
+        return;
+    }
+    if (m_nodes.empty())
+        return;
+
+    std::vector<float> cost;
+    std::vector<uint32_t> subtreeSize;
+    refitNodes(cost, subtreeSize);
+
+    // find the topmost degraded subtrees; a subtree occupies the node range [i, i + subtreeSize[i])
+    std::vector<uint32_t> degraded;
+    if (rebuildThreshold > 0.0f)
+    {
+        for (uint32_t i = 0; i < m_nodes.size();)
+        {
+            if (m_nodes[i].nPrimitives == 0 && cost[i] > rebuildThreshold * m_buildCost[i])
+            {
+                degraded.push_back(i);
+                i += subtreeSize[i];
+            }
+            else
+                ++i;
+        }
+    }
+
+    int rebuilt = 0;
+    if (!degraded.empty())
+    {
+        rebuilt = rebuildSubtrees(degraded, subtreeSize);
+
+        // the rebuilt subtrees become the new baseline, their ancestors keep theirs
+        refitNodes(cost, subtreeSize);
+        for (auto i : range(int(m_nodes.size())))
+            if (std::isnan(m_buildCost[i]))
+                m_buildCost[i] = cost[i];
+    }
+
+    message("refit BBH in %s: rebuilt %d subtrees with %d primitives, SAH cost %.2f times that when built\n",
+            timer.elapsedString(), degraded.size(), rebuilt, cost[0] / m_buildCost[0]);
+}
+
+void BBH::refitNodes(std::vector<float> & cost, std::vector<uint32_t> & subtreeSize)
+{
+    int n = int(m_nodes.size());
+    cost.resize(n);
+    subtreeSize.resize(n);
+
+    // children follow their parent, so a backwards sweep visits them first
+    for (int i = n - 1; i >= 0; --i)
+    {
+        LinearBBHNode & node = m_nodes[i];
+        if (node.nPrimitives > 0)
+        {
+            Box3f bounds;
+            for (auto p : range(int(node.primitivesOffset), int(node.primitivesOffset + node.nPrimitives)))
+                bounds.extend(m_primBounds.bounds[p]);
+            node.bounds = bounds;
+            cost[i] = intersectionCost * node.nPrimitives * bounds.surfaceArea();
+            subtreeSize[i] = 1;
+        }
+        else
+        {
+            uint32_t second = node.secondChildOffset;
+            node.bounds = m_nodes[i + 1].bounds;
+            node.bounds.extend(m_nodes[second].bounds);
+            cost[i] = traversalCost * node.bounds.surfaceArea() + cost[i + 1] + cost[second];
+            subtreeSize[i] = 1 + subtreeSize[i + 1] + subtreeSize[second];
+        }
+    }
+}
+
+void BBH::refitTree(BBHNode * node)
+{
+    if (node->isleaf)
+    {
+        node->bounds = Box3f();
+        for (auto p : range(int(node->primOffset), int(node->primOffset + node->nPrims)))
+            node->bounds.extend(m_primBounds.bounds[p]);
+        return;
+    }
+    refitTree(node->leftchild);
+    refitTree(node->rightchild);
+    node->bounds = node->leftchild->bounds;
+    node->bounds.extend(node->rightchild->bounds);
+}
+
+int BBH::rebuildSubtrees(const std::vector<uint32_t> & roots, const std::vector<uint32_t> & subtreeSize)
+{
+    ThreadPool pool(buildThreads);
+    int n = int(m_primitives.size());
+    std::vector<uint32_t> order(n);
+    for (auto i : range(n))
+        order[i] = i;
+
+    // depth of every node, so the new subtrees continue at the depth they replace
+    std::vector<int> depth(m_nodes.size(), 0);
+    for (auto i : range(int(m_nodes.size())))
+        if (m_nodes[i].nPrimitives == 0)
+            depth[i + 1] = depth[m_nodes[i].secondChildOffset] = depth[i] + 1;
+
+    // the leaves of a depth-first subtree cover a contiguous range of primitives,
+    // so every subtree can be rebuilt over its own range of the order
+    int covered = 0;
+    std::vector<BBHNode *> trees;
+    for (uint32_t root : roots)
+    {
+        uint32_t begin = std::numeric_limits<uint32_t>::max(), end = 0;
+        for (auto i : range(int(root), int(root + subtreeSize[root])))
+        {
+            if (m_nodes[i].nPrimitives == 0)
+                continue;
+            begin = std::min(begin, m_nodes[i].primitivesOffset);
+            end = std::max(end, m_nodes[i].primitivesOffset + m_nodes[i].nPrimitives);
+        }
+        trees.push_back(CreateNode(order, int(begin), int(end), depth[root], pool));
+        covered += int(end - begin);
+    }
+    permutePrimitives(order);
+
+    // splice the new subtrees in with a single pass over the old nodes
+    decltype(m_nodes) nodes;
+    std::vector<float> buildCost;
+    std::vector<uint32_t> newIndex(m_nodes.size());
+    std::vector<bool> spliced;
+    nodes.reserve(m_nodes.size());
+    buildCost.reserve(m_nodes.size());
+    size_t t = 0;
+    for (uint32_t i = 0; i < m_nodes.size();)
+    {
+        if (t < roots.size() && roots[t] == i)
+        {
+            // flattenTree appends, so the offsets of the new nodes are already final
+            uint32_t base = uint32_t(nodes.size());
+            nodes.swap(m_nodes);
+            flattenTree(trees[t]);
+            nodes.swap(m_nodes);
+            deleteTree(trees[t]);
+
+            newIndex[i] = base;
+            buildCost.resize(nodes.size(), std::numeric_limits<float>::quiet_NaN());
+            spliced.resize(nodes.size(), true);
+            i += subtreeSize[i];
+            ++t;
+        }
+        else
+        {
+            newIndex[i] = uint32_t(nodes.size());
+            nodes.push_back(m_nodes[i]);
+            buildCost.push_back(m_buildCost[i]);
+            spliced.push_back(false);
+            ++i;
+        }
+    }
+
+    // children of the kept interior nodes moved
+    for (auto n : range(int(nodes.size())))
+        if (!spliced[n] && nodes[n].nPrimitives == 0)
+            nodes[n].secondChildOffset = newIndex[nodes[n].secondChildOffset];
+
+    m_nodes.swap(nodes);
+    m_buildCost.swap(buildCost);
+    return covered;
+}
+
+void BBH::buildTree()
+{
+    Timer timer;
+    ThreadPool pool(buildThreads);
+
+    // every subtree partitions its own range of the index array in place,
+    // so afterwards the leaves cover contiguous ranges of the final order
+    int n = int(m_primitives.size());
+    std::vector<uint32_t> order(n);
+    for (auto i : range(n))
+        order[i] = i;
+    totalNodes = 0;
+    TreeRoot = CreateNode(order, 0, n, 0, pool);
+    permutePrimitives(order);
+
+    TreeStats stats;
+    treeStats(TreeRoot, 0, TreeRoot->bounds.surfaceArea(), stats);
+    message("BBH built in %s using %d threads: %d nodes, %d leaves, max depth %d, %.2f primitives/leaf, SAH cost %.2f\n",
+            timer.elapsedString(), pool.numThreads(), stats.nodes, stats.leaves, stats.maxDepth,
+            float(n) / stats.leaves, stats.sahCost);
+}
+
+// local functions
+namespace
+{
+
+// subtrees with fewer primitives are built serially
+const int parallelSubtreeThreshold = 4096;
+// nodes with more primitives compute bounds and bins in parallel chunks
+const int parallelNodeThreshold = 65536;
+
+struct Bin
+{
+    int count = 0;
+    Box3f bounds;
+};
+
+// number of chunks a range of n primitives is processed in
+int numChunks(int n)
+{
+    const int chunkSize = parallelNodeThreshold / 4;
+    return n < parallelNodeThreshold ? 1 : (n + chunkSize - 1) / chunkSize;
+}
+
+// Apply fn(chunk, begin, end) to the chunks of [start, end), in parallel for large ranges.
+// Chunk boundaries do not depend on the number of threads.
+template <typename Fn>
+void forChunks(ThreadPool & pool, int start, int end, Fn fn)
+{
+    int64_t n = end - start;
+    int chunks = numChunks(int(n));
+    auto body = [&](int c)
+    {
+        fn(c, start + int(n * c / chunks), start + int(n * (c + 1) / chunks));
+    };
+    if (chunks == 1)
+        body(0);
+    else
+        parallelFor(pool, 0, chunks, body);
+}
+
+} // namespace
+
+BBH::BBHNode * BBH::CreateNode(std::vector<uint32_t> & order, int start, int end, int depth, ThreadPool & pool)
+{
+    const std::vector<Box3f> & bounds = m_primBounds.bounds;
+    const std::vector<Point3f> & centroids = m_primBounds.centroids;
+
+    int N = end - start;
+    BBHNode *node = new BBHNode;
+    totalNodes++;
+
+    // Per-chunk results only need the heap when the node is split across
+    // tasks; all nodes below parallelNodeThreshold use a single chunk on the stack.
+    int chunks = numChunks(N);
+
+    // bounds of the primitives and of their centroids (box unions are exact,
+    // so merging per-chunk results gives the same boxes in any order)
+    Box3f singleBounds[2];
+    std::vector<Box3f> chunkBounds;
+    if (chunks > 1)
+        chunkBounds.resize(2 * chunks);
+    Box3f * boundsOfChunk = chunks > 1 ? chunkBounds.data() : singleBounds;
+    forChunks(pool, start, end, [&](int c, int b, int e)
+    {
+        for (int i = b; i < e; ++i)
+        {
+            boundsOfChunk[2*c].extend(bounds[order[i]]);
+            boundsOfChunk[2*c+1].extend(centroids[order[i]]);
+        }
+    });
+    Box3f centroidBounds;
+    for (int c = 0; c < chunks; ++c)
+    {
+        node->bounds.extend(boundsOfChunk[2*c]);
+        centroidBounds.extend(boundsOfChunk[2*c+1]);
+    }
+
+    auto makeLeaf = [&]()
+    {
+        node->isleaf = true;
+        node->primOffset = start;
+        node->nPrims = N;
+        return node;
+    };
+
+    if (N == 1)
+        return makeLeaf();
+
+    // split along the axis of largest centroid extent
+    int axis = centroidBounds.majorAxis();
+    float cmin = centroidBounds.min()[axis];
+    float cmax = centroidBounds.max()[axis];
+
+    auto first = order.begin() + start;
+    auto last = order.begin() + end;
+
+    // only the SAH weighs the cost of a leaf against splitting it further
+    if (splitMethod != SPLIT_SAH && N <= maxPrimsInNode)
+        return makeLeaf();
+
+    int mid = -1;
+    if (cmax == cmin)
+    {
+        // all centroids coincide, so no plane separates them
+        if (N <= maxPrimsInNode)
+            return makeLeaf();
+        mid = start + N / 2;
+    }
+    else if (depth >= maxSplitDepth)
+    {
+        // keep very deep trees within the traversal stacks by halving instead
+        if (N <= maxPrimsInNode)
+            return makeLeaf();
+    }
+    else if (splitMethod == SPLIT_MIDDLE)
+    {
+        float pmid = 0.5f * (cmin + cmax);
+        mid = int(std::partition(first, last,
+                                 [&](uint32_t p) { return centroids[p][axis] < pmid; }) - order.begin());
+        if (mid == start || mid == end)
+            mid = -1;
+    }
+    else if (splitMethod == SPLIT_SAH && !std::isfinite(sahBins / (cmax - cmin)))
+    {
+        // the centroid extent is too small to bin
+        if (N <= maxPrimsInNode)
+            return makeLeaf();
+    }
+    else if (splitMethod == SPLIT_SAH)
+    {
+        // bin the centroids along the split axis
+        float scale = sahBins / (cmax - cmin);
+        auto binIndex = [&](uint32_t p)
+        {
+            return min(int((centroids[p][axis] - cmin) * scale), sahBins - 1);
+        };
+        // the first chunk bins into bins, any further ones into chunkBins
+        Bin bins[maxSahBins];
+        std::vector<std::vector<Bin>> chunkBins;
+        if (chunks > 1)
+            chunkBins.assign(chunks - 1, std::vector<Bin>(sahBins));
+        forChunks(pool, start, end, [&](int c, int b, int e)
+        {
+            Bin * chunk = c == 0 ? bins : chunkBins[c - 1].data();
+            for (int i = b; i < e; ++i)
+            {
+                Bin & bin = chunk[binIndex(order[i])];
+                bin.count++;
+                bin.bounds.extend(bounds[order[i]]);
+            }
+        });
+        for (auto & chunk : chunkBins)
+            for (auto i : range(sahBins))
+            {
+                bins[i].count += chunk[i].count;
+                bins[i].bounds.extend(chunk[i].bounds);
+            }
+
+        // sweep from the right to get the area and count to the right of every plane
+        float rightArea[maxSahBins - 1];
+        int rightCount[maxSahBins - 1];
+        Box3f box;
+        int count = 0;
+        for (int i = sahBins - 1; i > 0; --i)
+        {
+            box.extend(bins[i].bounds);
+            count += bins[i].count;
+            rightArea[i - 1] = count ? box.surfaceArea() : 0.0f;
+            rightCount[i - 1] = count;
+        }
+
+        // sweep from the left and evaluate the cost of splitting after bin i
+        float area = node->bounds.surfaceArea();
+        float invArea = area > 0.0f ? 1.0f / area : 0.0f;
+        float minCost = std::numeric_limits<float>::infinity();
+        int minBin = -1;
+        box.setEmpty();
+        count = 0;
+        for (int i = 0; i < sahBins - 1; ++i)
+        {
+            box.extend(bins[i].bounds);
+            count += bins[i].count;
+            if (count == 0 || rightCount[i] == 0)
+                continue;
+            float cost = traversalCost + intersectionCost * invArea *
+                         (count * box.surfaceArea() + rightCount[i] * rightArea[i]);
+            if (cost < minCost)
+            {
+                minCost = cost;
+                minBin = i;
+            }
+        }
+
+        // create a leaf if that is cheaper than the best split
+        float leafCost = intersectionCost * N;
+        if (N <= maxPrimsInNode && !(minCost < leafCost))
+            return makeLeaf();
+
+        if (minBin >= 0)
+            mid = int(std::partition(first, last,
+                                     [&](uint32_t p) { return binIndex(p) <= minBin; }) - order.begin());
+    }
+
+    if (mid < 0)
+    {
+        // equal counts (also the fallback when a split method fails)
+        mid = start + N / 2;
+        std::nth_element(first, order.begin() + mid, last,
+                         [&](uint32_t a, uint32_t b)
+                         {
+                             return centroids[a][axis] < centroids[b][axis];
+                         });
+    }
+
+    node->isleaf = false;
+    node->axis = axis;
+    if (N >= parallelSubtreeThreshold && pool.numThreads() > 1)
+    {
+        // the two halves are disjoint ranges of order, build them concurrently
+        TaskGroup group(pool);
+        group.run([&]() { node->leftchild = CreateNode(order, start, mid, depth + 1, pool); });
+        node->rightchild = CreateNode(order, mid, end, depth + 1, pool);
+        group.wait();
+    }
+    else
+    {
+        node->leftchild = CreateNode(order, start, mid, depth + 1, pool);
+        node->rightchild = CreateNode(order, mid, end, depth + 1, pool);
+    }
+    return node;
+}
+
+void BBH::treeStats(const BBHNode * node, int depth, float rootArea, TreeStats & stats) const
+{
+    stats.nodes++;
+    stats.maxDepth = max(stats.maxDepth, depth);
+    float relArea = rootArea > 0.0f ? node->bounds.surfaceArea() / rootArea : 1.0f;
+    if (node->isleaf)
+    {
+        stats.leaves++;
+        stats.sahCost += relArea * intersectionCost * node->nPrims;
+    }
+    else
+    {
+        stats.sahCost += relArea * traversalCost;
+        treeStats(node->leftchild, depth + 1, rootArea, stats);
+        treeStats(node->rightchild, depth + 1, rootArea, stats);
+    }
+}
+
+uint32_t BBH::flattenTree(const BBHNode * node)
+{
+    uint32_t offset = (uint32_t) m_nodes.size();
+    m_nodes.push_back(LinearBBHNode());
+    m_nodes[offset].bounds = node->bounds;
+
+    if (node->isleaf)
+    {
+        m_nodes[offset].primitivesOffset = node->primOffset;
+        m_nodes[offset].nPrimitives = (uint16_t) node->nPrims;
+    }
+    else
+    {
+        // the first child directly follows its parent
+        m_nodes[offset].axis = (uint8_t) node->axis;
+        flattenTree(node->leftchild);
+        uint32_t second = flattenTree(node->rightchild);
+        m_nodes[offset].secondChildOffset = second;
+    }
+    return offset;
+}
+
+void BBH::deleteTree(BBHNode * node)
+{
+    if (!node)
+        return;
+    deleteTree(node->leftchild);
+    deleteTree(node->rightchild);
+    delete node;
+}
+
+void BBH::clear()
+{
+    deleteTree(TreeRoot);
+    TreeRoot = nullptr;
+    m_nodes.clear();
+    m_nodes.shrink_to_fit();
+    m_buildCost.clear();
+    m_buildCost.shrink_to_fit();
+    Accelerator::clear();
 }
 
 BBH::~BBH()
 {
+    clear();
 }
 
 
-bool BBH::intersect(const Ray3f & _ray, Intersection3f & its) const
+bool BBH::findHit(const Ray3f & _ray, HitRecord & hit) const
 {
     // PSEUDO CODE
     // ***********
@@ -154,11 +660,301 @@ bool BBH::intersect(const Ray3f & _ray, Intersection3f & its) const
                 // Find intersecction with primitives and update ray params
     // Else
         // return
-    BBHNode *current = this->TreeRoot;
+    if (flatten)
+        return !m_nodes.empty() && intersectLinear<false>(_ray, hit);
+
+    if (!TreeRoot)
+        return false;
+
+    // copy the ray so we can shrink maxt as closer hits are found
     Ray3f ray = _ray;
+    return Recursive<false>(TreeRoot, PreparedRay(ray), ray, hit);
+}
 
-    if(Recursive(current,ray,its)) return true;
-    return false;
-    
-   
+bool BBH::occluded(const Ray3f & _ray) const
+{
+    HitRecord unused;
+    if (flatten)
+        return !m_nodes.empty() && intersectLinear<true>(_ray, unused);
+
+    if (!TreeRoot)
+        return false;
+
+    Ray3f ray = _ray;
+    return Recursive<true>(TreeRoot, PreparedRay(ray), ray, unused);
+}
+
+// local functions
+namespace
+{
+
+//! Conservative bounds on the slab distances of all rays of a packet
+/*!
+    The origins and reciprocal directions of the rays are bounded by
+    intervals, and the slab distances of a box are bounded with interval
+    arithmetic. Rounding is monotonic, so the bounds also hold for the
+    distances that the per-ray slab test computes in floating point.
+*/
+struct PacketInterval
+{
+    Vector3f oMin, oMax;            //!< bounds of the ray origins
+    Vector3f invMin, invMax;        //!< bounds of the reciprocal directions
+    int dirIsNeg[3];                //!< direction signs shared by all rays
+    float mint, maxt;               //!< union of the ray segments
+
+    //! Return false if the rays do not share direction signs or have a zero direction component
+    bool init(const PreparedRay * rays, int n)
+    {
+        oMin = oMax = rays[0].o;
+        invMin = invMax = rays[0].invDir;
+        mint = rays[0].mint;
+        maxt = rays[0].maxt;
+        for (auto a : range(3))
+            dirIsNeg[a] = rays[0].dirIsNeg[a];
+
+        for (auto i : range(n))
+        {
+            for (auto a : range(3))
+                if (rays[i].dirIsNeg[a] != dirIsNeg[a] || !std::isfinite(rays[i].invDir[a]))
+                    return false;
+            oMin = oMin.cwiseMin(rays[i].o);
+            oMax = oMax.cwiseMax(rays[i].o);
+            invMin = invMin.cwiseMin(rays[i].invDir);
+            invMax = invMax.cwiseMax(rays[i].invDir);
+            mint = std::min(mint, rays[i].mint);
+            maxt = std::max(maxt, rays[i].maxt);
+        }
+        return true;
+    }
+
+    //! Return true only if no ray of the packet can hit \a bounds
+    bool missed(const Box3f & bounds) const
+    {
+        float tNear = mint, tFar = maxt;
+        for (auto a : range(3))
+        {
+            // entry distance: lower bound of (near plane - o) * invDir
+            float n0 = bounds[dirIsNeg[a]][a] - oMax[a], n1 = bounds[dirIsNeg[a]][a] - oMin[a];
+            // exit distance: upper bound of (far plane - o) * invDir
+            float f0 = bounds[1 - dirIsNeg[a]][a] - oMax[a], f1 = bounds[1 - dirIsNeg[a]][a] - oMin[a];
+            tNear = std::max(tNear, std::min(std::min(n0 * invMin[a], n0 * invMax[a]),
+                                             std::min(n1 * invMin[a], n1 * invMax[a])));
+            tFar = std::min(tFar, std::max(std::max(f0 * invMin[a], f0 * invMax[a]),
+                                           std::max(f1 * invMin[a], f1 * invMax[a])));
+        }
+        return tNear > tFar;
+    }
+};
+
+} // namespace
+
+
+uint64_t BBH::intersectPacket(const Ray3f * _rays, int n, Intersection3f * its) const
+{
+    if (n > maxPacketRays)
+        throw DirtException("Packets hold at most %d rays, not %d.", maxPacketRays, n);
+    if (!flatten || m_nodes.empty() || n <= 0)
+        return Accelerator::intersectPacket(_rays, n, its);
+
+    // copies whose maxt shrinks as closer hits are found
+    Ray3f rays[maxPacketRays];
+    PreparedRay prays[maxPacketRays];
+    HitRecord hits[maxPacketRays];
+    uint64_t mask = 0;
+    for (auto i : range(n))
+    {
+        rays[i] = _rays[i];
+        prays[i] = PreparedRay(rays[i]);
+    }
+
+    PacketInterval packet;
+    if (!packet.init(prays, n))
+        return Accelerator::intersectPacket(_rays, n, its);
+
+    // the slab test of a single ray, exactly as intersectLinear does it
+    auto rayHits = [&](const LinearBBHNode & node, int i)
+    {
+        float minT = rays[i].mint, maxT = rays[i].maxt;
+        return aabbIntersect(node.bounds, prays[i], minT, maxT);
+    };
+
+    // Rays are visited in the same near-to-far order as intersectLinear, since
+    // they share direction signs. Each node carries the first ray that may
+    // still hit it; rays before it failed the slab test of an ancestor.
+    struct Entry
+    {
+        uint32_t node;
+        int first;
+    };
+    Entry todo[maxTreeDepth];
+    int todoSize = 0;
+    Entry current = {0, 0};
+
+    while (true)
+    {
+        INCREMENT_VISITED_NODES;
+        const LinearBBHNode & node = m_nodes[current.node];
+
+        // find the first ray that hits the node, unless the whole packet misses it
+        int first = current.first;
+        if (!rayHits(node, first))
+        {
+            first = n;
+            if (!packet.missed(node.bounds))
+                for (auto i : range(current.first + 1, n))
+                    if (rayHits(node, i))
+                    {
+                        first = i;
+                        break;
+                    }
+        }
+
+        if (first < n)
+        {
+            if (node.nPrimitives > 0)
+            {
+                // only rays whose own slab test accepts the leaf, so each ray
+                // tests the same primitives in the same order as on its own
+                for (auto r : range(first, n))
+                {
+                    if (r != first && !rayHits(node, r))
+                        continue;
+                    for (auto i : range(node.primitivesOffset, node.primitivesOffset + node.nPrimitives))
+                        if (hitLeafPrimitive<false>(i, prays[r], rays[r], hits[r]))
+                            mask |= uint64_t(1) << r;
+                }
+            }
+            else
+            {
+                if (packet.dirIsNeg[node.axis])
+                {
+                    todo[todoSize++] = {current.node + 1, first};
+                    current = {node.secondChildOffset, first};
+                }
+                else
+                {
+                    todo[todoSize++] = {node.secondChildOffset, first};
+                    current = {current.node + 1, first};
+                }
+                continue;
+            }
+        }
+
+        if (todoSize == 0)
+            break;
+        current = todo[--todoSize];
+    }
+
+    // only the closest hits need full intersection records
+    for (auto r : range(n))
+        if (mask & (uint64_t(1) << r))
+            hits[r].surface->computeHitDetails(_rays[r], hits[r], its[r]);
+    return mask;
+}
+
+template <bool AnyHit>
+bool BBH::Recursive(const BBHNode * node, const PreparedRay & pray, Ray3f & ray, HitRecord & record) const
+{
+    if (AnyHit)
+        INCREMENT_SHADOW_VISITED_NODES;
+    else
+        INCREMENT_VISITED_NODES;
+    float minT = ray.mint, maxT = ray.maxt;
+    if (!aabbIntersect(node->bounds, pray, minT, maxT))
+        return false;
+
+    if (node->isleaf)
+    {
+        bool hit = false;
+        for (auto i : range(node->primOffset, node->primOffset + node->nPrims))
+        {
+            if (hitLeafPrimitive<AnyHit>(i, pray, ray, record))
+            {
+                if (AnyHit)
+                    return true;
+                hit = true;
+            }
+        }
+        return hit;
+    }
+
+    // visit the child on the near side of the split plane first, so that
+    // hits found there clip the ray before the far child is tested
+    const BBHNode * first = node->leftchild;
+    const BBHNode * second = node->rightchild;
+    if (pray.dirIsNeg[node->axis])
+        std::swap(first, second);
+
+    bool hit = first && Recursive<AnyHit>(first, pray, ray, record);
+    if (AnyHit && hit)
+        return true;
+    if (second && Recursive<AnyHit>(second, pray, ray, record))
+        hit = true;
+    return hit;
+}
+
+template <bool AnyHit>
+bool BBH::intersectLinear(const Ray3f & _ray, HitRecord & hit) const
+{
+    // copy the ray so we can shrink maxt as closer hits are found
+    Ray3f ray = _ray;
+    PreparedRay pray(ray);
+    bool hitSomething = false;
+
+    // nodes still to be visited
+    uint32_t todo[maxTreeDepth];
+    int todoSize = 0;
+    uint32_t current = 0;
+
+    while (true)
+    {
+        if (AnyHit)
+            INCREMENT_SHADOW_VISITED_NODES;
+        else
+            INCREMENT_VISITED_NODES;
+        const LinearBBHNode & node = m_nodes[current];
+        float minT = ray.mint, maxT = ray.maxt;
+        if (aabbIntersect(node.bounds, pray, minT, maxT))
+        {
+            if (node.nPrimitives > 0)
+            {
+                for (auto i : range(node.primitivesOffset, node.primitivesOffset + node.nPrimitives))
+                {
+                    if (hitLeafPrimitive<AnyHit>(i, pray, ray, hit))
+                    {
+                        if (AnyHit)
+                            return true;
+                        hitSomething = true;
+                    }
+                }
+                if (todoSize == 0)
+                    break;
+                current = todo[--todoSize];
+            }
+            else
+            {
+                // visit the child on the near side of the split plane next and
+                // remember the other one; by the time it is popped, its box test
+                // runs against the clipped ray
+                if (pray.dirIsNeg[node.axis])
+                {
+                    todo[todoSize++] = current + 1;
+                    current = node.secondChildOffset;
+                }
+                else
+                {
+                    todo[todoSize++] = node.secondChildOffset;
+                    current = current + 1;
+                }
+            }
+        }
+        else
+        {
+            if (todoSize == 0)
+                break;
+            current = todo[--todoSize];
+        }
+    }
+
+    return hitSomething;
 }
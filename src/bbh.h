@@ -20,6 +20,10 @@
 #pragma once
 
 #include "accelerator.h"
+#include "aabb.h"
+#include <atomic>
+
+class ThreadPool;
 
 // Ray - AABB intersection method
 bool aabbIntersect(const Box3f &bounds, const Ray3f &ray, float& tmin, float& tmax);
@@ -33,21 +37,63 @@ public:
     BBH(const Scene & scene, const json & j = json());
     virtual ~BBH();
 
+    virtual void clear();
     virtual void build();
 
+    //! Refit the node bounds bottom-up, and rebuild subtrees whose quality degraded
+    /*!
+        Refitting takes time linear in the number of nodes. With the flattened
+        tree, subtrees whose area-weighted SAH cost grew by more than a factor
+        of "rebuildThreshold" since they were built are rebuilt from scratch;
+        only the topmost of nested degraded subtrees is rebuilt.
+    */
+    virtual void refit();
+
     
-    //! Intersect a ray against all surfaces registered with the Accelerator
-    virtual bool intersect(const Ray3f & ray, Intersection3f & its) const;
+    //! Find the closest hit of a ray with all surfaces registered with the Accelerator
+    virtual bool findHit(const Ray3f & ray, HitRecord & hit) const;
+
+    //! Return whether any surface blocks the ray, stopping at the first hit
+    virtual bool occluded(const Ray3f & ray) const;
+
+    //! Trace a packet of coherent rays through the flattened tree together
+    /*!
+        Interior nodes are culled for the whole packet with interval
+        arithmetic on the packet's origins and directions, and each ray is
+        only tested against the leaves its own slab test accepts, so every
+        ray gets exactly the hit \ref intersect() would find. Packets whose
+        rays do not share direction signs, and the pointer tree, fall back to
+        tracing the rays one by one.
+    */
+    virtual uint64_t intersectPacket(const Ray3f * rays, int n, Intersection3f * its) const;
    
 
     // BBHAccel Private Data
     int maxPrimsInNode = 10;
     enum SplitMethod { SPLIT_MIDDLE, SPLIT_EQUAL_COUNTS, SPLIT_SAH };
     SplitMethod splitMethod = SPLIT_SAH;
+    int sahBins = 16;                   //!< number of centroid bins evaluated by the SAH builder (at most \ref maxSahBins)
+    float traversalCost = 0.125f;       //!< SAH cost of visiting an interior node
+    float intersectionCost = 1.0f;      //!< SAH cost of intersecting one primitive
+    int buildThreads = 0;               //!< threads used to build the tree (0: one per core)
+    float rebuildThreshold = 1.5f;      //!< cost growth that makes \ref refit() rebuild a subtree (0: never)
+    bool flatten = true;        //!< traverse a compact linear node array instead of the pointer tree
+
+    //! Depth from which every split method halves the primitives instead
+    /*!
+        Halving adds at most log2(#primitives) < 32 further levels, so no
+        tree gets deeper than \ref maxTreeDepth, the size of the traversal
+        stacks.
+    */
+    static constexpr int maxSplitDepth = 32;
+    static constexpr int maxTreeDepth = 64;     //!< upper bound of the depth of a leaf
+    static constexpr int maxSahBins = 64;       //!< upper bound of \ref sahBins, the size of the builder's bin arrays
     
     struct BBHNode{
         bool isleaf = true;                //node or leaf
-        vector<Primitive *> prim;//list of primitive only not empty if node is leaf
+        int axis = 0;                      //split axis of an interior node
+        uint32_t primOffset = 0;           //first primitive of a leaf in m_primitives
+        uint32_t nPrims = 0;               //number of primitives of a leaf
         BBHNode *leftchild = nullptr;//only not empty if not lear;
         BBHNode *rightchild = nullptr;//only not empty if not leaf;
         //Primitive leftleaf = nullptr;
@@ -55,121 +101,110 @@ public:
         Box3f bounds;//bounding box of the node
     };
     BBH::BBHNode *TreeRoot = nullptr;//root of the BBH
-    
-    //Create tree node recursively
-    BBHNode * CreateNode(std::vector<Primitive *> &A,int type,int AXIS){
-        int N = A.size();
-        BBHNode *node = new BBHNode;
-        
-        //if this node is leaf
-        if(N <= maxPrimsInNode){
-            node->isleaf = true;
-            auto it = node->prim.begin();
-            node->prim.insert(it,A.begin(),A.begin() + N);
-            node->leftchild = nullptr;
-            node->rightchild = nullptr;
-            node->bounds = A[0]->worldBBox();
-            for(auto i:range(N))
-                node->bounds = node->bounds.extend(A[i]->worldBBox());
-            message("   tree node with %d prim\n",node->prim.size());
-            return node;
-        }else{
-            // if the node is not leaf
-            node->isleaf = false;
-            //sort along axis
-            struct comp{
-                int axis;
-                bool operator()(Primitive * a,Primitive *b){
-                    return a->worldBBox().center()[axis] < b->worldBBox().center()[axis];
-                }
-                comp(int a){axis = a;}
-            };
-            std::sort(A.begin(),A.end(),comp(AXIS));
-            auto it = A.begin();
-            int splite = N/2;
-            
-            if(type){//if use sah
-              Box3f leftbox = A[0]->worldBBox();
-              Box3f rightbox = A[1]->worldBBox();
-              float SAH = INFINITY;
-                //compute area of bbox
-                for(auto i:range(N)){
-                std::vector<Primitive *> lA(it,it+i);
-                std::vector<Primitive *> rA(it + i,it + N);
-                for(auto t:range(lA.size()))
-                      leftbox = leftbox.extend(lA[t]->worldBBox());
-                
-                Box3f rightbox = A[i]->worldBBox();
-                for(auto j:range(rA.size()))
-                    rightbox = rightbox.extend(rA[j]->worldBBox());
-                auto s_ah = leftbox.surfaceArea()*lA.size() + rightbox.surfaceArea()*rA.size();
-                if(s_ah < SAH){
-                    SAH = s_ah;
-                    splite = i;
-                }
-              }
-            }
-            
-            //devide into left and right
-            std::vector<Primitive *> LA(it,it+splite);
-            std::vector<Primitive *> RA(it+splite,it+N);
-            node->leftchild = CreateNode(LA,type,(AXIS+1)%3);
-            node->rightchild = CreateNode(RA,type,(AXIS+1)%3);
-            Box3f abox = node->leftchild->bounds;
-            Box3f bbox = node->rightchild->bounds;
-            node->bounds = abox.extend(bbox);
-     
-            return node;
-        }
-    }
-    
+    std::atomic<int> totalNodes;//number of nodes created by CreateNode
+
+    //! A node of the flattened BBH
+    /*!
+        Nodes are stored depth-first in one contiguous array, so the first
+        child of an interior node immediately follows it and only the offset
+        of the second child needs to be stored. Leaves reference a contiguous
+        range of the primitive array. At 32 bytes, two nodes share
+        a cache line.
+    */
+    struct alignas(32) LinearBBHNode
+    {
+        Box3f bounds;                       //!< bounding box of the node
+        union
+        {
+            uint32_t primitivesOffset;      //!< leaf: first primitive in m_primitives
+            uint32_t secondChildOffset;     //!< interior: index of the second child
+        };
+        uint16_t nPrimitives = 0;           //!< 0 for interior nodes
+        uint8_t axis = 0;                   //!< split axis of interior nodes
+        uint8_t pad = 0;
+    };
+    static_assert(sizeof(LinearBBHNode) == 32, "LinearBBHNode should be 32 bytes");
+
+    std::vector<LinearBBHNode, AlignedAllocator<LinearBBHNode, 64>> m_nodes;
+    std::vector<float> m_buildCost;     //!< area-weighted SAH cost of each flattened subtree when it was built
+
+    //! Build the pointer tree over all primitives into \ref TreeRoot and reorder m_primitives to match its leaves
+    void buildTree();
+
+    //! Convert the pointer tree rooted at \a node into m_nodes
+    uint32_t flattenTree(const BBHNode * node);
+
+    //! Release the pointer tree rooted at \a node
+    static void deleteTree(BBHNode * node);
+
+    //! Recompute the bounds of the flattened nodes bottom-up from the primitive bounds
+    /*!
+        Also returns the SAH cost of every subtree weighted by surface area
+        (i.e. not divided by the area of its root), and the number of nodes in
+        every subtree.
+    */
+    void refitNodes(std::vector<float> & cost, std::vector<uint32_t> & subtreeSize);
+
+    //! Recompute the bounds of the pointer subtree rooted at \a node
+    void refitTree(BBHNode * node);
+
+    //! Rebuild the flattened subtrees rooted at \a roots (in increasing order), returning the number of primitives covered
+    /*!
+        The new subtrees are built starting at the depth of the nodes they
+        replace, so they stay within \ref maxTreeDepth.
+    */
+    int rebuildSubtrees(const std::vector<uint32_t> & roots, const std::vector<uint32_t> & subtreeSize);
+
+    //! Explicit-stack traversal of the flattened BBH
+    /*!
+        Finds the closest hit, or with \a AnyHit returns at the first hit
+        without filling \a its.
+    */
+    template <bool AnyHit>
+    bool intersectLinear(const Ray3f & ray, HitRecord & hit) const;
+
+    //! Create tree node recursively
+    /*!
+        Builds the subtree over the primitives \a order[start, end) (indices
+        into m_primitives), partitioning that range in place. Large subtrees
+        are built as parallel tasks on \a pool, which yields the same tree as
+        a serial build.
+    */
+    BBHNode * CreateNode(std::vector<uint32_t> & order, int start, int end, int depth, ThreadPool & pool);
+
+    //! Summary of the quality of a built tree
+    struct TreeStats
+    {
+        int nodes = 0;
+        int leaves = 0;
+        int maxDepth = 0;
+        float sahCost = 0.0f;               //!< expected cost of a random ray, relative to the root
+    };
+
+    //! Accumulate \ref TreeStats for the subtree rooted at \a node
+    void treeStats(const BBHNode * node, int depth, float rootArea, TreeStats & stats) const;
     
   
-    bool Recursive(BBHNode *parent,Ray3f & ray,Intersection3f & its)const
+    //! Test leaf primitive \a i if its bounds overlap the ray up to the closest hit so far
+    /*!
+        Every traversal of the tree, including those of \ref WideBBH, tests
+        leaf primitives through this, so primitivesIntersected counts the
+        same kind of work for all of them.
+    */
+    template <bool AnyHit>
+    bool hitLeafPrimitive(uint32_t i, const PreparedRay & pray, Ray3f & ray, HitRecord & hit) const
     {
-        BBHNode * current = parent;
-        float minT = ray.mint;
-        float maxT = ray.maxt;
-        if(aabbIntersect(current->bounds, ray,minT,maxT)){
-                if(current->isleaf){
-                    //message("hit leaf;index%d !\n",current->prim[0]->primitiveIndex);
-                    bool inter = false;
-                    float mint = INFINITY;
-                    for(auto i:range(current->prim.size())){
-                      if(aabbIntersect(current->prim[i]->worldBBox(),ray,minT,maxT)){
-                            if(current->prim[i]->intersect(ray, its)){
-                                inter = true;
-                                if(its.t < mint){
-                                    mint = its.t;
-                                }
-                           }
-                        }
-                    }
-                    if(inter == true) ray.maxt = its.t;
-                    return inter;
-                }
-            
-            Intersection3f lits,rits;
-            bool left_hit,right_hit;
-            left_hit = (current->leftchild != nullptr) && Recursive(current->leftchild,ray,lits);
-            right_hit = (current->rightchild != nullptr) && Recursive(current->rightchild,ray,rits);
-            if(left_hit && right_hit){
-                if(lits.t < rits.t)its = lits;
-                else its = rits;
-                ray.maxt = its.t;
-                return true;
-            }else if(right_hit){
-                its = rits;
-                ray.maxt = its.t;
-                return true;
-            }else if(left_hit){
-                its = lits;
-                ray.maxt = its.t;
-                return true;
-            }else return false;
-        }else return false;
+        float minT = ray.mint, maxT = ray.maxt;
+        return aabbIntersect(m_primBounds.bounds[i], pray, minT, maxT) && hitPrimitive<AnyHit>(i, ray, hit);
     }
 
+    //! Traversal of the pointer tree that visits the child on the near side of the split first
+    /*!
+        Shrinks ray.maxt whenever a closer hit is found, so subtrees that
+        start beyond the closest hit so far fail their box test.
+    */
+    template <bool AnyHit>
+    bool Recursive(const BBHNode * node, const PreparedRay & pray, Ray3f & ray, HitRecord & hit) const;
 };
 //BBNode
 
@@ -0,0 +1,367 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer, used in
+    Dartmouth's COSC 77/177 Computer Graphics course.
+
+    Copyright (c) 2016 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "scene.h"
+#include "parser.h"
+#include "parallel.h"
+#include "surface.h"
+#include "timer.h"
+
+// local functions
+namespace
+{
+
+// times below this many milliseconds are too coarse to compare
+const double minComparableTime = 20.0;
+
+//! The benchmark matrix used when no configuration file is given
+json defaultConfig()
+{
+    return {
+        {"scenes", {"testscene0", "testscene1", "testscene2"}},
+        {"accelerators", {
+            {{"type", "bbh"}, {"splitMethod", "sah"}},
+            {{"type", "bbh"}, {"splitMethod", "middle"}},
+            {{"type", "bbh"}, {"splitMethod", "equal"}},
+            {{"type", "bvh4"}},
+            {{"type", "bvh8"}}
+        }},
+        {"threads", {1, 0}},
+        {"repeat", 3}
+    };
+}
+
+bool endsWith(const string & s, const string & suffix)
+{
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+//! A scene around a single OBJ file, with the camera and a light placed from its bounds
+/*!
+    The mesh uses the "moller-trumbore" intersector rather than the default
+    "reference" one.
+*/
+json objScene(const string & filename)
+{
+    json j = {{"surfaces", {{{"type", "obj"}, {"filename", filename}, {"cache", false},
+                             {"intersector", "moller-trumbore"}}}}};
+
+    // loading the mesh once more is cheaper than asking for a hand-made camera
+    Box3f bounds;
+    {
+        Scene scene(j);
+        for (auto surface : scene.surfaces())
+            for (auto i : range(int(surface->numPrimitives())))
+                bounds.extend(surface->worldBBox(i));
+    }
+    if (bounds.isEmpty())
+        throw DirtException("\"%s\" contains no faces", filename);
+
+    Vector3f center = bounds.center();
+    float radius = 0.5f * bounds.diagonal().norm();
+    Vector3f from = center + radius * Vector3f(0.5f, 0.5f, 2.5f);
+    Vector3f light = center + radius * Vector3f(1.0f, 3.0f, 3.0f);
+    float intensity = 20.0f * radius * radius;
+
+    j["camera"] = {{"transform", {{"from", {from.x(), from.y(), from.z()}},
+                                  {"to", {center.x(), center.y(), center.z()}},
+                                  {"up", {0, 1, 0}}}}};
+    j["lights"] = {{{"transform", {{"o", {light.x(), light.y(), light.z()}}}},
+                    {"intensity", {intensity, intensity, intensity}}}};
+    return j;
+}
+
+//! Turn off the geometry cache of all OBJ surfaces and prototypes of \a scene
+/*!
+    Otherwise only the first run of a scene would parse its OBJ files, and
+    parse times could not be compared between runs or to a baseline.
+*/
+void disableGeometryCache(json & scene)
+{
+    for (auto key : {"surfaces", "prototypes"})
+        if (scene.count(key))
+            for (auto & surface : scene[key])
+                if (surface.value("type", "") == "obj")
+                    surface["cache"] = false;
+}
+
+//! The specification of a scene of the benchmark: "testsceneN", a scene .json file or an .obj file
+json loadScene(const string & name)
+{
+    json j;
+    if (name.size() > 9 && name.substr(0, 9) == "testscene")
+    {
+        j = create_test_scene_json(atoi(name.substr(9).c_str()));
+        if (j.empty())
+            throw DirtException("unknown test scene \"%s\"", name);
+    }
+    else if (endsWith(name, ".obj"))
+        j = objScene(name);
+    else
+        j = loadJSON(name);
+    disableGeometryCache(j);
+    return j;
+}
+
+//! Start measuring the peak memory use from the current memory use
+/*!
+    \return whether the peak could be reset. Only Linux allows this; elsewhere
+    the peak never decreases during the process, so it would include all
+    earlier runs.
+*/
+bool resetPeakMemory()
+{
+#if defined(__linux__)
+    // writing 5 resets the peak resident set size (VmHWM) of the process
+    std::ofstream clearRefs("/proc/self/clear_refs");
+    clearRefs << "5";
+    clearRefs.close();
+    return !clearRefs.fail();
+#else
+    return false;
+#endif
+}
+
+//! Return the peak resident set size of the process in bytes since \ref resetPeakMemory() (0 if unknown)
+size_t peakMemory()
+{
+#if defined(__linux__)
+    std::ifstream status("/proc/self/status");
+    string line;
+    while (std::getline(status, line))
+        if (line.compare(0, 6, "VmHWM:") == 0)
+            return size_t(atoll(line.c_str() + 6)) * 1024;
+#endif
+    return 0;
+}
+
+//! Traversal statistics of one kind of ray
+json rayResults(uint64_t rays, uint64_t nodes, uint64_t prims)
+{
+    double n = double(std::max(rays, uint64_t(1)));
+    return {
+        {"count", rays},
+        {"nodes_per_ray", nodes / n},
+        {"prims_per_ray", prims / n}
+    };
+}
+
+//! Parse and build \a scene with \a accelerator on \a threads threads, and render it \a repeat times
+json run(const string & name, const json & scene, const json & accelerator, int threads, int repeat)
+{
+    json j = scene;
+    j["accelerator"] = accelerator;
+    j["accelerator"]["buildThreads"] = threads;
+    j["render_threads"] = threads;
+
+    bool measureMemory = resetPeakMemory();
+    Timer timer;
+    std::unique_ptr<Scene> s(new Scene(j));
+    double parseTime = timer.elapsed() - s->buildTime();
+
+    // counters are deterministic, times are the fastest of all repetitions
+    double renderTime = std::numeric_limits<double>::infinity();
+    RayStats stats;
+    for (int i = 0; i < std::max(1, repeat); ++i)
+    {
+        RayStats before = rayStats;
+        timer.reset();
+        s->raytrace();
+        renderTime = std::min(renderTime, timer.elapsed());
+        stats = rayStats - before;
+    }
+
+    json result = {
+        {"name", name},
+        {"scene", name.substr(0, name.find(" | "))},
+        {"accelerator", accelerator},
+        {"threads", threads},
+        {"used_threads", threads > 0 ? threads : numSystemThreads()},
+        {"parse_ms", parseTime},
+        {"build_ms", s->buildTime()},
+        {"render_ms", renderTime},
+        // camera, reflection and shadow rays share the render time, so only their total has a throughput
+        {"mrays_per_s", (stats.raysTraced + stats.shadowRaysTraced) / (renderTime * 1000.0)},
+        {"rays", rayResults(stats.raysTraced, stats.nodesVisited, stats.primitivesIntersected)},
+        {"shadow_rays", rayResults(stats.shadowRaysTraced, stats.shadowNodesVisited, stats.shadowPrimitivesTested)}
+    };
+    s.reset();
+    if (measureMemory)
+        result["peak_rss"] = peakMemory();
+    return result;
+}
+
+//! The value of \a metric in \a run, or NaN if the run does not record it
+double metricValue(const json & run, const json::json_pointer & metric)
+{
+    try
+    {
+        const json & value = run.at(metric);
+        if (value.is_number())
+            return value.get<double>();
+    }
+    catch (const std::exception &)
+    {
+    }
+    return std::numeric_limits<double>::quiet_NaN();
+}
+
+//! Compare \a results to \a baseline run by run and return the number of regressions
+int compare(const json & results, const json & baseline, float tolerance)
+{
+    std::map<string, const json *> baselineRuns;
+    for (auto & r : baseline.at("runs"))
+        baselineRuns[r.at("name").get<string>()] = &r;
+
+    // the metrics to compare, and whether higher values are better
+    const std::vector<std::pair<json::json_pointer, bool>> metrics = {
+        {json::json_pointer("/parse_ms"), false},
+        {json::json_pointer("/build_ms"), false},
+        {json::json_pointer("/render_ms"), false},
+        {json::json_pointer("/mrays_per_s"), true},
+        {json::json_pointer("/rays/nodes_per_ray"), false},
+        {json::json_pointer("/rays/prims_per_ray"), false},
+        {json::json_pointer("/shadow_rays/nodes_per_ray"), false},
+        {json::json_pointer("/shadow_rays/prims_per_ray"), false},
+        {json::json_pointer("/peak_rss"), false}
+    };
+
+    int matched = 0, regressions = 0, improvements = 0;
+    for (auto & r : results["runs"])
+    {
+        auto b = baselineRuns.find(r["name"].get<string>());
+        if (b == baselineRuns.end())
+            continue;
+        ++matched;
+
+        for (auto & metric : metrics)
+        {
+            const string key = metric.first.to_string().substr(1);
+            double now = metricValue(r, metric.first), then = metricValue(*b->second, metric.first);
+            bool isTime = endsWith(key, "_ms");
+            // skip metrics that either run lacks
+            if (!(then > 0) || std::isnan(now) || (isTime && std::max(now, then) < minComparableTime))
+                continue;
+
+            double change = now / then - 1.0;
+            bool worse = metric.second ? change < -tolerance : change > tolerance;
+            bool better = metric.second ? change > tolerance : change < -tolerance;
+            if (worse)
+            {
+                ++regressions;
+                warning("REGRESSION %s %s: %g -> %g (%+.1f%%)\n", r["name"].get<string>(), key, then, now, 100 * change);
+            }
+            else if (better)
+            {
+                ++improvements;
+                message("improved   %s %s: %g -> %g (%+.1f%%)\n", r["name"].get<string>(), key, then, now, 100 * change);
+            }
+        }
+    }
+
+    message("compared %d of %d runs to the baseline: %d regressions, %d improvements (tolerance %.0f%%)\n",
+            matched, results["runs"].size(), regressions, improvements, 100 * tolerance);
+    return regressions;
+}
+
+} // namespace
+
+
+// renders a matrix of scenes, acceleration structures and thread counts and records the performance
+int main(int argc, char** argv)
+{
+    auto args = parseCmdline(argc, argv,
+    {
+        "bench", "benchmark parsing, building and rendering",
+        {
+            {"output", "o", "write the results to this JSON file", typeid(string), true, json("bench.json")},
+            {"compare", "c", "compare the results to a baseline written by an earlier run", typeid(string), true, json("")},
+            {"input", "i", "compare these saved results instead of running the benchmark", typeid(string), true, json("")},
+            {"tolerance", "t", "relative change that counts as a regression", typeid(float), true, json(0.1f)}
+        },
+        {
+            {"config", "", "JSON file with the \"scenes\" (testscene0-2, .json or .obj files), \"accelerators\", "
+                           "\"threads\" (0: one per core) and \"repeat\" to run (default: all test scenes)",
+             typeid(string), true, json("")}
+        }
+    });
+
+    json results;
+    try
+    {
+        if (args["input"].get<string>() != "")
+            results = loadJSON(args["input"]);
+        else
+        {
+            json config = defaultConfig();
+            if (args["config"].get<string>() != "")
+            {
+                json custom = loadJSON(args["config"]);
+                for (auto it = custom.begin(); it != custom.end(); ++it)
+                    config[it.key()] = it.value();
+            }
+            int repeat = config["repeat"];
+
+            results["system_threads"] = numSystemThreads();
+            results["runs"] = json::array();
+            for (auto & sceneName : config["scenes"])
+            {
+                json scene = loadScene(sceneName);
+                for (auto & accelerator : config["accelerators"])
+                {
+                    for (auto & threads : config["threads"])
+                    {
+                        int n = threads;
+                        string name = tfm::format("%s | %s | %s threads", sceneName.get<string>(), accelerator.dump(),
+                                                  n > 0 ? std::to_string(n) : string("all"));
+                        message("\n=== %s ===\n", name);
+                        results["runs"].push_back(run(name, scene, accelerator, n, repeat));
+                    }
+                }
+            }
+
+            std::ofstream out(args["output"].get<string>());
+            out << results.dump(4) << std::endl;
+            if (!out)
+                throw DirtException("could not write \"%s\"", args["output"].get<string>());
+        }
+
+        message("\n%-60s %10s %10s %10s %10s %10s\n", "run", "parse", "build", "render", "Mrays/s", "peak RSS");
+        for (auto & r : results["runs"])
+        {
+            string peak = r.count("peak_rss") ? memString(r["peak_rss"].get<size_t>()) : string("-");
+            message("%-60s %10s %10s %10s %10.2f %10s\n", r["name"].get<string>(),
+                    timeString(r["parse_ms"].get<double>()), timeString(r["build_ms"].get<double>()),
+                    timeString(r["render_ms"].get<double>()), r.value("mrays_per_s", 0.0), peak);
+        }
+
+        if (args["compare"].get<string>() != "")
+        {
+            if (compare(results, loadJSON(args["compare"]), args["tolerance"]) > 0)
+                return EXIT_FAILURE;
+        }
+    }
+    catch (const std::exception & e)
+    {
+        error("Benchmark failed: %s.\n", e.what());
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
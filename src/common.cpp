@@ -19,6 +19,7 @@
 
 #include "common.h"
 #include "transform.h"
+#include "simd.h"
 #include <Eigen/Geometry>
 #include <Eigen/LU>
 #include <cmath>
@@ -124,7 +125,10 @@ unsigned int toUInt(const std::string & str)
 
 
 Transform::Transform(const Eigen::Matrix4f &trafo)
-    : m_transform(trafo), m_inverse(trafo.inverse()) { }
+    : m_transform(trafo), m_inverse(trafo.inverse())
+{
+    update();
+}
 
 std::string Transform::toString() const
 {
@@ -137,3 +141,103 @@ Transform Transform::operator*(const Transform &t) const
 {
     return Transform(m_transform * t.m_transform, t.m_inverse * m_inverse);
 }
+
+#if defined(DIRT_SSE)
+namespace
+{
+
+// load a 3-vector (or the top of a matrix column) into the first three lanes
+inline __m128 load3(const float * v)
+{
+    return _mm_setr_ps(v[0], v[1], v[2], 0.0f);
+}
+
+inline void store3(float * v, __m128 r)
+{
+    _mm_storel_pi((__m64 *) v, r);
+    _mm_store_ss(v + 2, _mm_movehl_ps(r, r));
+}
+
+// c0*v.x + c1*v.y + c2*v.z for a 3-vector v
+inline __m128 multiply(const __m128 c[3], const float * v)
+{
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(c[0], _mm_set1_ps(v[0])),
+                                 _mm_mul_ps(c[1], _mm_set1_ps(v[1]))),
+                      _mm_mul_ps(c[2], _mm_set1_ps(v[2])));
+}
+
+} // namespace
+#endif
+
+void Transform::transformPoints(const Point3f * in, Point3f * out, size_t n) const
+{
+#if defined(DIRT_SSE)
+    if (!m_projective)
+    {
+        const float * m = m_transform.data();
+        const __m128 c[3] = {load3(m), load3(m + 4), load3(m + 8)};
+        const __m128 t = load3(m + 12);
+        for (size_t i = 0; i < n; ++i)
+            store3(out[i].data(), _mm_add_ps(multiply(c, in[i].data()), t));
+        return;
+    }
+#endif
+    for (size_t i = 0; i < n; ++i)
+        out[i] = operator*(in[i]);
+}
+
+void Transform::transformNormals(const Normal3f * in, Normal3f * out, size_t n) const
+{
+#if defined(DIRT_SSE)
+    if (!m_projective)
+    {
+        const float * m = m_normalMatrix.data();
+        const __m128 c[3] = {load3(m), load3(m + 3), load3(m + 6)};
+        for (size_t i = 0; i < n; ++i)
+        {
+            store3(out[i].data(), multiply(c, in[i].data()));
+            out[i].normalize();
+        }
+        return;
+    }
+#endif
+    for (size_t i = 0; i < n; ++i)
+        out[i] = operator*(in[i]);
+}
+
+void Transform::transformBoxes(const Box3f * in, Box3f * out, size_t n) const
+{
+#if defined(DIRT_SSE)
+    if (!m_projective)
+    {
+        // the SIMD version of the affine case of operator*(const Box3f &)
+        const float * m = m_transform.data();
+        const __m128 c[3] = {load3(m), load3(m + 4), load3(m + 8)};
+        const __m128 t = load3(m + 12);
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (in[i].isEmpty())
+            {
+                out[i] = in[i];
+                continue;
+            }
+
+            const float * lo = in[i].min().data();
+            const float * hi = in[i].max().data();
+            __m128 newMin = t, newMax = t;
+            for (int j = 0; j < 3; ++j)
+            {
+                __m128 a = _mm_mul_ps(c[j], _mm_set1_ps(lo[j]));
+                __m128 b = _mm_mul_ps(c[j], _mm_set1_ps(hi[j]));
+                newMin = _mm_add_ps(newMin, _mm_min_ps(a, b));
+                newMax = _mm_add_ps(newMax, _mm_max_ps(a, b));
+            }
+            store3(out[i].min().data(), newMin);
+            store3(out[i].max().data(), newMax);
+        }
+        return;
+    }
+#endif
+    for (size_t i = 0; i < n; ++i)
+        out[i] = operator*(in[i]);
+}
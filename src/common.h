@@ -37,6 +37,7 @@
 #include <iostream>
 #include <cstdio>
 #include <typeinfo>
+#include <cstdlib>
 #include <tinyformat.h>
 
 #ifdef __GNUC__
@@ -117,6 +118,7 @@ class Surface;
 class Sphere;
 class Quad;
 class Mesh;
+struct Prototype;
 class WavefrontOBJ;
 class Light;
 class Scene;
@@ -326,6 +328,50 @@ extern std::vector<std::string> tokenize(const std::string &s, const std::string
 //! Convert a string into an unsigned integer value
 extern unsigned int toUInt(const std::string &str);
 
+//! Minimal STL allocator returning memory aligned to \a Alignment bytes
+/*!
+    Used for arrays of small, hot structures (e.g. acceleration structure
+    nodes) that should not straddle cache lines:
+
+        std::vector<Node, AlignedAllocator<Node, 64>> nodes;
+*/
+template <typename T, size_t Alignment = 64>
+struct AlignedAllocator
+{
+    typedef T value_type;
+
+    template <typename U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+    AlignedAllocator() {}
+    template <typename U> AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+
+    T * allocate(size_t n)
+    {
+        void * ptr = nullptr;
+#if defined(_WIN32)
+        ptr = _aligned_malloc(n * sizeof(T), Alignment);
+#else
+        if (posix_memalign(&ptr, Alignment, n * sizeof(T)) != 0)
+            ptr = nullptr;
+#endif
+        if (!ptr)
+            throw std::bad_alloc();
+        return static_cast<T *>(ptr);
+    }
+
+    void deallocate(T * ptr, size_t)
+    {
+#if defined(_WIN32)
+        _aligned_free(ptr);
+#else
+        free(ptr);
+#endif
+    }
+
+    template <typename U> bool operator==(const AlignedAllocator<U, Alignment> &) const { return true; }
+    template <typename U> bool operator!=(const AlignedAllocator<U, Alignment> &) const { return false; }
+};
+
 //! Simple exception class, which stores a human-readable error description
 class DirtException: public std::runtime_error
 {
@@ -339,8 +385,52 @@ public:
 };
 
 // Acceleration structure stats parameters
-extern uint64_t primitives_intersected;
-extern uint64_t rays_traced;
+struct RayStats
+{
+    uint64_t primitivesIntersected = 0;     //!< ray-primitive intersection tests
+    uint64_t raysTraced = 0;                //!< rays traced through the scene
+    uint64_t nodesVisited = 0;              //!< acceleration structure nodes visited
+
+    // shadow rays (occlusion queries) are counted separately
+    uint64_t shadowPrimitivesTested = 0;    //!< ray-primitive occlusion tests
+    uint64_t shadowRaysTraced = 0;          //!< occlusion queries
+    uint64_t shadowNodesVisited = 0;        //!< acceleration structure nodes visited by occlusion queries
 
-#define INCREMENT_INTERSECTED_PRIMS primitives_intersected++
-#define INCREMENT_TRACED_RAYS rays_traced++
+    RayStats & operator+=(const RayStats & o)
+    {
+        primitivesIntersected += o.primitivesIntersected;
+        raysTraced += o.raysTraced;
+        nodesVisited += o.nodesVisited;
+        shadowPrimitivesTested += o.shadowPrimitivesTested;
+        shadowRaysTraced += o.shadowRaysTraced;
+        shadowNodesVisited += o.shadowNodesVisited;
+        return *this;
+    }
+
+    RayStats operator-(const RayStats & o) const
+    {
+        RayStats r = *this;
+        r.primitivesIntersected -= o.primitivesIntersected;
+        r.raysTraced -= o.raysTraced;
+        r.nodesVisited -= o.nodesVisited;
+        r.shadowPrimitivesTested -= o.shadowPrimitivesTested;
+        r.shadowRaysTraced -= o.shadowRaysTraced;
+        r.shadowNodesVisited -= o.shadowNodesVisited;
+        return r;
+    }
+};
+
+//! Statistics gathered by the calling thread
+/*!
+    Every thread counts into its own copy, so counting needs no
+    synchronization. Multi-threaded loops (e.g. \ref Scene::raytrace) add
+    what their workers gathered to the copy of the thread that started them.
+*/
+extern thread_local RayStats rayStats;
+
+#define INCREMENT_INTERSECTED_PRIMS rayStats.primitivesIntersected++
+#define INCREMENT_TRACED_RAYS rayStats.raysTraced++
+#define INCREMENT_VISITED_NODES rayStats.nodesVisited++
+#define INCREMENT_SHADOW_PRIMS rayStats.shadowPrimitivesTested++
+#define INCREMENT_SHADOW_RAYS rayStats.shadowRaysTraced++
+#define INCREMENT_SHADOW_VISITED_NODES rayStats.shadowNodesVisited++
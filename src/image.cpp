@@ -18,9 +18,14 @@
 */
 
 #include "image.h"
+#include "parallel.h"
+#include "pngencoder.h"
 #include <math.h>
 #include <iostream>
 #include <sstream>
+#include <cstring>
+#include <array>
+#include <limits>
 
 #define STB_IMAGE_IMPLEMENTATION
 
@@ -65,6 +70,107 @@ string getFileExtension(const string& filename)
     return "";
 }
 
+string lowerCaseExtension(const string& filename)
+{
+    string extension = getFileExtension(filename);
+    transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension;
+}
+
+// the 8-bit sRGB value of a linear color channel, the way Color3f::toSRGB() rounds it
+unsigned char referenceSRGB8(float linear)
+{
+    Color3f c = Color3f(linear).toSRGB();
+    return (unsigned char) clamp(c[0] * 255.0f, 0.0f, 255.0f);
+}
+
+//! Converts linear values to 8-bit sRGB without calling pow for every pixel
+/*!
+    Rather than tabulating a quantized input (which would round differently
+    from the exact conversion), the table stores for every output value the
+    smallest float that reaches it. For non-negative floats the bit patterns
+    are ordered like the values, so a second table indexed by the top 16 bits
+    gives a starting value that needs at most a few steps to refine. Results
+    are identical to \ref referenceSRGB8.
+*/
+class SRGBTable
+{
+public:
+    SRGBTable()
+    {
+        // bisect over the float bit patterns in [0, 2] for the first one reaching k
+        m_threshold[0] = 0;
+        for (int k = 1; k < 256; ++k)
+        {
+            uint32_t lo = m_threshold[k - 1], hi = twoBits;
+            while (lo < hi)
+            {
+                uint32_t mid = lo + (hi - lo) / 2;
+                if (referenceSRGB8(fromBits(mid)) >= k)
+                    hi = mid;
+                else
+                    lo = mid + 1;
+            }
+            m_threshold[k] = lo;
+        }
+        m_threshold[256] = std::numeric_limits<uint32_t>::max();
+
+        int k = 0;
+        for (auto i : range(int(m_start.size())))
+        {
+            while (m_threshold[k + 1] <= uint32_t(i) << 16)
+                ++k;
+            m_start[i] = uint8_t(k);
+        }
+    }
+
+    unsigned char operator()(float linear) const
+    {
+        // also catches NaNs
+        if (!(linear > 0.0f))
+            return 0;
+        // toSRGB() maps 1 itself to slightly less than 1, so the table extends to 2
+        if (linear >= 2.0f)
+            return 255;
+
+        uint32_t bits;
+        memcpy(&bits, &linear, sizeof(bits));
+        int k = m_start[bits >> 16];
+        while (bits >= m_threshold[k + 1])
+            ++k;
+        return (unsigned char) k;
+    }
+
+private:
+    static const uint32_t twoBits = 0x40000000;
+
+    static float fromBits(uint32_t bits)
+    {
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+
+    uint32_t m_threshold[257];
+    std::array<uint8_t, (twoBits >> 16) + 1> m_start;
+};
+
+// convert a linear color to 8-bit sRGB
+void toSRGB8(const Color3f & linear, float gain, unsigned char * rgb)
+{
+    static const SRGBTable table;
+    for (auto i : range(3))
+        rgb[i] = table(linear[i] * gain);
+}
+
+// convert rows [y0, y1) of an image to 8-bit sRGB
+void toSRGB8(const Image3f & image, int y0, int y1, float gain, unsigned char * rgb)
+{
+    for (auto y : range(y0, y1))
+        for (auto x : range(image.width()))
+            toSRGB8(image(x, y), gain, rgb + 3 * (size_t(y - y0) * image.width() + x));
+}
+
 } // namespace
 
 
@@ -118,45 +224,96 @@ bool Image3f::load(const string & filename)
     return false;
 }
 
-bool Image3f::save(const string & filename, float gain)
+bool Image3f::save(const string & filename, float gain, int pngLevel)
 {
-    string extension = getFileExtension(filename);
-
-    transform(extension.begin(),
-              extension.end(),
-              extension.begin(),
-              ::tolower);
+    string extension = lowerCaseExtension(filename);
 
     if (extension == "hdr")
         return stbi_write_hdr(filename.c_str(), width(), height(), 3, (const float *) data()) != 0;
-    else
+    else if (ImageWriter::supports(filename))
     {
-        // convert floating-point image to 8-bit per channel
-        vector<unsigned char> data(width()*height()*3, 0);
-        for (auto y : range(height()))
-            for (auto x : range(width()))
-            {
-                Color3f c = (*this)(x,y) * gain;
-                c = c.toSRGB();
-
-                // convert to [0-255] range
-                c.r() = clamp(c.r() * 255.0f, 0.0f, 255.0f);
-                c.g() = clamp(c.g() * 255.0f, 0.0f, 255.0f);
-                c.b() = clamp(c.b() * 255.0f, 0.0f, 255.0f);
-
-                data[3*x + 3*y*width() + 0] = (unsigned char) c[0];
-                data[3*x + 3*y*width() + 1] = (unsigned char) c[1];
-                data[3*x + 3*y*width() + 2] = (unsigned char) c[2];
-            }
+        ImageWriter writer(filename, width(), height(), gain);
+        return writer.writeRows(0, *this);
+    }
+    else if (extension == "png" || extension == "bmp" || extension == "tga")
+    {
+        // convert floating-point image to 8-bit per channel, a band of rows per task
+        ThreadPool pool;
+        vector<unsigned char> data(size_t(width())*height()*3, 0);
+        const int band = 16;
+        parallelFor(pool, 0, (height() + band - 1) / band, [&](int i)
+        {
+            int y0 = i * band, y1 = std::min(height(), y0 + band);
+            toSRGB8(*this, y0, y1, gain, &data[size_t(y0) * width() * 3]);
+        });
 
         if (extension == "png")
-            return stbi_write_png(filename.c_str(), width(), height(),
-                                  3, &data[0], sizeof(unsigned char)*width()*3) != 0;
+            return writePNG(filename, width(), height(), data.data(), pngLevel, pool);
         else if (extension == "bmp")
             return stbi_write_bmp(filename.c_str(), width(), height(), 3, &data[0]) != 0;
-        else if (extension == "tga")
-            return stbi_write_tga(filename.c_str(), width(), height(), 3, &data[0]) != 0;
         else
-            throw DirtException("Could not determine desired file type from extension.");
+            return stbi_write_tga(filename.c_str(), width(), height(), 3, &data[0]) != 0;
     }
+    else
+        throw DirtException("Could not determine desired file type from extension.");
+}
+
+ImageWriter::ImageWriter(const string & filename, int width, int height, float gain) :
+    m_width(width), m_height(height), m_gain(gain)
+{
+    string extension = lowerCaseExtension(filename);
+    if (extension != "pfm" && extension != "ppm")
+        throw DirtException("Cannot stream images to \"%s\", only to .pfm and .ppm files.", filename);
+    m_float = extension == "pfm";
+
+    m_file.open(filename, ios::binary | ios::trunc);
+    if (!m_file)
+        throw DirtException("Could not create \"%s\".", filename);
+
+    // a negative PFM scale means little-endian floats
+    uint16_t one = 1;
+    bool littleEndian = *reinterpret_cast<unsigned char *>(&one) == 1;
+    string header = m_float ? tfm::format("PF\n%d %d\n%s\n", width, height, littleEndian ? "-1.0" : "1.0")
+                            : tfm::format("P6\n%d %d\n255\n", width, height);
+    m_file.write(header.data(), header.size());
+    m_headerSize = std::streamoff(header.size());
+}
+
+bool ImageWriter::supports(const string & filename)
+{
+    string extension = lowerCaseExtension(filename);
+    return extension == "pfm" || extension == "ppm";
+}
+
+bool ImageWriter::writeRows(int y, const Image3f & rows)
+{
+    if (rows.width() != m_width || y < 0 || y + rows.height() > m_height)
+        return false;
+
+    // convert the rows in the order they appear in the file
+    std::streamoff rowSize = std::streamoff(m_width) * 3 * (m_float ? sizeof(float) : 1);
+    vector<char> buffer(size_t(rowSize) * rows.height());
+    for (auto j : range(rows.height()))
+    {
+        int fileRow = m_float ? rows.height() - 1 - j : j;
+        char * out = &buffer[size_t(rowSize) * fileRow];
+        for (auto x : range(m_width))
+        {
+            if (m_float)
+            {
+                Color3f c = rows(x, j) * m_gain;
+                memcpy(out + 12 * x, c.data(), 12);
+            }
+            else
+                toSRGB8(rows(x, j), m_gain, reinterpret_cast<unsigned char *>(out + 3 * x));
+        }
+    }
+
+    // PFM stores the bottom row first
+    int firstRow = m_float ? m_height - y - rows.height() : y;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_file.seekp(m_headerSize + rowSize * firstRow);
+    m_file.write(buffer.data(), buffer.size());
+    m_file.flush();
+    return bool(m_file);
 }
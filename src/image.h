@@ -21,6 +21,8 @@
 
 #include "common.h"
 #include "color.h"
+#include <fstream>
+#include <mutex>
 
 //! A floating-point RGB image
 struct Image3f
@@ -36,7 +38,13 @@ struct Image3f
     //! load an image from file
     bool load(const std::string & filename);
     //! save an image to file
-    bool save(const std::string & filename, float gain = 1.0f);
+    /*!
+        The format follows the extension: png, bmp, tga (8-bit sRGB), hdr,
+        pfm (floating point) or ppm (8-bit sRGB, binary). 8-bit images are
+        converted and PNGs compressed on all cores; \a pngLevel trades PNG
+        encoding speed (1) for file size (9), 0 stores the pixels uncompressed.
+    */
+    bool save(const std::string & filename, float gain = 1.0f, int pngLevel = 6);
 
     // image width
     int width() const               {return m_width;}
@@ -59,3 +67,45 @@ private:
     int m_width, m_height;
     vector<Color3f> m_data;
 };
+
+//! Writes an image to a PFM or PPM file in bands of rows, in any order
+/*!
+    Both formats store all rows with the same size after a short header, so
+    every band is written straight to its place in the file and the writer
+    keeps no pixels in memory. This lets renderers stream images much larger
+    than the memory they would take as an \ref Image3f.
+
+    PFM files store the linear floating-point colors (bottom row first, as
+    the format requires), PPM files 8-bit sRGB colors. \ref writeRows() may
+    be called from several threads at once.
+*/
+class ImageWriter
+{
+public:
+    //! Create \a filename for an image of \a width x \a height pixels, scaled by \a gain
+    /*!
+        Throws a \ref DirtException if the extension is neither pfm nor ppm,
+        or the file cannot be created.
+    */
+    ImageWriter(const std::string & filename, int width, int height, float gain = 1.0f);
+
+    //! Return whether \a filename has an extension the writer supports
+    static bool supports(const std::string & filename);
+
+    int width() const               {return m_width;}
+    int height() const              {return m_height;}
+
+    //! Write all rows of \a rows (which must be as wide as the image), starting at row \a y
+    /*!
+        \return whether the rows were written successfully
+    */
+    bool writeRows(int y, const Image3f & rows);
+
+private:
+    std::ofstream m_file;
+    std::mutex m_mutex;
+    int m_width, m_height;
+    float m_gain;
+    bool m_float;                           //!< PFM, otherwise PPM
+    std::streamoff m_headerSize;
+};
@@ -0,0 +1,86 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer, used in
+    Dartmouth's COSC 77/177 Computer Graphics course.
+
+    Copyright (c) 2016 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "instance.h"
+#include "scene.h"
+
+Prototype::Prototype(Surface * s, Accelerator * accelerator) :
+    surface(s), blas(accelerator)
+{
+    for (auto i : range(int(s->numPrimitives())))
+        bounds.extend(s->worldBBox(i));
+    blas->addSurface(s);
+    blas->build();
+}
+
+
+Instance::Instance(const Scene & scene, const json & j) : Surface(scene, j)
+{
+    string name;
+    Parser::get(j, name, "prototype");
+    m_prototype = scene.findPrototype(name);
+    if (!m_prototype)
+        throw DirtException("Unknown prototype \"%s\" in instance specification:\n\t%s", name, j.dump());
+
+    m_toPrototype = m_xform.inverse();
+    m_ownMaterial = j.count("material") > 0;
+}
+
+bool Instance::intersect(uint32_t index, const Ray3f & ray, Intersection3f & its) const
+{
+    HitRecord hit;
+    if (!findHit(index, ray, hit))
+        return false;
+    computeHitDetails(ray, hit, its);
+    return true;
+}
+
+bool Instance::findHit(uint32_t, const Ray3f & ray, HitRecord & hit) const
+{
+    // the prototype has a single surface, so only the instance needs recording
+    if (!m_prototype->blas->findHit(m_toPrototype.transformSegment(ray), hit))
+        return false;
+    hit.surface = this;
+    return true;
+}
+
+void Instance::computeHitDetails(const Ray3f & ray, const HitRecord & hit, Intersection3f & its) const
+{
+    HitRecord prototypeHit = hit;
+    prototypeHit.surface = m_prototype->surface;
+    m_prototype->surface->computeHitDetails(m_toPrototype.transformSegment(ray), prototypeHit, its);
+
+    its.p = ray(hit.t);
+    its.gn = m_xform * its.gn;
+    its.sn = m_xform * its.sn;
+    its.surface = this;
+    if (m_ownMaterial)
+        its.mat = m_material;
+}
+
+void Instance::setTransform(const Transform & xform)
+{
+    m_xform = xform;
+    m_toPrototype = m_xform.inverse();
+}
+
+bool Instance::occluded(uint32_t, const Ray3f & ray) const
+{
+    return m_prototype->blas->occluded(m_toPrototype.transformSegment(ray));
+}
@@ -0,0 +1,70 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer, used in
+    Dartmouth's COSC 77/177 Computer Graphics course.
+
+    Copyright (c) 2016 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "accelerator.h"
+
+//! A surface with its own acceleration structure, shared by all its \ref Instance "instances"
+/*!
+    Declared in the scene's "prototypes" list, which takes regular surface
+    specifications plus a "name" and an optional "accelerator" (defaults to the
+    scene's). Prototypes are not rendered themselves.
+*/
+struct Prototype
+{
+    const Surface * surface = nullptr;  //!< the shared surface, owned by \ref blas
+    Accelerator * blas = nullptr;       //!< bottom-level acceleration structure over \ref surface
+    Box3f bounds;                       //!< bounds of \ref surface in prototype space
+
+    Prototype(Surface * s, Accelerator * accelerator);
+    ~Prototype() { delete blas; }
+};
+
+
+//! A copy of a \ref Prototype placed in the scene with its own transform
+/*!
+    The scene's acceleration structure treats every instance as a single
+    primitive bounded by the transformed prototype bounds, which makes it a
+    top-level structure over the instances. Rays that reach an instance are
+    transformed into prototype space and traced through the prototype's own
+    bottom-level structure. The direction is not renormalized, so hit
+    distances are the same in both spaces.
+
+    Parameters: "prototype" (name of the prototype), "transform", and an
+    optional "material" replacing the prototype's material.
+*/
+class Instance : public Surface
+{
+public:
+    Instance(const Scene & scene, const json & j = json());
+
+    virtual Box3f localBBox(uint32_t) const override { return m_prototype->bounds; }
+
+    virtual bool intersect(uint32_t index, const Ray3f & ray, Intersection3f & its) const override;
+    virtual bool findHit(uint32_t index, const Ray3f & ray, HitRecord & hit) const override;
+    virtual void computeHitDetails(const Ray3f & ray, const HitRecord & hit, Intersection3f & its) const override;
+    virtual bool occluded(uint32_t index, const Ray3f & ray) const override;
+    virtual void setTransform(const Transform & xform) override;
+
+protected:
+    const Prototype * m_prototype = nullptr;
+    Transform m_toPrototype;            //!< inverse of m_xform
+    bool m_ownMaterial = false;         //!< whether hits use m_material instead of the prototype's
+};
@@ -0,0 +1,121 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer, used in
+    Dartmouth's COSC 77/177 Computer Graphics course.
+
+    Copyright (c) 2016 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "mappedfile.h"
+#include <cstring>
+#include <fstream>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include <sys/stat.h>
+
+MappedFile::MappedFile(const std::string & filename)
+{
+#if !defined(_WIN32)
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw DirtException("Unable to open \"%s\"!", filename);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throw DirtException("Unable to read \"%s\"!", filename);
+    }
+
+    m_size = size_t(st.st_size);
+    if (m_size > 0)
+    {
+        void * p = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            close(fd);
+            throw DirtException("Unable to map \"%s\"!", filename);
+        }
+        m_data = static_cast<const uint8_t *>(p);
+    }
+    // the mapping stays valid after closing the descriptor
+    close(fd);
+#else
+    std::ifstream is(filename, std::ios::binary);
+    if (is.fail())
+        throw DirtException("Unable to open \"%s\"!", filename);
+    m_buffer.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+    m_data = m_buffer.data();
+    m_size = m_buffer.size();
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#if !defined(_WIN32)
+    if (m_data)
+        munmap(const_cast<uint8_t *>(m_data), m_size);
+#endif
+}
+
+
+uint64_t hashBytes(const void * data, size_t size, uint64_t seed)
+{
+    // 64-bit FNV-1a over 8-byte words, with a final avalanche; plenty to tell files apart
+    const uint64_t prime = 0x100000001b3ull;
+    uint64_t h = 0xcbf29ce484222325ull ^ seed ^ (uint64_t(size) * prime);
+    const uint8_t * bytes = static_cast<const uint8_t *>(data);
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t w;
+        std::memcpy(&w, bytes + i, 8);
+        h = (h ^ w) * prime;
+        h ^= h >> 32;
+    }
+    for (; i < size; ++i)
+        h = (h ^ bytes[i]) * prime;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h;
+}
+
+
+bool fileStatus(const std::string & filename, uint64_t & size, int64_t & modified)
+{
+#if defined(_WIN32)
+    struct _stat64 st;
+    if (_stat64(filename.c_str(), &st) != 0)
+        return false;
+    modified = int64_t(st.st_mtime) * 1000000000;
+#else
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0)
+        return false;
+#if defined(__APPLE__)
+    modified = int64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    modified = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#endif
+    size = uint64_t(st.st_size);
+    return true;
+}
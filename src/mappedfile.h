@@ -0,0 +1,121 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer, used in
+    Dartmouth's COSC 77/177 Computer Graphics course.
+
+    Copyright (c) 2016 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common.h"
+#include <memory>
+
+//! A read-only view of a whole file, memory-mapped where the platform allows it
+/*!
+    The contents are paged in on demand, so opening even a large file is
+    nearly free. Throws a \ref DirtException if the file cannot be opened.
+*/
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string & filename);
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator=(const MappedFile &) = delete;
+
+    const uint8_t * data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    const uint8_t * m_data = nullptr;
+    size_t m_size = 0;
+    std::vector<uint8_t> m_buffer;      //!< file contents where mmap is not available
+};
+
+
+//! 64-bit hash of \a size bytes, e.g. to detect whether a file changed
+uint64_t hashBytes(const void * data, size_t size, uint64_t seed = 0);
+
+//! Get the size and modification time (in nanoseconds, where available) of a file without opening it
+/*!
+    \return whether the file exists and could be queried
+*/
+bool fileStatus(const std::string & filename, uint64_t & size, int64_t & modified);
+
+
+//! A read-only array that either owns its elements or refers to memory owned elsewhere
+/*!
+    Meshes loaded from a cache (see \ref Mesh) refer straight into the mapped
+    cache file instead of copying it; \a keepAlive holds whatever owns that
+    memory. Contents are replaced as a whole by assigning a std::vector.
+*/
+template <typename T>
+class DataBuffer
+{
+public:
+    DataBuffer() = default;
+    DataBuffer(DataBuffer &&) = default;
+    DataBuffer & operator=(DataBuffer &&) = default;
+
+    DataBuffer(const DataBuffer & other) :
+        m_owned(other.m_owned), m_keepAlive(other.m_keepAlive)
+    {
+        m_data = m_keepAlive ? other.m_data : m_owned.data();
+        m_size = other.m_size;
+    }
+
+    DataBuffer & operator=(const DataBuffer & other)
+    {
+        return *this = DataBuffer(other);
+    }
+
+    //! Take over the elements of \a v
+    DataBuffer & operator=(std::vector<T> && v)
+    {
+        m_owned = std::move(v);
+        m_keepAlive.reset();
+        m_data = m_owned.data();
+        m_size = m_owned.size();
+        return *this;
+    }
+
+    //! Refer to \a n elements at \a data, which stay valid as long as \a keepAlive exists
+    void reference(const T * data, size_t n, std::shared_ptr<const void> keepAlive)
+    {
+        m_owned = std::vector<T>();
+        m_keepAlive = std::move(keepAlive);
+        m_data = data;
+        m_size = n;
+    }
+
+    void clear() { *this = std::vector<T>(); }
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    const T * data() const { return m_data; }
+    const T * begin() const { return m_data; }
+    const T * end() const { return m_data + m_size; }
+    const T & operator[](size_t i) const { return m_data[i]; }
+
+    //! Whether the elements live in memory owned elsewhere
+    bool isReference() const { return m_keepAlive != nullptr; }
+
+private:
+    std::vector<T> m_owned;
+    const T * m_data = nullptr;
+    size_t m_size = 0;
+    std::shared_ptr<const void> m_keepAlive;
+};
@@ -47,70 +47,20 @@ Color3f Material::shade(const Ray3f & ray, const Intersection3f & its,
     //message("%s",kd);
     
     for(auto i:range(lights.size())){
-        Vector3f l =  (lights[i]->xform)*Point3f(0.0f,0.0f,0.0f) - its.p;//compute light
-        Normal3f l_n = l.normalized();//light direction
-        
         //if light hit some object on the way to the object
-        auto mint = 0.00005f;
-        auto maxt = sqrt(l.dot(l)) - 0.00005f;
-        Ray3f lightray(its.p,l_n);
-        Ray3f lightscale(lightray,mint,maxt);
-        Intersection3f l_its;
-        
-        
-        if(scene.intersect(lightscale, l_its)){
-            Accumulate += Color3f::Zero();
-            //avoid shadow ance
-        }
-        else{
-            //diffuse shading
-            Vector3f kdv = Vector3f(kd[0],kd[1],kd[2]);
-            Vector3f Ld = Vector3f(kdv[0]*lights[i]->intensity[0],kdv[1]*lights[i]->intensity[1],kdv[2]*lights[i]->intensity[2]) * max(0.0f,l_n.dot(its.sn))/l.dot(l);
-            //Boling phong
-            Vector3f ksv = Vector3f(ks[0],ks[1],ks[2]);
-            //Vector3f h = 2*(its.gn.dot(l_n)*its.gn) - l_n;
-            Vector3f h = (l_n - ray.d).normalized();
-            Vector3f Ls = Vector3f(ksv[0]*lights[i]->intensity[0],ksv[1]*lights[i]->intensity[1],ksv[2]*lights[i]->intensity[2]) * pow(max(0.0f,its.sn.dot(h)),n)/l.dot(l);
-            
-            
-            
-            Accumulate = Accumulate + Color3f(Ld[0],Ld[1],Ld[2])+ Color3f(Ls[0],Ls[1],Ls[2]) ;
-        }
-        
+        if(!scene.occluded(shadowRay(its, *lights[i])))
+            addLight(ray, its, *lights[i], Accumulate);
     }
+
     //Specular Reflection
-    if(ray.depth < 5)
-     if(!(kr[0] == 0.0f && kr[1] == 0.0f && kr[2] == 0.0f)){
-        Vector3f krv = Vector3f(kr[0],kr[1],kr[2]);
-        Normal3f r = (2*its.sn*(its.sn.dot(-ray.d)) + ray.d).normalized();
-        Ray3f reflect_ray(its.p,r);
-        reflect_ray.depth = ray.depth + 1;
-        Color3f trace = scene.radiance(reflect_ray);
-        Vector3f trace_color = Vector3f(trace[0],trace[1],trace[2]);
-        Vector3f Lr = Vector3f(krv[0] * trace_color[0],krv[1] * trace_color[1],krv[2] * trace_color[2]);
-        Accumulate = Accumulate + Color3f(Lr[0],Lr[1],Lr[2]);
-     }
+    Ray3f reflect_ray;
+    if(reflectedRay(ray, its, reflect_ray))
+        addReflected(scene.radiance(reflect_ray), Accumulate);
     
     //Refraction
-    if(ray.depth < 5)
-        if(!(kt[0] == 0.0f && kt[1] == 0.0f && kt[2] == 0.0f)){
-            auto r = 1/ior;
-            Vector3f surface_n = its.sn;
-            Vector3f ktv = Vector3f(kt[0],kt[1],kt[2]);
-        
-            if(ray.d.dot(its.sn) > 0){
-             r = ior/1;
-             surface_n = -its.sn;
-            }
-            auto temp = (-ray.d).dot(surface_n);
-            Vector3f t = (r*(temp*surface_n + ray.d) - surface_n*sqrt(1 - r*r*(1 - temp*temp))).normalized();
-            Ray3f refraction_ray(its.p,t);
-            refraction_ray.depth = ray.depth + 1;
-            Color3f trace_refra = scene.radiance(refraction_ray);
-            Vector3f trace_refra_color = Vector3f(trace_refra[0],trace_refra[1],trace_refra[2]);
-            Vector3f Lt = Vector3f(ktv[0] * trace_refra_color[0] , ktv[1] * trace_refra_color[1],ktv[2] * trace_refra_color[2]);
-            Accumulate = Accumulate + Color3f(Lt[0],Lt[1],Lt[2]);
-        }
+    Ray3f refraction_ray;
+    if(refractedRay(ray, its, refraction_ray))
+        addRefracted(scene.radiance(refraction_ray), Accumulate);
 
     
     return Accumulate;
@@ -122,3 +72,80 @@ Color3f Material::shade(const Ray3f & ray, const Intersection3f & its,
     
     // return the accumulated color (for now the surface normal)
 }
+
+Ray3f Material::shadowRay(const Intersection3f & its, const Light & light)
+{
+    Vector3f l =  (light.xform)*Point3f(0.0f,0.0f,0.0f) - its.p;//compute light
+    Normal3f l_n = l.normalized();//light direction
+
+    //avoid shadow acne
+    auto mint = 0.00005f;
+    auto maxt = sqrt(l.dot(l)) - 0.00005f;
+    Ray3f lightray(its.p,l_n);
+    return Ray3f(lightray,mint,maxt);
+}
+
+void Material::addLight(const Ray3f & ray, const Intersection3f & its,
+                        const Light & light, Color3f & Accumulate) const
+{
+    Vector3f l =  (light.xform)*Point3f(0.0f,0.0f,0.0f) - its.p;//compute light
+    Normal3f l_n = l.normalized();//light direction
+
+    //diffuse shading
+    Vector3f kdv = Vector3f(kd[0],kd[1],kd[2]);
+    Vector3f Ld = Vector3f(kdv[0]*light.intensity[0],kdv[1]*light.intensity[1],kdv[2]*light.intensity[2]) * max(0.0f,l_n.dot(its.sn))/l.dot(l);
+    //Boling phong
+    Vector3f ksv = Vector3f(ks[0],ks[1],ks[2]);
+    //Vector3f h = 2*(its.gn.dot(l_n)*its.gn) - l_n;
+    Vector3f h = (l_n - ray.d).normalized();
+    Vector3f Ls = Vector3f(ksv[0]*light.intensity[0],ksv[1]*light.intensity[1],ksv[2]*light.intensity[2]) * pow(max(0.0f,its.sn.dot(h)),n)/l.dot(l);
+
+    Accumulate = Accumulate + Color3f(Ld[0],Ld[1],Ld[2])+ Color3f(Ls[0],Ls[1],Ls[2]) ;
+}
+
+bool Material::reflectedRay(const Ray3f & ray, const Intersection3f & its, Ray3f & reflect_ray) const
+{
+    if(ray.depth >= MaxDepth || (kr[0] == 0.0f && kr[1] == 0.0f && kr[2] == 0.0f))
+        return false;
+
+    Normal3f r = (2*its.sn*(its.sn.dot(-ray.d)) + ray.d).normalized();
+    reflect_ray = Ray3f(its.p,r);
+    reflect_ray.depth = ray.depth + 1;
+    return true;
+}
+
+bool Material::refractedRay(const Ray3f & ray, const Intersection3f & its, Ray3f & refraction_ray) const
+{
+    if(ray.depth >= MaxDepth || (kt[0] == 0.0f && kt[1] == 0.0f && kt[2] == 0.0f))
+        return false;
+
+    auto r = 1/ior;
+    Vector3f surface_n = its.sn;
+
+    if(ray.d.dot(its.sn) > 0){
+     r = ior/1;
+     surface_n = -its.sn;
+    }
+    auto temp = (-ray.d).dot(surface_n);
+    // under total internal reflection the direction is NaN and the ray sees nothing
+    Vector3f t = (r*(temp*surface_n + ray.d) - surface_n*sqrt(1 - r*r*(1 - temp*temp))).normalized();
+    refraction_ray = Ray3f(its.p,t);
+    refraction_ray.depth = ray.depth + 1;
+    return true;
+}
+
+void Material::addReflected(const Color3f & trace, Color3f & Accumulate) const
+{
+    Vector3f krv = Vector3f(kr[0],kr[1],kr[2]);
+    Vector3f trace_color = Vector3f(trace[0],trace[1],trace[2]);
+    Vector3f Lr = Vector3f(krv[0] * trace_color[0],krv[1] * trace_color[1],krv[2] * trace_color[2]);
+    Accumulate = Accumulate + Color3f(Lr[0],Lr[1],Lr[2]);
+}
+
+void Material::addRefracted(const Color3f & trace_refra, Color3f & Accumulate) const
+{
+    Vector3f ktv = Vector3f(kt[0],kt[1],kt[2]);
+    Vector3f trace_refra_color = Vector3f(trace_refra[0],trace_refra[1],trace_refra[2]);
+    Vector3f Lt = Vector3f(ktv[0] * trace_refra_color[0] , ktv[1] * trace_refra_color[1],ktv[2] * trace_refra_color[2]);
+    Accumulate = Accumulate + Color3f(Lt[0],Lt[1],Lt[2]);
+}
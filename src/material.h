@@ -44,6 +44,29 @@ public:
     Color3f shade(const Ray3f & ray, const class Intersection3f & its,
                   const class Scene & scene) const;
 
+    //! \name Building blocks of shade()
+    //! Renderers that do not trace recursively (e.g. the wavefront renderer in
+    //! Scene) combine these in the same order as \ref shade(), so they produce
+    //! exactly the same colors.
+    //@{
+    //! Return the shadow ray from the hit point towards \a light
+    static Ray3f shadowRay(const class Intersection3f & its, const class Light & light);
+    //! Add the unshadowed contribution of \a light to \a result
+    void addLight(const Ray3f & ray, const class Intersection3f & its,
+                  const class Light & light, Color3f & result) const;
+    //! Create the mirror reflection ray, return false if the material does not reflect
+    bool reflectedRay(const Ray3f & ray, const class Intersection3f & its, Ray3f & reflected) const;
+    //! Create the refracted ray, return false if the material is not transparent
+    bool refractedRay(const Ray3f & ray, const class Intersection3f & its, Ray3f & refracted) const;
+    //! Add the radiance arriving along the reflected ray, scaled by kr, to \a result
+    void addReflected(const Color3f & incoming, Color3f & result) const;
+    //! Add the radiance arriving along the refracted ray, scaled by kt, to \a result
+    void addRefracted(const Color3f & incoming, Color3f & result) const;
+    //@}
+
+    //! Maximum ray depth up to which reflected and refracted rays are traced
+    static const int MaxDepth = 5;
+
 public:
     Color3f kd = Color3f::Ones();           //!< diffuse coefficient
     Color3f ks = Color3f::Zero();           //!< specular coefficient
@@ -18,36 +18,203 @@
 */
 
 #include "mesh.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 
-// Ray-Triangle intersection
-// p0, p1, p2 - Triangle vertices
-// n0, n1, n2 - optional per vertex normal data
-bool Mesh::singleTriangleIntersect(const Ray3f& ray, const Vector3f& p0, const Vector3f& p1, const Vector3f& p2,
-    const Normal3f* n0, const Normal3f* n1, const Normal3f* n2, Intersection3f& its)
+// local functions
+namespace
+{
+
+// layout of the geometry cache files written by Mesh::saveCache
+const char CacheMagic[8] = {'D', 'I', 'R', 'T', 'M', 'S', 'H', '\0'};
+const uint32_t CacheVersion = 2;
+const uint64_t CacheAlignment = 16;
+
+struct CacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t sourceSize;                //!< Mesh::CacheSource the cache was built from
+    int64_t sourceModified;
+    uint64_t transformHash;
+    uint64_t contentHash;
+    uint64_t fileSize;
+    uint64_t count[4];                  //!< number of positions, normals, texture coordinates and faces
+    uint64_t offset[4];                 //!< byte offsets of the arrays, each aligned to CacheAlignment
+};
+
+static_assert(sizeof(Point3f) == 3 * sizeof(float), "unexpected padding in Point3f");
+static_assert(sizeof(Normal3f) == 3 * sizeof(float), "unexpected padding in Normal3f");
+static_assert(sizeof(Point2f) == 2 * sizeof(float), "unexpected padding in Point2f");
+static_assert(sizeof(Vector3i) == 3 * sizeof(int), "unexpected padding in Vector3i");
+
+const size_t CacheElementSize[4] = {sizeof(Point3f), sizeof(Normal3f), sizeof(Point2f), sizeof(Vector3i)};
+
+inline uint64_t alignUp(uint64_t x)
+{
+    return (x + CacheAlignment - 1) / CacheAlignment * CacheAlignment;
+}
+
+// Octahedral normal encoding (Meyer et al. 2010): project the unit sphere onto
+// an octahedron, unfold it into a square and store both coordinates as 16-bit snorm.
+inline float signNotZero(float x)
+{
+    return x >= 0.0f ? 1.0f : -1.0f;
+}
+
+uint32_t encodeOctahedral(const Normal3f & n)
+{
+    float l1 = std::abs(n.x()) + std::abs(n.y()) + std::abs(n.z());
+    if (l1 == 0.0f)
+        return 0;
+    float x = n.x() / l1, y = n.y() / l1;
+    if (n.z() < 0.0f)
+    {
+        float fx = (1.0f - std::abs(y)) * signNotZero(x);
+        y = (1.0f - std::abs(x)) * signNotZero(y);
+        x = fx;
+    }
+    auto snorm = [](float f) { return uint32_t(uint16_t(int16_t(std::round(clamp(f, -1.0f, 1.0f) * 32767.0f)))); };
+    return snorm(x) | snorm(y) << 16;
+}
+
+Normal3f decodeOctahedral(uint32_t q)
+{
+    float x = float(int16_t(q & 0xffff)) / 32767.0f;
+    float y = float(int16_t(q >> 16)) / 32767.0f;
+    float z = 1.0f - std::abs(x) - std::abs(y);
+    if (z < 0.0f)
+    {
+        float fx = (1.0f - std::abs(y)) * signNotZero(x);
+        y = (1.0f - std::abs(x)) * signNotZero(y);
+        x = fx;
+    }
+    return Normal3f(x, y, z);
+}
+
+// Find where the ray hits the plane of triangle p0, p1, p2 within [ray.mint, ray.maxt]
+// and check that this point lies inside the triangle. On success, returns the
+// distance, the geometric normal, and the edge cross products needed for the barycentrics.
+bool hitTriangleReference(const Ray3f& ray, const Vector3f& p0, const Vector3f& p1, const Vector3f& p2,
+                 float & t, Normal3f & gn, Vector3f & area, Vector3f & cross_1, Vector3f & cross_2)
 {
-    // TODO: Implement ray-triangle intersection
-    
     Vector3f v10 = p1 - p0;
     Vector3f v20 = p2 - p0;
     Vector3f v21 = p2 - p1;
-    Vector3f area = v10.cross(v20);
-    Normal3f gn = (area).normalized();
-    auto t = - (ray.o - p0).dot(gn)/ray.d.dot(gn);
+    area = v10.cross(v20);
+    gn = (area).normalized();
+    t = - (ray.o - p0).dot(gn)/ray.d.dot(gn);
     if(t > ray.maxt || t < ray.mint) return false;
     Point3f x = ray(t);
     //Aproach 1,test direction of cross products
-    Vector3f cross_1 = v20.cross(x - p0);
-    //message("%f,%f,%f",cross_1[0],cross_1[1],cross_1[2]);
-    //message("%f,%f,%f",gn[0],gn[1],gn[2]);
+    cross_1 = v20.cross(x - p0);
     if(cross_1.dot(gn) > 0) return false;
-    Vector3f cross_2 = v10.cross(x - p0);
+    cross_2 = v10.cross(x - p0);
     if(cross_2.dot(gn) < 0) return false;
     Vector3f cross_3 = v21.cross(x - p1);
     if(cross_3.dot(gn) < 0) return false;
-    
+    return true;
+}
+
+// Moller-Trumbore test against the triangle p0, p0 + e1, p0 + e2.
+// u and v are the barycentric weights of the second and third vertex.
+inline bool hitMollerTrumbore(const Ray3f & ray, const Point3f & p0, const Vector3f & e1, const Vector3f & e2,
+                              float & t, float & u, float & v)
+{
+    Vector3f pvec = ray.d.cross(e2);
+    float det = e1.dot(pvec);
+    // the ray is parallel to the triangle
+    if (det == 0.0f)
+        return false;
+    float invDet = 1.0f / det;
+
+    Vector3f tvec = ray.o - p0;
+    u = tvec.dot(pvec) * invDet;
+    if (u < 0.0f || u > 1.0f)
+        return false;
+
+    Vector3f qvec = tvec.cross(e1);
+    v = ray.d.dot(qvec) * invDet;
+    if (v < 0.0f || u + v > 1.0f)
+        return false;
+
+    t = e2.dot(qvec) * invDet;
+    return t >= ray.mint && t <= ray.maxt;
+}
+
+// Watertight ray-triangle test of Woop, Benthin and Wald, "Watertight Ray/Triangle
+// Intersection", JCGT 2013. Rays through a shared edge or vertex hit at least one of
+// the adjacent triangles. u and v are the barycentric weights of p1 and p2.
+bool hitWatertight(const Ray3f & ray, const Point3f & p0, const Point3f & p1, const Point3f & p2,
+                   float & t, float & u, float & v)
+{
+    // permute the axes so that the largest direction component becomes z,
+    // swapping x and y if needed to keep the winding
+    int kz = 0;
+    ray.d.cwiseAbs().maxCoeff(&kz);
+    int kx = (kz + 1) % 3;
+    int ky = (kx + 1) % 3;
+    if (ray.d[kz] < 0.0f)
+        std::swap(kx, ky);
+
+    // shear so that the ray points along +z
+    float Sz = 1.0f / ray.d[kz];
+    float Sx = ray.d[kx] * Sz;
+    float Sy = ray.d[ky] * Sz;
+
+    Vector3f A = p0 - ray.o, B = p1 - ray.o, C = p2 - ray.o;
+    float Ax = A[kx] - Sx * A[kz], Ay = A[ky] - Sy * A[kz];
+    float Bx = B[kx] - Sx * B[kz], By = B[ky] - Sy * B[kz];
+    float Cx = C[kx] - Sx * C[kz], Cy = C[ky] - Sy * C[kz];
+
+    // scaled barycentric coordinates, recomputed in double precision on an edge
+    float U = Cx * By - Cy * Bx;
+    float V = Ax * Cy - Ay * Cx;
+    float W = Bx * Ay - By * Ax;
+    if (U == 0.0f || V == 0.0f || W == 0.0f)
+    {
+        U = float(double(Cx) * double(By) - double(Cy) * double(Bx));
+        V = float(double(Ax) * double(Cy) - double(Ay) * double(Cx));
+        W = float(double(Bx) * double(Ay) - double(By) * double(Ax));
+    }
+
+    if ((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f))
+        return false;
+
+    float det = U + V + W;
+    if (det == 0.0f)
+        return false;
+
+    float T = U * Sz * A[kz] + V * Sz * B[kz] + W * Sz * C[kz];
+    float invDet = 1.0f / det;
+    t = T * invDet;
+    if (t < ray.mint || t > ray.maxt)
+        return false;
+
+    u = V * invDet;
+    v = W * invDet;
+    return true;
+}
+
+} // namespace
+
+// Ray-Triangle intersection
+// p0, p1, p2 - Triangle vertices
+// n0, n1, n2 - optional per vertex normal data
+bool Mesh::singleTriangleIntersect(const Ray3f& ray, const Vector3f& p0, const Vector3f& p1, const Vector3f& p2,
+    const Normal3f* n0, const Normal3f* n1, const Normal3f* n2, Intersection3f& its)
+{
+    float t;
+    Normal3f gn;
+    Vector3f area, cross_1, cross_2;
+    if (!hitTriangleReference(ray, p0, p1, p2, t, gn, area, cross_1, cross_2))
+        return false;
+
     its.t = t;
     its.gn = gn;
-    its.p = x;
+    its.p = ray(t);
     
     auto beta = sqrt(cross_2.dot(cross_2)/(area.dot(area)));
     auto gamma = sqrt(cross_1.dot(cross_1)/(area.dot(area)));
@@ -64,27 +231,354 @@ bool Mesh::singleTriangleIntersect(const Ray3f& ray, const Vector3f& p0, const V
 
 Mesh::Mesh(const Scene & scene, const json & j) : Surface(scene, j)
 {
+    string method("reference");
+    Parser::get(j, method, "intersector");
+    Parser::get(j, m_compact, "compact");
+    if (method == "moller-trumbore")
+        m_triangleMethod = TRIANGLE_MOLLER_TRUMBORE;
+    else if (method == "watertight")
+        m_triangleMethod = TRIANGLE_WATERTIGHT;
+    else if (method == "reference")
+        m_triangleMethod = TRIANGLE_REFERENCE;
+    else
+    {
+        warning("Triangle intersector \"%s\" unknown. Using \"reference\".", method.c_str());
+        m_triangleMethod = TRIANGLE_REFERENCE;
+    }
+}
 
+void Mesh::precomputeTriangles()
+{
+    m_edges.clear();
+    if (m_triangleMethod != TRIANGLE_MOLLER_TRUMBORE)
+        return;
+
+    m_edges.resize(numPrimitives());
+    for (auto i : range(int(numPrimitives())))
+    {
+        Vector3i f = face(i);
+        const Point3f & p0 = m_V[f[0]];
+        m_edges.p0[i] = p0;
+        m_edges.e1[i] = m_V[f[1]] - p0;
+        m_edges.e2[i] = m_V[f[2]] - p0;
+    }
+}
+
+void Mesh::compactStorage()
+{
+    if (!m_compact)
+        return;
+
+    if (!m_F.empty() && m_V.size() < 65536)
+    {
+        std::vector<Face16> F(m_F.size());
+        for (auto i : range(int(F.size())))
+            for (auto k : range(3))
+                F[i].v[k] = uint16_t(m_F[i][k]);
+        m_F16 = std::move(F);
+        m_F.clear();
+    }
+
+    if (!m_N.empty())
+    {
+        std::vector<uint32_t> N(m_N.size());
+        for (auto i : range(int(N.size())))
+            N[i] = encodeOctahedral(m_N[i]);
+        m_octN = std::move(N);
+        m_N.clear();
+    }
+
+    if (!m_UV.empty())
+    {
+        Point2f uvMax = m_UV[0];
+        m_uvMin = m_UV[0];
+        for (const Point2f & uv : m_UV)
+        {
+            m_uvMin = m_uvMin.cwiseMin(uv);
+            uvMax = uvMax.cwiseMax(uv);
+        }
+        m_uvExtent = uvMax - m_uvMin;
+
+        std::vector<uint32_t> UV(m_UV.size());
+        for (auto i : range(int(UV.size())))
+        {
+            uint32_t q[2];
+            for (auto k : range(2))
+                q[k] = m_uvExtent[k] > 0 ? uint32_t(std::round((m_UV[i][k] - m_uvMin[k]) / m_uvExtent[k] * 65535.0f)) : 0;
+            UV[i] = q[0] | q[1] << 16;
+        }
+        m_UV16 = std::move(UV);
+        m_UV.clear();
+    }
+}
+
+void Mesh::setTransform(const Transform & xform)
+{
+    if (m_objectV.empty())
+    {
+        Transform toObject = m_xform.inverse();
+        m_objectV.assign(m_V.begin(), m_V.end());
+        toObject.transformPoints(m_objectV.data(), m_objectV.data(), m_objectV.size());
+        if (hasNormals())
+        {
+            m_objectN.resize(numVertices());
+            for (auto i : range(int(numVertices())))
+                m_objectN[i] = normal(i);
+            toObject.transformNormals(m_objectN.data(), m_objectN.data(), m_objectN.size());
+        }
+    }
+
+    m_xform = xform;
+    std::vector<Point3f> V(m_objectV);
+    std::vector<Normal3f> N(m_objectN);
+    m_xform.transformPoints(V.data(), V.data(), V.size());
+    m_xform.transformNormals(N.data(), N.data(), N.size());
+    updateVertices(std::move(V), std::move(N));
+}
+
+void Mesh::setVertices(std::vector<Point3f> && positions, std::vector<Normal3f> && normals)
+{
+    // the object-space copies no longer match
+    m_objectV = std::vector<Point3f>();
+    m_objectN = std::vector<Normal3f>();
+    updateVertices(std::move(positions), std::move(normals));
+}
+
+void Mesh::updateVertices(std::vector<Point3f> && positions, std::vector<Normal3f> && normals)
+{
+    if (positions.size() != numVertices() || (!normals.empty() && normals.size() != numVertices()))
+        throw DirtException("Mesh vertices can only be replaced by the same number of vertices");
+
+    m_V = std::move(positions);
+    if (!normals.empty())
+    {
+        m_N = std::move(normals);
+        m_octN.clear();
+    }
+    precomputeTriangles();
+    compactStorage();
+}
+
+Normal3f Mesh::normal(uint32_t index) const
+{
+    return m_N.empty() ? decodeOctahedral(m_octN[index]) : m_N[index];
+}
+
+Point2f Mesh::texCoord(uint32_t index) const
+{
+    if (!m_UV.empty())
+        return m_UV[index];
+    uint32_t q = m_UV16[index];
+    return Point2f(m_uvMin.x() + m_uvExtent.x() * float(q & 0xffff) / 65535.0f,
+                   m_uvMin.y() + m_uvExtent.y() * float(q >> 16) / 65535.0f);
+}
+
+size_t Mesh::memoryUsage() const
+{
+    return m_V.size() * sizeof(Point3f) + m_N.size() * sizeof(Normal3f) + m_UV.size() * sizeof(Point2f) +
+           m_F.size() * sizeof(Vector3i) + m_F16.size() * sizeof(Face16) +
+           (m_octN.size() + m_UV16.size()) * sizeof(uint32_t) + m_edges.bytes();
+}
+
+bool Mesh::loadCache(const std::string & filename, const CacheSource & source)
+{
+    std::shared_ptr<MappedFile> file;
+    try
+    {
+        file = std::make_shared<MappedFile>(filename);
+    }
+    catch (const DirtException &)
+    {
+        return false;
+    }
+
+    CacheHeader header;
+    if (file->size() < sizeof(header))
+        return false;
+    std::memcpy(&header, file->data(), sizeof(header));
+
+    if (std::memcmp(header.magic, CacheMagic, sizeof(CacheMagic)) != 0 ||
+        header.version != CacheVersion || header.headerSize != sizeof(header) ||
+        header.fileSize != file->size())
+        return false;
+
+    // only hash the source if it may have changed
+    if (header.sourceSize != source.size || header.transformHash != source.transformHash ||
+        (header.sourceModified != source.modified && header.contentHash != source.contentHash()))
+        return false;
+
+    // every array has to lie inside the file, and every face has to index existing vertices
+    for (auto i : range(4))
+        if (header.offset[i] % CacheAlignment != 0 || header.offset[i] > file->size() ||
+            header.count[i] > (file->size() - header.offset[i]) / CacheElementSize[i])
+            return false;
+    if ((header.count[1] && header.count[1] != header.count[0]) ||
+        (header.count[2] && header.count[2] != header.count[0]))
+        return false;
+
+    const uint8_t * base = file->data();
+    const Vector3i * faces = reinterpret_cast<const Vector3i *>(base + header.offset[3]);
+    for (auto i : range(int(header.count[3])))
+        for (auto k : range(3))
+            if (uint64_t(uint32_t(faces[i][k])) >= header.count[0])
+                return false;
+
+    m_V.reference(reinterpret_cast<const Point3f *>(base + header.offset[0]), header.count[0], file);
+    m_N.reference(reinterpret_cast<const Normal3f *>(base + header.offset[1]), header.count[1], file);
+    m_UV.reference(reinterpret_cast<const Point2f *>(base + header.offset[2]), header.count[2], file);
+    m_F.reference(faces, header.count[3], file);
+    return true;
+}
+
+void Mesh::saveCache(const std::string & filename, const CacheSource & source) const
+{
+    CacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, CacheMagic, sizeof(CacheMagic));
+    header.version = CacheVersion;
+    header.headerSize = sizeof(header);
+    header.sourceSize = source.size;
+    header.sourceModified = source.modified;
+    header.transformHash = source.transformHash;
+    header.contentHash = source.contentHash();
+
+    const void * arrays[4] = {m_V.data(), m_N.data(), m_UV.data(), m_F.data()};
+    uint64_t sizes[4] = {m_V.size(), m_N.size(), m_UV.size(), m_F.size()};
+    uint64_t end = sizeof(header);
+    for (auto i : range(4))
+    {
+        header.count[i] = sizes[i];
+        header.offset[i] = alignUp(end);
+        end = header.offset[i] + sizes[i] * CacheElementSize[i];
+    }
+    header.fileSize = end;
+
+    std::string tmpName = filename + ".tmp";
+    {
+        std::ofstream os(tmpName, std::ios::binary | std::ios::trunc);
+        os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        uint64_t written = sizeof(header);
+        const char zeros[CacheAlignment] = {};
+        for (auto i : range(4))
+        {
+            os.write(zeros, std::streamsize(header.offset[i] - written));
+            os.write(static_cast<const char *>(arrays[i]), std::streamsize(sizes[i] * CacheElementSize[i]));
+            written = header.offset[i] + sizes[i] * CacheElementSize[i];
+        }
+        if (os.good())
+            os.close();
+        if (!os.good())
+        {
+            std::remove(tmpName.c_str());
+            warning("Unable to write geometry cache \"%s\".\n", tmpName);
+            return;
+        }
+    }
+
+    if (std::rename(tmpName.c_str(), filename.c_str()) != 0)
+    {
+        std::remove(tmpName.c_str());
+        warning("Unable to write geometry cache \"%s\".\n", filename);
+    }
+}
+
+bool Mesh::hitTriangle(uint32_t index, const Ray3f & ray, float & t, float & u, float & v) const
+{
+    switch (m_triangleMethod)
+    {
+        case TRIANGLE_MOLLER_TRUMBORE:
+        {
+            return hitMollerTrumbore(ray, m_edges.p0[index], m_edges.e1[index], m_edges.e2[index], t, u, v);
+        }
+
+        case TRIANGLE_WATERTIGHT:
+        {
+            Vector3i f = face(index);
+            return hitWatertight(ray, m_V[f[0]], m_V[f[1]], m_V[f[2]], t, u, v);
+        }
+
+        default:
+        {
+            Vector3i f = face(index);
+            Normal3f gn;
+            Vector3f area, cross_1, cross_2;
+            if (!hitTriangleReference(ray, m_V[f[0]], m_V[f[1]], m_V[f[2]],
+                                      t, gn, area, cross_1, cross_2))
+                return false;
+            u = sqrt(cross_1.dot(cross_1)/(area.dot(area)));
+            v = sqrt(cross_2.dot(cross_2)/(area.dot(area)));
+            return true;
+        }
+    }
 }
 
 bool Mesh::intersect(uint32_t index, const Ray3f & ray, Intersection3f & its) const
+{
+    HitRecord hit;
+    if (!findHit(index, ray, hit))
+        return false;
+    computeHitDetails(ray, hit, its);
+    return true;
+}
+
+bool Mesh::findHit(uint32_t index, const Ray3f & ray, HitRecord & hit) const
 {
     INCREMENT_INTERSECTED_PRIMS;
-    // TODO: Implement ray-triangle intersection
-    //message("%f,%f,%f,\n",m_V[m_F[index][0]],m_V[m_F[index][1]],m_V[m_F[index][2]]);
-    if(singleTriangleIntersect(ray,m_V[m_F[index][0]],m_V[m_F[index][1]],m_V[m_F[index][2]],&m_N[m_F[index][0]],&m_N[m_F[index][1]],&m_N[m_F[index][2]],its)){
-          its = Intersection3f(its.t,its.p, its.gn, its.sn,its.uv,m_material, this);
-        //message("%f,%f,%f\n",its.gn[0],its.gn[1],its.gn[2]);
-          return true;
-    }
-    return false;
+
+    float t, u, v;
+    if (!hitTriangle(index, ray, t, u, v))
+        return false;
+
+    hit.t = t;
+    hit.surface = this;
+    hit.primIndex = index;
+    hit.u = u;
+    hit.v = v;
+    return true;
+}
+
+void Mesh::computeHitDetails(const Ray3f & ray, const HitRecord & hit, Intersection3f & its) const
+{
+    Vector3i f = face(hit.primIndex);
+    const Point3f & p0 = m_V[f[0]];
+    float u = hit.u, v = hit.v;
+    Normal3f gn = (m_V[f[1]] - p0).cross(m_V[f[2]] - p0).normalized();
+    Normal3f sn = gn;
+    if (!m_N.empty())
+        sn = ((1 - u - v) * m_N[f[0]] + u * m_N[f[1]] + v * m_N[f[2]]).normalized();
+    else if (!m_octN.empty())
+        sn = ((1 - u - v) * normal(f[0]) + u * normal(f[1]) + v * normal(f[2])).normalized();
+
+    // meshes without texture coordinates report the barycentric coordinates instead
+    Point2f uv(u, v);
+    if (hasTexCoords())
+        uv = (1 - u - v) * texCoord(f[0]) + u * texCoord(f[1]) + v * texCoord(f[2]);
+
+    its = Intersection3f(hit.t, ray(hit.t), gn, sn, uv, m_material, this);
+}
+
+bool Mesh::occluded(uint32_t index, const Ray3f & ray) const
+{
+    INCREMENT_SHADOW_PRIMS;
+    float t, u, v;
+    return hitTriangle(index, ray, t, u, v);
 }
 
 Box3f Mesh::localBBox(uint32_t index) const
 {
+    Vector3i f = face(index);
     Box3f result;
-    result.extend(m_xform.inverse() * m_V[m_F[index][0]]);
-    result.extend(m_xform.inverse() * m_V[m_F[index][1]]);
-    result.extend(m_xform.inverse() * m_V[m_F[index][2]]);
+    result.extend(m_xform.inverse() * m_V[f[0]]);
+    result.extend(m_xform.inverse() * m_V[f[1]]);
+    result.extend(m_xform.inverse() * m_V[f[2]]);
+    return result;
+}
+
+Box3f Mesh::worldBBox(uint32_t index) const
+{
+    Vector3i f = face(index);
+    Box3f result(m_V[f[0]], m_V[f[0]]);
+    result.extend(m_V[f[1]]);
+    result.extend(m_V[f[2]]);
     return result;
 }
@@ -37,6 +37,8 @@
 #pragma once
 
 #include "surface.h"
+#include "mappedfile.h"
+#include <functional>
 
 //! Triangle mesh
 /*
@@ -51,7 +53,7 @@ public:
     //! Return the total number of triangles in this shape
     virtual uint32_t numPrimitives() const override
     {
-        return (uint32_t) m_F.size();
+        return (uint32_t) (m_F.size() + m_F16.size());
     }
 
     //! Ray-triangle intersection test
@@ -78,6 +80,19 @@ public:
      */
     virtual bool intersect(uint32_t idx, const Ray3f & ray, Intersection3f & its) const override;
 
+    //! Return whether the ray hits triangle \a idx, without computing shading data
+    virtual bool occluded(uint32_t idx, const Ray3f & ray) const override;
+
+    //! Find the hit with triangle \a idx, recording its barycentric coordinates in \a hit
+    virtual bool findHit(uint32_t idx, const Ray3f & ray, HitRecord & hit) const override;
+
+    //! Compute the hit point, normals and texture coordinates of a hit found by \ref findHit()
+    /*!
+        its.uv interpolates the vertex texture coordinates, or holds the
+        barycentric coordinates if the mesh has none.
+    */
+    virtual void computeHitDetails(const Ray3f & ray, const HitRecord & hit, Intersection3f & its) const override;
+
     // Static ray - single triangle intersection routine
     static bool singleTriangleIntersect(const Ray3f& ray, const Vector3f& v0, const Vector3f& v1, const Vector3f& v2,
         const Normal3f* n0, const Normal3f* n1, const Normal3f* n2, Intersection3f& isect);
@@ -89,27 +104,172 @@ public:
     }
 
     //! Return a reference to the vertex positions
-    const std::vector<Point3f> & vertexPositions() const { return m_V; }
+    const DataBuffer<Point3f> & vertexPositions() const { return m_V; }
+
+    //! Return a reference to the vertex normals (empty with compact storage)
+    const DataBuffer<Normal3f> & vertexNormals() const { return m_N; }
+
+    //! Return a reference to the texture coordinates (empty with compact storage)
+    const DataBuffer<Point2f> & vertexTexCoords() const { return m_UV; }
+
+    //! Return a pointer to the triangle vertex index list (empty with compact 16-bit indices)
+    const DataBuffer<Vector3i> & faceIndices() const { return m_F; }
+
+    //! Return the vertex indices of triangle \a index, in either storage mode
+    Vector3i face(uint32_t index) const
+    {
+        if (m_F16.empty())
+            return m_F[index];
+        const Face16 & f = m_F16[index];
+        return Vector3i(f.v[0], f.v[1], f.v[2]);
+    }
 
-    //! Return a reference to the vertex normals
-    const std::vector<Normal3f> & vertexNormals() const { return m_N; }
+    //! Whether the mesh has per-vertex normals
+    bool hasNormals() const { return !m_N.empty() || !m_octN.empty(); }
 
-    //! Return a reference to the texture coordinates
-    const std::vector<Point2f> & vertexTexCoords() const { return m_UV; }
+    //! Whether the mesh has per-vertex texture coordinates
+    bool hasTexCoords() const { return !m_UV.empty() || !m_UV16.empty(); }
 
-    //! Return a pointer to the triangle vertex index list
-    const std::vector<Vector3i> & faceIndices() const { return m_F; }
+    //! Return the (unnormalized) normal of vertex \a index, in either storage mode
+    Normal3f normal(uint32_t index) const;
+
+    //! Return the texture coordinates of vertex \a index, in either storage mode
+    Point2f texCoord(uint32_t index) const;
+
+    //! Bytes used by the vertex, face and per-triangle intersection data
+    size_t memoryUsage() const;
+
+    //! Move the mesh, transforming its world-space vertices again
+    /*!
+        The first move keeps a copy of the vertices in object space, so that
+        repeated moves do not accumulate rounding errors.
+    */
+    virtual void setTransform(const Transform & xform) override;
+
+    //! Replace the world-space vertex positions (and normals, if given) of a deforming mesh
+    /*!
+        The number of vertices and the faces stay the same.
+    */
+    void setVertices(std::vector<Point3f> && positions, std::vector<Normal3f> && normals = std::vector<Normal3f>());
 
     //! Return the local-space axis-aligned bounding box containing the given primitive
     virtual Box3f localBBox(uint32_t index) const override;
 
+    //! Return the world-space axis-aligned bounding box containing the given primitive
+    /*!
+        The vertices are stored in world space, so this is just the bounding
+        box of the triangle's vertices.
+    */
+    virtual Box3f worldBBox(uint32_t index) const override;
+
+    //! Ray-triangle intersection algorithms, selected with the "intersector" parameter (default "reference")
+    enum TriangleMethod
+    {
+        TRIANGLE_REFERENCE,             //!< \ref singleTriangleIntersect() ("reference")
+        TRIANGLE_MOLLER_TRUMBORE,       //!< Moller-Trumbore on precomputed edges ("moller-trumbore")
+        TRIANGLE_WATERTIGHT             //!< Woop et al.'s watertight test ("watertight")
+    };
+
+    TriangleMethod triangleMethod() const { return m_triangleMethod; }
+
 protected:
     //! Create an empty mesh
     Mesh(const Scene & scene, const json & j = json());
 
+    //! Precompute the per-triangle data used by the intersectors
+    /*!
+        Mesh loaders call this once m_V and m_F are filled.
+    */
+    void precomputeTriangles();
+
+    //! Install new world-space vertices and update the data derived from them
+    void updateVertices(std::vector<Point3f> && positions, std::vector<Normal3f> && normals);
+
+    //! Switch to compact storage if the "compact" parameter was set
+    /*!
+        Mesh loaders call this last. Compact storage uses 16-bit vertex
+        indices (when there are fewer than 65536 vertices), normals
+        oct-encoded into 32 bits and texture coordinates quantized to 16 bits
+        per component within their bounding box. Positions are kept at full
+        precision, so intersection results do not change; normals and texture
+        coordinates are decoded in \ref computeHitDetails().
+    */
+    void compactStorage();
+
+    //! The source data a geometry cache is built from
+    struct CacheSource
+    {
+        uint64_t size = 0;                      //!< size of the source file in bytes
+        int64_t modified = 0;                   //!< modification time of the source file
+        uint64_t transformHash = 0;             //!< hash of the transform applied to the vertices
+        std::function<uint64_t()> contentHash;  //!< hash of the source file content, only called when needed
+    };
+
+    //! Point the mesh arrays into the geometry cache \a filename
+    /*!
+        The cache is memory-mapped and used in place, without copying. Returns
+        \c false, leaving the mesh untouched, if the file is missing, corrupt,
+        or was written for a different \a source. A cache of a source file of
+        the same size and transform is valid if the modification time is the
+        same, or else if the content hash is the same; so the source is only
+        read when its modification time changed.
+    */
+    bool loadCache(const std::string & filename, const CacheSource & source);
+
+    //! Write the mesh arrays to the geometry cache \a filename, tagged with \a source
+    /*!
+        The file is written under a temporary name and then renamed, so a
+        concurrent or interrupted run never sees a partial cache. Failures
+        only produce a warning.
+    */
+    void saveCache(const std::string & filename, const CacheSource & source) const;
+
+    //! Find the distance and barycentric coordinates of the hit with triangle \a index, if any
+    /*!
+        \a u and \a v are the weights of the second and third vertex.
+    */
+    bool hitTriangle(uint32_t index, const Ray3f & ray, float & t, float & u, float & v) const;
+
+    //! First vertex and the two edges leaving it of every triangle, in separate arrays
+    /*!
+        Element i of each array belongs to triangle i. A test reads one
+        densely packed 12-byte element from each array, and none of the
+        arrays holds data the test does not use.
+    */
+    struct TriangleEdges
+    {
+        std::vector<Point3f> p0;
+        std::vector<Vector3f> e1;       //!< p1 - p0
+        std::vector<Vector3f> e2;       //!< p2 - p0
+
+        size_t size() const             {return p0.size();}
+        size_t bytes() const            {return size() * (sizeof(Point3f) + 2 * sizeof(Vector3f));}
+        void clear()                    {p0.clear(); e1.clear(); e2.clear();}
+        void resize(size_t n)           {p0.resize(n); e1.resize(n); e2.resize(n);}
+    };
+
+    //! Triangle vertex indices with compact storage
+    struct Face16
+    {
+        uint16_t v[3];
+    };
+
 protected:
-    std::vector<Point3f> m_V;           //!< Vertex positions
-    std::vector<Normal3f> m_N;          //!< Vertex normals
-    std::vector<Point2f> m_UV;          //!< Vertex texture coordinates
-    std::vector<Vector3i> m_F;          //!< Faces
+    DataBuffer<Point3f> m_V;            //!< Vertex positions
+    DataBuffer<Normal3f> m_N;           //!< Vertex normals
+    DataBuffer<Point2f> m_UV;           //!< Vertex texture coordinates
+    DataBuffer<Vector3i> m_F;           //!< Faces
+
+    bool m_compact = false;             //!< use compact storage (see \ref compactStorage())
+    DataBuffer<Face16> m_F16;           //!< Faces with 16-bit indices, replacing m_F
+    DataBuffer<uint32_t> m_octN;        //!< Oct-encoded vertex normals, replacing m_N
+    DataBuffer<uint32_t> m_UV16;        //!< Quantized texture coordinates, replacing m_UV
+    Point2f m_uvMin = Point2f(0, 0);    //!< texture coordinates quantized to 0
+    Vector2f m_uvExtent = Vector2f(1, 1); //!< texture coordinates quantized to 65535, minus m_uvMin
+
+    std::vector<Point3f> m_objectV;     //!< Object-space vertex positions, kept once the mesh was moved
+    std::vector<Normal3f> m_objectN;    //!< Object-space vertex normals, kept once the mesh was moved
+
+    TriangleMethod m_triangleMethod = TRIANGLE_REFERENCE;
+    TriangleEdges m_edges;              //!< Per-face edge data for Moller-Trumbore
 };
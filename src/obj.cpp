@@ -36,7 +36,9 @@
 
 #include "obj.h"
 #include "timer.h"
-#include <unordered_map>
+#include "mappedfile.h"
+#include "parallel.h"
+#include <cstdlib>
 #include <fstream>
 
 namespace
@@ -75,41 +77,113 @@ struct OBJVertex
     }
 };
 
-//! Hash function for OBJVertex
-struct OBJVertexHash : std::unary_function<OBJVertex, size_t>
+//! Open-addressing hash table mapping each distinct OBJVertex to its index in the vertex list
+/*!
+    Keys and values are stored inline in a single power-of-two sized array
+    and collisions are resolved by linear probing, so a lookup usually
+    touches one cache line and inserting a vertex never allocates. The table
+    is kept at most half full.
+*/
+class VertexMap
 {
-    std::size_t operator()(const OBJVertex & v) const
+public:
+    //! Create a table sized for about \a expected distinct vertices
+    explicit VertexMap(size_t expected)
     {
-        size_t hash = std::hash<uint32_t>()(v.p);
-        hash = hash * 37 + std::hash<uint32_t>()(v.uv);
-        hash = hash * 37 + std::hash<uint32_t>()(v.n);
-        return hash;
+        size_t capacity = 16;
+        while (capacity < 2 * expected)
+            capacity *= 2;
+        m_slots.resize(capacity);
     }
-};
 
-} // namespace
+    //! Return the index of \a v, adding it with index \a next if it is not in the table yet
+    uint32_t insert(const OBJVertex & v, uint32_t next)
+    {
+        if (2 * (m_size + 1) > m_slots.size())
+            grow();
 
+        size_t mask = m_slots.size() - 1;
+        for (size_t i = hash(v) & mask;; i = (i + 1) & mask)
+        {
+            Slot & slot = m_slots[i];
+            if (slot.key.p == Empty)
+            {
+                slot.key = v;
+                slot.value = next;
+                ++m_size;
+                return next;
+            }
+            if (slot.key == v)
+                return slot.value;
+        }
+    }
 
-WavefrontOBJ::WavefrontOBJ(const Scene & scene, const json & j) : Mesh(scene, j)
-{
-    typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
+    //! Number of distinct vertices in the table
+    size_t size() const { return m_size; }
 
-    std::string filename = j["filename"];
+    //! Memory used by the table
+    size_t bytes() const { return m_slots.size() * sizeof(Slot); }
 
-    std::ifstream is(filename);
-    if (is.fail())
-        throw DirtException("Unable to open OBJ file \"%s\"!", filename);
+private:
+    static const uint32_t Empty = (uint32_t) -1;
 
-    cout << "Loading \"" << filename << "\" .. ";
-    cout.flush();
-    Timer timer;
+    struct Slot
+    {
+        OBJVertex key;                  //!< key.p == Empty marks an unused slot
+        uint32_t value = 0;
+    };
+
+    // mixes all 96 key bits into the 64-bit result (finalizer of MurmurHash3)
+    static uint64_t mix(uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    static uint64_t hash(const OBJVertex & v)
+    {
+        return mix(mix(uint64_t(v.p) | uint64_t(v.uv) << 32) ^ (uint64_t(v.n) * 0x9e3779b97f4a7c15ull));
+    }
+
+    void grow()
+    {
+        std::vector<Slot> old(2 * m_slots.size());
+        old.swap(m_slots);
+        size_t mask = m_slots.size() - 1;
+        for (const Slot & slot : old)
+        {
+            if (slot.key.p == Empty)
+                continue;
+            size_t i = hash(slot.key) & mask;
+            while (m_slots[i].key.p != Empty)
+                i = (i + 1) & mask;
+            m_slots[i] = slot;
+        }
+    }
+
+    std::vector<Slot> m_slots;
+    size_t m_size = 0;
+};
 
+//! The attributes of an OBJ file, and the (1-based) vertex indices of every triangle corner
+struct OBJData
+{
     std::vector<Point3f>    positions;
     std::vector<Point2f>    texcoords;
     std::vector<Normal3f>   normals;
-    std::vector<uint32_t>   indices;
-    std::vector<OBJVertex>  vertices;
-    VertexMap vertexMap;
+    std::vector<OBJVertex>  corners;
+};
+
+// Reference parser, reading the file line by line through a stream
+void parseStream(const std::string & filename, OBJData & data)
+{
+    std::ifstream is(filename);
+    if (is.fail())
+        throw DirtException("Unable to open OBJ file \"%s\"!", filename);
 
     std::string line_str;
     while (std::getline(is, line_str))
@@ -123,20 +197,19 @@ WavefrontOBJ::WavefrontOBJ(const Scene & scene, const json & j) : Mesh(scene, j)
         {
             Point3f p;
             line >> p.x() >> p.y() >> p.z();
-            p = m_xform * p;
-            positions.push_back(p);
+            data.positions.push_back(p);
         }
         else if (prefix == "vt")
         {
             Point2f tc;
             line >> tc.x() >> tc.y();
-            texcoords.push_back(tc);
+            data.texcoords.push_back(tc);
         }
         else if (prefix == "vn")
         {
             Normal3f n;
             line >> n.x() >> n.y() >> n.z();
-            normals.push_back((m_xform * n).normalized());
+            data.normals.push_back(n);
         }
         else if (prefix == "f")
         {
@@ -158,50 +231,439 @@ WavefrontOBJ::WavefrontOBJ(const Scene & scene, const json & j) : Mesh(scene, j)
                 nVertices = 6;
             }
 
-            // Convert to an indexed vertex list
-            for (auto i : range(nVertices))
+            data.corners.insert(data.corners.end(), verts, verts + nVertices);
+        }
+    }
+}
+
+
+// Bytes of OBJ text parsed by one task. Chunk boundaries only depend on the
+// file, so the result never depends on the number of threads.
+const size_t OBJChunkSize = 256 * 1024;
+
+// Index of a face corner as found in a chunk. Negative OBJ indices are
+// relative to the last attribute defined before the face; since the chunk
+// does not know how many attributes earlier chunks defined, those are stored
+// relative to the start of the chunk and resolved when merging.
+struct ChunkIndex
+{
+    int32_t value = 0;                  //!< 1-based index, or 0-based index relative to the chunk
+    bool relative = false;
+};
+
+struct ChunkCorner
+{
+    ChunkIndex p, uv, n;
+};
+
+struct OBJChunk
+{
+    std::vector<Point3f>     positions;
+    std::vector<Point2f>     texcoords;
+    std::vector<Normal3f>    normals;
+    std::vector<ChunkCorner> corners;   //!< 3 per triangle
+};
+
+inline bool isBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+inline void skipBlanks(const char *& p, const char * end)
+{
+    while (p < end && isBlank(*p))
+        ++p;
+}
+
+inline const char * tokenEnd(const char * p, const char * end)
+{
+    while (p < end && !isBlank(*p) && *p != '\n')
+        ++p;
+    return p;
+}
+
+// Parse the float in [p, end) without allocating. When the decimal mantissa
+// and the power of ten are both exact floats (mantissa < 2^24, |exponent| <= 10),
+// a single float multiplication or division rounds correctly (Clinger's fast
+// path), so the result matches strtof; everything else goes through strtof.
+float parseFloat(const char * p, const char * end)
+{
+    static const float powers[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+    const char * start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false;
+    for (; p < end && isDigit(*p); ++p, any = true)
+    {
+        mantissa = mantissa * 10 + uint64_t(*p - '0');
+        digits += mantissa != 0;
+    }
+    if (p < end && *p == '.')
+        for (++p; p < end && isDigit(*p); ++p, any = true)
+        {
+            mantissa = mantissa * 10 + uint64_t(*p - '0');
+            digits += mantissa != 0;
+            --exponent;
+        }
+    if (any && p < end && (*p == 'e' || *p == 'E'))
+    {
+        const char * e = p + 1;
+        bool negativeExponent = false;
+        if (e < end && (*e == '-' || *e == '+'))
+            negativeExponent = *e++ == '-';
+        int value = 0;
+        bool anyExponent = false;
+        for (; e < end && isDigit(*e) && value < 10000; ++e, anyExponent = true)
+            value = value * 10 + (*e - '0');
+        if (anyExponent)
+        {
+            exponent += negativeExponent ? -value : value;
+            p = e;
+        }
+    }
+
+    // trailing zeros of the fraction (as in "%f" output) do not change the value
+    if (digits <= 19)
+        while (exponent < 0 && mantissa != 0 && mantissa % 10 == 0)
+        {
+            mantissa /= 10;
+            ++exponent;
+        }
+
+    if (any && p == end && digits <= 19 && mantissa < (uint64_t(1) << 24) && exponent >= -10 && exponent <= 10)
+    {
+        float value = exponent < 0 ? float(mantissa) / powers[-exponent] : float(mantissa) * powers[exponent];
+        return negative ? -value : value;
+    }
+
+    char buffer[64];
+    size_t length = std::min(size_t(end - start), sizeof(buffer) - 1);
+    std::copy(start, start + length, buffer);
+    buffer[length] = '\0';
+    return std::strtof(buffer, nullptr);
+}
+
+// Read up to N floats from the rest of the line; missing values are 0
+template <int N>
+void readFloats(const char *& p, const char * end, float * values)
+{
+    for (auto i : range(N))
+    {
+        skipBlanks(p, end);
+        const char * e = tokenEnd(p, end);
+        values[i] = e > p ? parseFloat(p, e) : 0.0f;
+        p = e;
+    }
+}
+
+// Parse one index of a face vertex, which may be empty (0)
+bool readIndex(const char *& p, const char * end, int64_t & index)
+{
+    bool negative = p < end && *p == '-';
+    if (negative)
+        ++p;
+    index = 0;
+    const char * digits = p;
+    for (; p < end && isDigit(*p) && index <= INT32_MAX; ++p)
+        index = index * 10 + (*p - '0');
+    if (p == digits)
+        return !negative;
+    if (negative)
+        index = -index;
+    return index != 0 && index >= INT32_MIN && index <= INT32_MAX;
+}
+
+// Turn a face vertex token "p", "p/uv", "p//n" or "p/uv/n" into chunk indices
+ChunkCorner parseCorner(const char * p, const char * end, const OBJChunk & chunk)
+{
+    const char * start = p;
+    int64_t index[3] = {0, 0, 0};
+    int count = 0;
+    for (; count < 3; ++count)
+    {
+        if (!readIndex(p, end, index[count]) || (count == 0 && index[0] == 0))
+            throw DirtException("Invalid vertex data: \"%s\"", std::string(start, end));
+        if (p == end)
+            break;
+        if (*p++ != '/')
+            throw DirtException("Invalid vertex data: \"%s\"", std::string(start, end));
+    }
+    if (count == 3)
+        throw DirtException("Invalid vertex data: \"%s\"", std::string(start, end));
+
+    auto resolve = [](int64_t i, size_t numDefined) -> ChunkIndex
+    {
+        ChunkIndex result;
+        if (i < 0)
+        {
+            result.value = int32_t(int64_t(numDefined) + i);
+            result.relative = true;
+        }
+        else
+            result.value = int32_t(i);
+        return result;
+    };
+
+    ChunkCorner corner;
+    corner.p = resolve(index[0], chunk.positions.size());
+    corner.uv = resolve(index[1], chunk.texcoords.size());
+    corner.n = resolve(index[2], chunk.normals.size());
+    return corner;
+}
+
+// Parse the complete lines in [p, end)
+void parseChunk(const char * p, const char * end, OBJChunk & chunk)
+{
+    std::vector<ChunkCorner> polygon;
+    while (p < end)
+    {
+        skipBlanks(p, end);
+        const char * e = tokenEnd(p, end);
+        size_t length = e - p;
+        const char * prefix = p;
+        p = e;
+
+        if (length == 1 && prefix[0] == 'v')
+        {
+            Point3f v;
+            readFloats<3>(p, end, v.data());
+            chunk.positions.push_back(v);
+        }
+        else if (length == 2 && prefix[0] == 'v' && prefix[1] == 't')
+        {
+            Point2f tc;
+            readFloats<2>(p, end, tc.data());
+            chunk.texcoords.push_back(tc);
+        }
+        else if (length == 2 && prefix[0] == 'v' && prefix[1] == 'n')
+        {
+            Normal3f n;
+            readFloats<3>(p, end, n.data());
+            chunk.normals.push_back(n);
+        }
+        else if (length == 1 && prefix[0] == 'f')
+        {
+            polygon.clear();
+            for (skipBlanks(p, end); p < end && *p != '\n'; skipBlanks(p, end))
             {
-                const OBJVertex & v = verts[i];
-                VertexMap::const_iterator it = vertexMap.find(v);
-                if (it == vertexMap.end())
-                {
-                    vertexMap[v] = (uint32_t) vertices.size();
-                    indices.push_back((uint32_t) vertices.size());
-                    vertices.push_back(v);
-                }
-                else
-                {
-                    indices.push_back(it->second);
-                }
+                e = tokenEnd(p, end);
+                polygon.push_back(parseCorner(p, e, chunk));
+                p = e;
             }
+            if (polygon.size() < 3)
+                throw DirtException("Face with fewer than 3 vertices");
+
+            // fan triangulation; triangle k > 0 is (k+2, 0, k+1), which splits quads like the stream parser
+            chunk.corners.insert(chunk.corners.end(), polygon.begin(), polygon.begin() + 3);
+            for (size_t k = 3; k < polygon.size(); ++k)
+            {
+                chunk.corners.push_back(polygon[k]);
+                chunk.corners.push_back(polygon[0]);
+                chunk.corners.push_back(polygon[k - 1]);
+            }
+        }
+
+        // skip the rest of the line
+        while (p < end && *p != '\n')
+            ++p;
+        ++p;
+    }
+}
+
+// Parse the mapped OBJ file in parallel chunks split at line boundaries
+void parseParallel(const MappedFile & file, const std::string & filename, OBJData & data)
+{
+    const char * text = reinterpret_cast<const char *>(file.data());
+    const char * textEnd = text + file.size();
+
+    std::vector<const char *> bounds(1, text);
+    while (bounds.back() < textEnd)
+    {
+        const char * b = bounds.back() + std::min(OBJChunkSize, size_t(textEnd - bounds.back()));
+        while (b < textEnd && b[-1] != '\n')
+            ++b;
+        bounds.push_back(b);
+    }
+    int numChunks = int(bounds.size()) - 1;
+
+    ThreadPool pool;
+    std::vector<OBJChunk> chunks(numChunks);
+    parallelFor(pool, 0, numChunks, [&](int c) { parseChunk(bounds[c], bounds[c + 1], chunks[c]); });
+
+    // where the attributes of every chunk start in the merged arrays
+    std::vector<size_t> positionStart(numChunks + 1, 0), texcoordStart(numChunks + 1, 0),
+                        normalStart(numChunks + 1, 0), cornerStart(numChunks + 1, 0);
+    for (auto c : range(numChunks))
+    {
+        positionStart[c + 1] = positionStart[c] + chunks[c].positions.size();
+        texcoordStart[c + 1] = texcoordStart[c] + chunks[c].texcoords.size();
+        normalStart[c + 1] = normalStart[c] + chunks[c].normals.size();
+        cornerStart[c + 1] = cornerStart[c] + chunks[c].corners.size();
+    }
+    data.positions.resize(positionStart[numChunks]);
+    data.texcoords.resize(texcoordStart[numChunks]);
+    data.normals.resize(normalStart[numChunks]);
+    data.corners.resize(cornerStart[numChunks]);
+
+    parallelFor(pool, 0, numChunks, [&](int c)
+    {
+        OBJChunk & chunk = chunks[c];
+        std::copy(chunk.positions.begin(), chunk.positions.end(), data.positions.begin() + positionStart[c]);
+        std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), data.texcoords.begin() + texcoordStart[c]);
+        std::copy(chunk.normals.begin(), chunk.normals.end(), data.normals.begin() + normalStart[c]);
+
+        // turn the chunk indices into global 1-based indices
+        auto resolve = [&](const ChunkIndex & i, size_t start, size_t total) -> uint32_t
+        {
+            if (!i.relative && i.value == 0)
+                return (uint32_t) -1;
+            int64_t index = i.relative ? int64_t(start) + i.value + 1 : int64_t(i.value);
+            if (index < 1 || index > int64_t(total))
+                throw DirtException("Vertex index out of range in OBJ file \"%s\"!", filename);
+            return uint32_t(index);
+        };
+        for (auto i : range(int(chunk.corners.size())))
+        {
+            const ChunkCorner & corner = chunk.corners[i];
+            OBJVertex & v = data.corners[cornerStart[c] + i];
+            v.p = resolve(corner.p, positionStart[c], data.positions.size());
+            v.uv = resolve(corner.uv, texcoordStart[c], data.texcoords.size());
+            v.n = resolve(corner.n, normalStart[c], data.normals.size());
         }
+        chunk = OBJChunk();
+    });
+}
+
+} // namespace
+
+
+WavefrontOBJ::WavefrontOBJ(const Scene & scene, const json & j) : Mesh(scene, j)
+{
+    std::string filename = j["filename"];
+
+    // the vertices are cached in world space, so every transform of the same file gets its own cache
+    const Eigen::Matrix4f & m = m_xform.getMatrix();
+    uint64_t xformHash = hashBytes(m.data(), sizeof(float) * 16);
+    bool useCache = j.count("cache_file") > 0;
+    std::string cacheFile = tfm::format("%s.%016x.dirtcache", filename, xformHash);
+    std::string parser = "parallel";
+    Parser::get(j, useCache, "cache");
+    Parser::get(j, cacheFile, "cache_file");
+    Parser::get(j, parser, "parser");
+    if (parser != "parallel" && parser != "stream")
+    {
+        warning("OBJ parser \"%s\" unknown. Using \"parallel\".", parser.c_str());
+        parser = "parallel";
+    }
+
+    cout << "Loading \"" << filename << "\" .. ";
+    cout.flush();
+    Timer timer;
+
+    // the file is only mapped (and hashed) if it has to be parsed or the cache
+    // cannot be validated by its size and modification time
+    std::unique_ptr<MappedFile> source;
+    auto mapSource = [&]() -> const MappedFile &
+    {
+        if (!source)
+            source.reset(new MappedFile(filename));
+        return *source;
+    };
+
+    CacheSource cacheSource;
+    cacheSource.transformHash = xformHash;
+    uint64_t contentHash = 0;
+    bool hashed = false;
+    cacheSource.contentHash = [&]()
+    {
+        if (!hashed)
+            contentHash = hashBytes(mapSource().data(), mapSource().size(), xformHash);
+        hashed = true;
+        return contentHash;
+    };
+    useCache = useCache && fileStatus(filename, cacheSource.size, cacheSource.modified);
+
+    if (useCache && loadCache(cacheFile, cacheSource))
+    {
+        precomputeTriangles();
+        compactStorage();
+        cout << "done. (V=" << numVertices() << ", F=" << numPrimitives() << ", mapped from \""
+             << cacheFile << "\" in " << timer.elapsedString() << " and " << memString(memoryUsage()) << ")" << endl;
+        return;
     }
 
-    m_F.resize(indices.size()/3);
-    for (auto i : range(int(m_F.size())))
-        m_F[i] = Vector3i(indices[3*i], indices[3*i+1], indices[3*i+2]);
+    OBJData data;
+    if (parser == "stream")
+        parseStream(filename, data);
+    else
+        parseParallel(mapSource(), filename, data);
+    const std::vector<Point3f> & positions = data.positions;
+    const std::vector<Point2f> & texcoords = data.texcoords;
+    const std::vector<Normal3f> & normals = data.normals;
 
-    m_V.resize(vertices.size());
+    std::vector<uint32_t>   indices;
+    std::vector<OBJVertex>  vertices;
+
+    // Convert to an indexed vertex list. A closed triangle mesh has about
+    // half as many vertices as faces, i.e. one per six corners.
+    VertexMap vertexMap(data.corners.size() / 6);
+    indices.reserve(data.corners.size());
+    for (const OBJVertex & v : data.corners)
+    {
+        uint32_t index = vertexMap.insert(v, (uint32_t) vertices.size());
+        if (index == vertices.size())
+            vertices.push_back(v);
+        indices.push_back(index);
+    }
+
+    // move everything into world space at once
+    m_xform.transformPoints(data.positions.data(), data.positions.data(), positions.size());
+    m_xform.transformNormals(data.normals.data(), data.normals.data(), normals.size());
+
+    std::vector<Vector3i> F(indices.size()/3);
+    for (auto i : range(int(F.size())))
+        F[i] = Vector3i(indices[3*i], indices[3*i+1], indices[3*i+2]);
+    m_F = std::move(F);
+
+    std::vector<Point3f> V(vertices.size());
     for (auto i : range(int(vertices.size())))
-        m_V[i] = positions.at(vertices[i].p-1);
+        V[i] = positions.at(vertices[i].p-1);
+    m_V = std::move(V);
 
     if (!normals.empty())
     {
-        m_N.resize(vertices.size());
+        std::vector<Normal3f> N(vertices.size());
         for (auto i : range(int(vertices.size())))
-            m_N[i] = normals.at(vertices[i].n-1);
+            N[i] = normals.at(vertices[i].n-1);
+        m_N = std::move(N);
     }
 
     if (!texcoords.empty())
     {
-        m_UV.resize(vertices.size());
+        std::vector<Point2f> UV(vertices.size());
         for (auto i : range(int(vertices.size())))
-            m_UV[i] = texcoords.at(vertices[i].uv-1);
+            UV[i] = texcoords.at(vertices[i].uv-1);
+        m_UV = std::move(UV);
     }
 
-    cout << "done. (V=" << m_V.size() << ", F=" << m_F.size() << ", took "
-         << timer.elapsedString() << " and "
-         << memString(m_F.size() * sizeof(uint32_t) +
-                 sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
-         << ")" << endl;
+    if (useCache)
+        saveCache(cacheFile, cacheSource);
+
+    precomputeTriangles();
+    compactStorage();
+
+    cout << "done. (V=" << numVertices() << ", F=" << numPrimitives() << ", took "
+         << timer.elapsedString() << " and " << memString(memoryUsage()) << ")" << endl;
+    message("de-duplicated %d face corners into %d vertices (%.2f corners per vertex) using a %s vertex table\n",
+            data.corners.size(), vertices.size(), data.corners.size() / std::max(1.0, double(vertices.size())),
+            memString(vertexMap.bytes()));
 }
@@ -22,6 +22,18 @@
 #include "mesh.h"
 
 //! Loader for Wavefront OBJ triangle meshes
+/*!
+    By default the file is memory-mapped, split into chunks at line
+    boundaries and parsed in parallel without per-line allocations. Faces may
+    be arbitrary convex polygons and may use negative (relative) indices.
+    "parser": "stream" selects the original line-by-line parser instead.
+
+    With "cache": true, the loaded geometry is cached next to the file (see
+    \ref Mesh::loadCache). A "cache_file" sets the cache path, e.g. outside a
+    read-only or versioned asset directory, and also enables the cache.
+    "compact": true stores the mesh in less memory (see
+    \ref Mesh::compactStorage()).
+*/
 class WavefrontOBJ : public Mesh
 {
 public:
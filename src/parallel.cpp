@@ -0,0 +1,229 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer, used in
+    Dartmouth's COSC 77/177 Computer Graphics course.
+
+    Copyright (c) 2016 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "parallel.h"
+
+// local variables
+namespace
+{
+
+// the pool (if any) the current thread is a worker of, and its queue index
+thread_local const ThreadPool * t_pool = nullptr;
+thread_local int t_queue = -1;
+
+} // namespace
+
+
+int numSystemThreads()
+{
+    return max(1, int(std::thread::hardware_concurrency()));
+}
+
+ThreadPool::ThreadPool(int numThreads) :
+    m_stop(false), m_queued(0)
+{
+    if (numThreads <= 0)
+        numThreads = numSystemThreads();
+
+    for (int i = 0; i < numThreads; ++i)
+        m_queues.emplace_back(new WorkQueue);
+
+    for (int i = 0; i < numThreads - 1; ++i)
+        m_workers.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+        m_stop = true;
+    }
+    m_wakeUp.notify_all();
+    for (auto & t : m_workers)
+        t.join();
+}
+
+int ThreadPool::currentQueue() const
+{
+    // threads outside of this pool share the last queue
+    return (t_pool == this) ? t_queue : int(m_workers.size());
+}
+
+void ThreadPool::push(Task && task)
+{
+    WorkQueue & q = *m_queues[currentQueue()];
+    {
+        std::lock_guard<std::mutex> lock(q.mutex);
+        q.tasks.push_back(std::move(task));
+    }
+    m_queued++;
+
+    // wakes a sleeping worker, or a thread waiting on a group
+    std::lock_guard<std::mutex> lock(m_sleepMutex);
+    m_wakeUp.notify_one();
+}
+
+bool ThreadPool::popOrSteal(Task & task)
+{
+    if (m_queued.load() == 0)
+        return false;
+
+    // newest task of our own queue first
+    int self = currentQueue();
+    {
+        WorkQueue & q = *m_queues[self];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (!q.tasks.empty())
+        {
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+            m_queued--;
+            return true;
+        }
+    }
+
+    // otherwise steal the oldest task of another queue
+    int n = int(m_queues.size());
+    for (int i = 1; i < n; ++i)
+    {
+        WorkQueue & q = *m_queues[(self + i) % n];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (!q.tasks.empty())
+        {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+            m_queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::execute(Task & task)
+{
+    try
+    {
+        task.fn();
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(task.group->m_exceptionMutex);
+        if (!task.group->m_exception)
+            task.group->m_exception = std::current_exception();
+    }
+
+    // the group may be destroyed as soon as its last task is done, so only touch the pool afterwards
+    if (--task.group->m_pending == 0)
+    {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+        m_wakeUp.notify_all();
+    }
+}
+
+void ThreadPool::workerLoop(int index)
+{
+    t_pool = this;
+    t_queue = index;
+
+    Task task;
+    while (true)
+    {
+        if (popOrSteal(task))
+        {
+            execute(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_sleepMutex);
+        if (m_stop)
+            break;
+        m_wakeUp.wait(lock, [this]() { return m_stop || m_queued.load() > 0; });
+    }
+
+    t_pool = nullptr;
+    t_queue = -1;
+}
+
+
+void TaskGroup::run(std::function<void()> fn)
+{
+    m_pending++;
+    ThreadPool::Task task;
+    task.fn = std::move(fn);
+    task.group = this;
+    m_pool.push(std::move(task));
+}
+
+void TaskGroup::wait()
+{
+    ThreadPool::Task task;
+    while (m_pending.load() > 0)
+    {
+        if (m_pool.popOrSteal(task))
+        {
+            m_pool.execute(task);
+            continue;
+        }
+
+        // sleep until the remaining tasks finish on other threads, or there is new work to help with
+        std::unique_lock<std::mutex> lock(m_pool.m_sleepMutex);
+        m_pool.m_wakeUp.wait(lock, [this]() { return m_pending.load() == 0 || m_pool.m_queued.load() > 0; });
+    }
+
+    // we may have been woken for a task we are not going to run, so pass that on
+    if (m_pool.m_queued.load() > 0)
+    {
+        std::lock_guard<std::mutex> lock(m_pool.m_sleepMutex);
+        m_pool.m_wakeUp.notify_one();
+    }
+
+    if (m_exception)
+    {
+        std::exception_ptr e = m_exception;
+        m_exception = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+
+void parallelFor(ThreadPool & pool, int begin, int end, const std::function<void(int)> & fn, int grain)
+{
+    if (end <= begin)
+        return;
+    grain = max(grain, 1);
+
+    std::atomic<int> next(begin);
+    auto worker = [&]()
+    {
+        while (true)
+        {
+            int start = next.fetch_add(grain);
+            if (start >= end)
+                break;
+            for (int i = start, stop = min(start + grain, end); i < stop; ++i)
+                fn(i);
+        }
+    };
+
+    int chunks = (end - begin + grain - 1) / grain;
+    TaskGroup group(pool);
+    for (int i = 0, n = min(pool.numThreads(), chunks); i < n; ++i)
+        group.run(worker);
+    group.wait();
+}
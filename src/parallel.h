@@ -0,0 +1,138 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer, used in
+    Dartmouth's COSC 77/177 Computer Graphics course.
+
+    Copyright (c) 2016 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+//! Return the number of hardware threads (at least 1)
+int numSystemThreads();
+
+class TaskGroup;
+
+//! A pool of worker threads that execute tasks with work stealing
+/*!
+    Every worker owns a double-ended queue of tasks. Tasks spawned from a
+    worker go to the back of its own queue and are executed LIFO, which keeps
+    recursive (divide-and-conquer) workloads depth-first and cache friendly.
+    Idle workers steal the oldest task from the front of another worker's
+    queue, which tends to be the largest piece of remaining work.
+
+    A pool created for \a n threads starts n-1 workers: the thread that waits
+    on a \ref TaskGroup executes tasks as well, so a single-threaded pool
+    simply runs everything inline.
+
+    Example usage:
+        ThreadPool pool(8);
+        TaskGroup group(pool);
+        for (auto i : range(100))
+            group.run([i]() { ... });
+        group.wait();
+*/
+class ThreadPool
+{
+public:
+    //! Create a pool using \a numThreads threads in total (<= 0: one per core)
+    explicit ThreadPool(int numThreads = 0);
+
+    //! Finish all queued tasks and join the workers
+    ~ThreadPool();
+
+    //! Total number of threads executing tasks, including the waiting thread
+    int numThreads() const { return int(m_workers.size()) + 1; }
+
+private:
+    friend class TaskGroup;
+
+    struct Task
+    {
+        std::function<void()> fn;
+        TaskGroup * group = nullptr;
+    };
+
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void push(Task && task);
+    bool popOrSteal(Task & task);
+    void execute(Task & task);
+    void workerLoop(int index);
+    int currentQueue() const;
+
+    std::vector<std::thread> m_workers;
+    //! one queue per worker, plus one shared by all threads outside the pool
+    std::vector<std::unique_ptr<WorkQueue>> m_queues;
+
+    std::atomic<bool> m_stop;
+    std::atomic<int> m_queued;
+    std::mutex m_sleepMutex;
+    //! notified when a task is queued or a group's last task finishes
+    std::condition_variable m_wakeUp;
+};
+
+
+//! A set of tasks that can be waited on as a whole
+class TaskGroup
+{
+public:
+    explicit TaskGroup(ThreadPool & pool) : m_pool(pool), m_pending(0) {}
+    ~TaskGroup()
+    {
+        try { wait(); } catch (...) {}
+    }
+
+    //! Queue \a fn for execution by the pool
+    void run(std::function<void()> fn);
+
+    //! Wait until all tasks of this group have finished, executing queued tasks in the meantime
+    /*!
+        Sleeps while there is nothing to execute, until a task is queued or
+        the group's last task finishes on another thread.
+
+        If a task threw an exception, the first one is rethrown here.
+    */
+    void wait();
+
+private:
+    friend class ThreadPool;
+
+    ThreadPool & m_pool;
+    std::atomic<int> m_pending;
+    std::mutex m_exceptionMutex;
+    std::exception_ptr m_exception;
+};
+
+
+//! Call \a fn(i) for every i in [begin, end) on the threads of \a pool
+/*!
+    Indices are handed out dynamically in chunks of \a grain, so uneven
+    per-index cost is balanced across threads.
+*/
+void parallelFor(ThreadPool & pool, int begin, int end, const std::function<void(int)> & fn, int grain = 1);
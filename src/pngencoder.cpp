@@ -0,0 +1,439 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer, used in
+    Dartmouth's COSC 77/177 Computer Graphics course.
+
+    Copyright (c) 2016 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pngencoder.h"
+#include "parallel.h"
+#include <algorithm>
+#include <fstream>
+#include <limits>
+
+// local functions
+namespace
+{
+
+// size of the deflate window
+const int windowSize = 32768;
+// bytes of filtered data compressed by one task
+const size_t groupSize = 256 * 1024;
+
+const uint32_t * crcTable()
+{
+    struct Table
+    {
+        uint32_t entries[256];
+        Table()
+        {
+            for (auto i : range(256))
+            {
+                uint32_t c = uint32_t(i);
+                for (int k = 0; k < 8; ++k)
+                    c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                entries[i] = c;
+            }
+        }
+    };
+    static const Table table;
+    return table.entries;
+}
+
+// continue the CRC-32 \a crc (0 to start) over \a size bytes
+uint32_t crc32(uint32_t crc, const uint8_t * data, size_t size)
+{
+    const uint32_t * table = crcTable();
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+const uint32_t adlerBase = 65521;
+
+uint32_t adler32(const uint8_t * data, size_t size)
+{
+    uint32_t a = 1, b = 0;
+    while (size > 0)
+    {
+        // the largest run that cannot overflow b
+        size_t n = std::min(size, size_t(5552));
+        for (size_t i = 0; i < n; ++i)
+        {
+            a += data[i];
+            b += a;
+        }
+        a %= adlerBase;
+        b %= adlerBase;
+        data += n;
+        size -= n;
+    }
+    return (b << 16) | a;
+}
+
+// the Adler-32 of the concatenation of two blocks, the second one \a size2 bytes long
+uint32_t adler32Combine(uint32_t adler1, uint32_t adler2, size_t size2)
+{
+    uint32_t rem = uint32_t(size2 % adlerBase);
+    uint32_t a1 = adler1 & 0xffff, b1 = adler1 >> 16;
+    uint32_t a2 = adler2 & 0xffff, b2 = adler2 >> 16;
+    uint32_t a = (a1 + a2 + adlerBase - 1) % adlerBase;
+    uint32_t b = uint32_t((uint64_t(rem) * a1 + b1 + b2 + adlerBase - rem) % adlerBase);
+    return (b << 16) | a;
+}
+
+// deflate streams are written least significant bit first
+class BitWriter
+{
+public:
+    explicit BitWriter(std::vector<uint8_t> & out) : m_out(out) {}
+
+    void put(uint32_t value, int count)
+    {
+        m_bits |= uint64_t(value) << m_count;
+        m_count += count;
+        while (m_count >= 8)
+        {
+            m_out.push_back(uint8_t(m_bits));
+            m_bits >>= 8;
+            m_count -= 8;
+        }
+    }
+
+    // Huffman codes are defined most significant bit first
+    void putCode(uint32_t code, int length)
+    {
+        uint32_t reversed = 0;
+        for (int i = 0; i < length; ++i)
+            reversed |= ((code >> i) & 1) << (length - 1 - i);
+        put(reversed, length);
+    }
+
+    void align()
+    {
+        if (m_count > 0)
+            put(0, 8 - m_count);
+    }
+
+private:
+    std::vector<uint8_t> & m_out;
+    uint64_t m_bits = 0;
+    int m_count = 0;
+};
+
+const int lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                            35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const int lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                             3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const int distanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+                              513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+const int distanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7,
+                               8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// a literal/length symbol with the fixed Huffman code
+void putSymbol(BitWriter & out, int symbol)
+{
+    if (symbol < 144)
+        out.putCode(0x30 + symbol, 8);
+    else if (symbol < 256)
+        out.putCode(0x190 + symbol - 144, 9);
+    else if (symbol < 280)
+        out.putCode(symbol - 256, 7);
+    else
+        out.putCode(0xc0 + symbol - 280, 8);
+}
+
+void putMatch(BitWriter & out, int length, int distance)
+{
+    int l = 28;
+    while (lengthBase[l] > length)
+        --l;
+    putSymbol(out, 257 + l);
+    out.put(length - lengthBase[l], lengthExtra[l]);
+
+    int d = 29;
+    while (distanceBase[d] > distance)
+        --d;
+    out.putCode(d, 5);
+    out.put(distance - distanceBase[d], distanceExtra[d]);
+}
+
+// deflate data[start, end) as part of a larger stream, with matches reaching back before start
+void deflateGroup(const uint8_t * data, size_t start, size_t end, int level, bool last, std::vector<uint8_t> & out)
+{
+    if (level == 0)
+    {
+        // stored blocks are byte aligned, so they simply follow each other
+        size_t pos = start;
+        do
+        {
+            size_t n = std::min(end - pos, size_t(65535));
+            bool final = last && pos + n == end;
+            uint8_t header[5] = {uint8_t(final ? 1 : 0), uint8_t(n), uint8_t(n >> 8), uint8_t(~n), uint8_t(~n >> 8)};
+            out.insert(out.end(), header, header + 5);
+            out.insert(out.end(), data + pos, data + pos + n);
+            pos += n;
+        } while (pos < end);
+        return;
+    }
+
+    BitWriter bits(out);
+    bits.put(last ? 1 : 0, 1);
+    bits.put(1, 2);                     // fixed Huffman codes
+
+    // hash chains over 3-byte prefixes; positions are relative to the start of the window
+    const int hashBits = 15;
+    size_t base = start > size_t(windowSize) ? start - windowSize : 0;
+    std::vector<int32_t> head(size_t(1) << hashBits, -1), prev(windowSize, -1);
+    auto hash = [&](size_t pos)
+    {
+        uint32_t v = uint32_t(data[pos]) | uint32_t(data[pos + 1]) << 8 | uint32_t(data[pos + 2]) << 16;
+        return (v * 2654435761u) >> (32 - hashBits);
+    };
+    auto insert = [&](size_t pos)
+    {
+        if (pos + 3 > end)
+            return;
+        uint32_t h = hash(pos);
+        int32_t p = int32_t(pos - base);
+        prev[p & (windowSize - 1)] = head[h];
+        head[h] = p;
+    };
+    for (size_t pos = base; pos < start; ++pos)
+        insert(pos);
+
+    int maxChain = level >= 9 ? 4096 : 2 << level;
+    size_t pos = start;
+    while (pos < end)
+    {
+        int best = 0, bestDistance = 0;
+        if (pos + 3 <= end)
+        {
+            int maxLength = int(std::min(end - pos, size_t(258)));
+            int32_t p = int32_t(pos - base);
+            int32_t candidate = head[hash(pos)];
+            for (int chain = maxChain; candidate >= 0 && p - candidate <= windowSize && chain > 0; --chain)
+            {
+                const uint8_t * a = data + base + candidate, * b = data + pos;
+                if (a[best] == b[best])
+                {
+                    int length = 0;
+                    while (length < maxLength && a[length] == b[length])
+                        ++length;
+                    if (length > best)
+                    {
+                        best = length;
+                        bestDistance = p - candidate;
+                        if (length == maxLength)
+                            break;
+                    }
+                }
+                // within the window, the slot of a candidate was not reused by a later position
+                int32_t next = prev[candidate & (windowSize - 1)];
+                if (next >= candidate)
+                    break;
+                candidate = next;
+            }
+        }
+
+        if (best >= 3)
+        {
+            putMatch(bits, best, bestDistance);
+            for (auto i : range(best))
+                insert(pos + i);
+            pos += best;
+        }
+        else
+        {
+            putSymbol(bits, data[pos]);
+            insert(pos);
+            ++pos;
+        }
+    }
+    putSymbol(bits, 256);               // end of block
+
+    if (!last)
+    {
+        // an empty stored block brings the stream back to a byte boundary
+        bits.put(0, 3);
+        bits.align();
+        const uint8_t empty[4] = {0x00, 0x00, 0xff, 0xff};
+        out.insert(out.end(), empty, empty + 4);
+    }
+    else
+        bits.align();
+}
+
+// the neighbour closest to a + b - c, selected with masks since the choice is hard to predict
+inline uint8_t paeth(int a, int b, int c)
+{
+    int pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2 * c);
+    int useB = -int(pb <= pc), useA = -int((pa <= pb) & (pa <= pc));
+    int bc = (b & useB) | (c & ~useB);
+    return uint8_t((a & useA) | (bc & ~useA));
+}
+
+// filter row y into out (filter type byte followed by the residuals)
+void filterRow(const uint8_t * rgb, int width, int y, bool adaptive, uint8_t * out)
+{
+    const int n = 3;
+    int rowBytes = width * n;
+    const uint8_t * row = rgb + size_t(y) * rowBytes;
+
+    out[0] = 0;
+    std::copy(row, row + rowBytes, out + 1);
+    if (!adaptive)
+        return;
+
+    // the row above the first one is all zeros
+    std::vector<uint8_t> zeros(y > 0 ? 0 : rowBytes, 0), candidate(rowBytes);
+    const uint8_t * up = y > 0 ? row - rowBytes : zeros.data();
+    auto cost = [](const uint8_t * residuals, int size)
+    {
+        int sum = 0;
+        for (int i = 0; i < size; ++i)
+            sum += std::abs(int(int8_t(residuals[i])));
+        return sum;
+    };
+
+    int bestCost = cost(out + 1, rowBytes);
+    for (int type = 1; type < 5; ++type)
+    {
+        // the first pixel has no left neighbours
+        uint8_t * r = candidate.data();
+        switch (type)
+        {
+            case 1:
+                for (int i = 0; i < n; ++i)
+                    r[i] = row[i];
+                for (int i = n; i < rowBytes; ++i)
+                    r[i] = uint8_t(row[i] - row[i - n]);
+                break;
+            case 2:
+                for (int i = 0; i < rowBytes; ++i)
+                    r[i] = uint8_t(row[i] - up[i]);
+                break;
+            case 3:
+                for (int i = 0; i < n; ++i)
+                    r[i] = uint8_t(row[i] - (up[i] >> 1));
+                for (int i = n; i < rowBytes; ++i)
+                    r[i] = uint8_t(row[i] - ((row[i - n] + up[i]) >> 1));
+                break;
+            case 4:
+                for (int i = 0; i < n; ++i)
+                    r[i] = uint8_t(row[i] - up[i]);
+                for (int i = n; i < rowBytes; ++i)
+                    r[i] = uint8_t(row[i] - paeth(row[i - n], up[i], up[i - n]));
+                break;
+        }
+
+        int c = cost(r, rowBytes);
+        if (c < bestCost)
+        {
+            bestCost = c;
+            out[0] = uint8_t(type);
+            std::copy(r, r + rowBytes, out + 1);
+        }
+    }
+}
+
+void putUInt32(std::vector<uint8_t> & out, uint32_t v)
+{
+    uint8_t bytes[4] = {uint8_t(v >> 24), uint8_t(v >> 16), uint8_t(v >> 8), uint8_t(v)};
+    out.insert(out.end(), bytes, bytes + 4);
+}
+
+// a PNG chunk: length, type, data, and the CRC of type and data
+void writeChunk(std::ofstream & file, const char * type, const std::vector<uint8_t> & data)
+{
+    std::vector<uint8_t> header;
+    putUInt32(header, uint32_t(data.size()));
+    header.insert(header.end(), type, type + 4);
+    uint32_t crc = crc32(crc32(0, header.data() + 4, 4), data.data(), data.size());
+    std::vector<uint8_t> trailer;
+    putUInt32(trailer, crc);
+
+    file.write(reinterpret_cast<const char *>(header.data()), header.size());
+    file.write(reinterpret_cast<const char *>(data.data()), data.size());
+    file.write(reinterpret_cast<const char *>(trailer.data()), trailer.size());
+}
+
+} // namespace
+
+
+bool writePNG(const std::string & filename, int width, int height, const uint8_t * rgb,
+              int level, ThreadPool & pool)
+{
+    if (width <= 0 || height <= 0)
+        return false;
+    level = clamp(level, 0, 9);
+
+    size_t filteredRow = size_t(width) * 3 + 1;
+    std::vector<uint8_t> filtered(filteredRow * height);
+    parallelFor(pool, 0, height, [&](int y)
+    {
+        filterRow(rgb, width, y, level > 0, &filtered[y * filteredRow]);
+    }, 16);
+
+    // whole rows per group, so the groups are also a natural unit for filtering
+    int rowsPerGroup = int(std::max(size_t(1), groupSize / filteredRow));
+    int numGroups = (height + rowsPerGroup - 1) / rowsPerGroup;
+    std::vector<std::vector<uint8_t>> groups(numGroups);
+    std::vector<uint32_t> adlers(numGroups);
+    parallelFor(pool, 0, numGroups, [&](int g)
+    {
+        size_t start = size_t(g) * rowsPerGroup * filteredRow;
+        size_t end = std::min(filtered.size(), start + rowsPerGroup * filteredRow);
+        if (g == 0)
+        {
+            // zlib header: deflate with a 32 KiB window, and the compression level as a hint
+            const uint8_t flags[4] = {0x01, 0x5e, 0x9c, 0xda};
+            groups[g].push_back(0x78);
+            groups[g].push_back(flags[level < 2 ? 0 : (level < 6 ? 1 : (level == 6 ? 2 : 3))]);
+        }
+        deflateGroup(filtered.data(), start, end, level, g == numGroups - 1, groups[g]);
+        adlers[g] = adler32(filtered.data() + start, end - start);
+    });
+
+    uint32_t adler = adlers[0];
+    for (int g = 1; g < numGroups; ++g)
+    {
+        size_t start = size_t(g) * rowsPerGroup * filteredRow;
+        size_t end = std::min(filtered.size(), start + rowsPerGroup * filteredRow);
+        adler = adler32Combine(adler, adlers[g], end - start);
+    }
+    putUInt32(groups.back(), adler);
+
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    if (!file)
+        return false;
+
+    const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    file.write(reinterpret_cast<const char *>(signature), 8);
+
+    std::vector<uint8_t> header;
+    putUInt32(header, uint32_t(width));
+    putUInt32(header, uint32_t(height));
+    const uint8_t format[5] = {8, 2, 0, 0, 0};      // 8-bit RGB, deflate, adaptive filtering, no interlacing
+    header.insert(header.end(), format, format + 5);
+    writeChunk(file, "IHDR", header);
+
+    for (auto & group : groups)
+        writeChunk(file, "IDAT", group);
+    writeChunk(file, "IEND", std::vector<uint8_t>());
+
+    return bool(file);
+}
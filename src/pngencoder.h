@@ -0,0 +1,42 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer, used in
+    Dartmouth's COSC 77/177 Computer Graphics course.
+
+    Copyright (c) 2016 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common.h"
+
+class ThreadPool;
+
+//! Write 8-bit RGB pixels (rows top to bottom, no padding) to a PNG file
+/*!
+    Rows are filtered in parallel, choosing the PNG filter with the smallest
+    sum of absolute residuals for every row. The filtered data is then split
+    into groups of rows of about 256 KiB, which are deflated in parallel and
+    stored as separate IDAT chunks of one zlib stream: every group may refer
+    back into the 32 KiB before it, like a serial compressor would, and ends
+    on a byte boundary with an empty stored block. The deflate encoder uses
+    the fixed Huffman codes and greedy LZ77 matching over hash chains.
+
+    \param level
+        Compression level: 0 stores the rows unfiltered and uncompressed,
+        1 to 9 follow increasingly long hash chains, trading speed for size.
+    \return whether the file was written successfully
+*/
+bool writePNG(const std::string & filename, int width, int height, const uint8_t * rgb,
+              int level, ThreadPool & pool);
@@ -23,31 +23,92 @@ Quad::Quad(const Scene & scene, const json & j)
     : Surface(scene, j)
 {
     Parser::get(j, m_width, "width");
+    setTransform(m_xform);
 }
 
-bool Quad::intersect(uint32_t, const Ray3f & ray, Intersection3f & its) const
+void Quad::setTransform(const Transform & xform)
+{
+    m_xform = xform;
+    m_toLocal = m_xform.inverse();
+    m_normal = (m_xform * Normal3f(0,0,1)).normalized();
+}
+
+// local functions
+namespace
 {
-    INCREMENT_INTERSECTED_PRIMS;
 
+// intersect a local-space ray with a quad of the given half width, returning the distance and local hit point
+bool hitQuad(const Ray3f & tray, float width, float & t, Point3f & p)
+{
     // compute ray intersection (and ray parameter), continue if not hit
-    auto tray = m_xform.inverse() * ray;
     if (tray.d.z() == 0)
         return false;
-    auto t = -tray.o.z() / tray.d.z();
-    auto p = tray(t);
-    if (m_width < p.x() || -m_width > p.x() || m_width < p.y() || -m_width > p.y())
+    t = -tray.o.z() / tray.d.z();
+    p = tray(t);
+    if (width < p.x() || -width > p.x() || width < p.y() || -width > p.y())
         return false;
 
     // check if computed param is within ray.mint and ray.maxt
-    if (t < tray.mint || t > tray.maxt)
+    return t >= tray.mint && t <= tray.maxt;
+}
+
+} // namespace
+
+
+bool Quad::intersect(uint32_t index, const Ray3f & ray, Intersection3f & its) const
+{
+    HitRecord hit;
+    if (!findHit(index, ray, hit))
+        return false;
+    computeHitDetails(ray, hit, its);
+    return true;
+}
+
+bool Quad::findHit(uint32_t index, const Ray3f & ray, HitRecord & hit) const
+{
+    INCREMENT_INTERSECTED_PRIMS;
+
+    // keep the local hit position for computeHitDetails
+    float t, u, v;
+    if (!findIntersection(ray, t, u, v))
         return false;
 
-    Normal3f gn = (m_xform * Normal3f(0,0,1)).normalized();
+    hit.t = t;
+    hit.surface = this;
+    hit.primIndex = index;
+    hit.u = u;
+    hit.v = v;
+    return true;
+}
+
+void Quad::computeHitDetails(const Ray3f &, const HitRecord & hit, Intersection3f & its) const
+{
     // if hit, set intersection record values
-    its = Intersection3f(t, m_xform * p, gn, gn,
-                         Point2f(lerpFactor(-m_width, m_width, p.x()),
-                                 lerpFactor(-m_width, m_width, p.y())),
+    its = Intersection3f(hit.t, m_xform * Point3f(hit.u, hit.v, 0), m_normal, m_normal,
+                         Point2f(lerpFactor(-m_width, m_width, hit.u),
+                                 lerpFactor(-m_width, m_width, hit.v)),
                          m_material, this);
+}
+
+bool Quad::occluded(uint32_t, const Ray3f & ray) const
+{
+    INCREMENT_SHADOW_PRIMS;
+    float t, u, v;
+    return findIntersection(ray, t, u, v);
+}
+
+bool Quad::findIntersection(const Ray3f & ray, float & t, float & u, float & v) const
+{
+    // intersect with a unit direction, which keeps the rounding of the hit
+    // point small; t and [mint, maxt] scale with the length of the direction
+    Ray3f tray = m_toLocal.transformSegment(ray);
+    float length = tray.d.norm();
+    Point3f p;
+    if (!hitQuad(Ray3f(tray.o, tray.d / length, ray.mint * length, ray.maxt * length), m_width, t, p))
+        return false;
+    t /= length;
+    u = p.x();
+    v = p.y();
     return true;
 }
 
@@ -22,13 +22,28 @@
 #include "surface.h"
 
 //! A quad spanning (-m_width, m_width) in the (x,y)-plane at z=0
+/*!
+    Rays are intersected in the local space of the quad with a normalized
+    direction. The inverse transform and world-space normal are computed once
+    per transform.
+*/
 class Quad : public Surface
 {
 public:
     Quad(const Scene & scene, const json & j = json());
+    virtual void setTransform(const Transform & xform);
     virtual Box3f localBBox(uint32_t index) const;
     virtual bool intersect(uint32_t idx, const Ray3f & ray, Intersection3f & its) const;
+    virtual bool occluded(uint32_t idx, const Ray3f & ray) const;
+    virtual bool findHit(uint32_t idx, const Ray3f & ray, HitRecord & hit) const;
+    virtual void computeHitDetails(const Ray3f & ray, const HitRecord & hit, Intersection3f & its) const;
 
 protected:
+    //! Find the hit of \a ray with the quad, returning its local (x,y) coordinates in \a u, \a v
+    bool findIntersection(const Ray3f & ray, float & t, float & u, float & v) const;
+
     float m_width = 1.0f;
+
+    Normal3f m_normal;              //!< world-space normal of the quad
+    Transform m_toLocal;            //!< inverse of m_xform
 };
@@ -56,6 +56,9 @@ struct TRay
     TRay(const TRay &ray)
      : o(ray.o), d(ray.d), mint(ray.mint), maxt(ray.maxt), depth(0) { }
 
+    //! Copy assignment, which also copies the depth
+    TRay & operator=(const TRay &ray) = default;
+
     //! Copy a ray, but change the covered segment of the copy
     TRay(const TRay &ray, Scalar mint, Scalar maxt)
      : o(ray.o), d(ray.d), mint(mint), maxt(maxt), depth(0) { }
@@ -114,3 +117,20 @@ public:
 
     }
 };
+
+
+//! The minimal record of a ray-surface hit kept during traversal
+/*!
+    Acceleration structures keep only this while searching for the closest
+    hit. The full \ref Intersection3f is computed once, for the final hit, by
+    \ref Surface::computeHitDetails(). The meaning of \a u and \a v is up to the
+    surface (e.g. barycentric coordinates for triangles).
+*/
+struct HitRecord
+{
+    float t = std::numeric_limits<float>::infinity();   //!< Ray parameter for the hit
+    const Surface * surface = nullptr;  //!< Surface that was hit
+    uint32_t primIndex = 0;             //!< Primitive within the surface
+    float u = 0.0f;                     //!< Surface-specific hit coordinate
+    float v = 0.0f;                     //!< Surface-specific hit coordinate
+};
@@ -22,9 +22,12 @@
 #include "parser.h"
 #include "obj.h"
 #include "bbh.h"
+#include "widebbh.h"
 #include "surface.h"
 #include "sphere.h"
 #include "quad.h"
+#include "instance.h"
+#include "timer.h"
 #include <iostream>
 #include <Eigen/Geometry>
 
@@ -52,6 +55,8 @@ Surface* parseSurface(const Scene & scene, const json & j)
         surface = new Sphere(scene, j);
     else if (type == "obj")
         surface = new WavefrontOBJ(scene, j);
+    else if (type == "instance")
+        surface = new Instance(scene, j);
     else
         throw DirtException("Unknown surface type \"%s\" in specification:\n\t%s",
                             type.c_str(), j.dump());
@@ -76,6 +81,10 @@ Accelerator* parseAccelerator(const Scene & scene, const json & j)
         std::transform(type.begin(), type.end(), type.begin(), ::tolower);
         if (type == "bbh" || type == "bvh")
             return new BBH(scene, j["accelerator"]);
+        else if (type == "bvh4")
+            return new WideBBH<4>(scene, j["accelerator"]);
+        else if (type == "bvh8")
+            return new WideBBH<8>(scene, j["accelerator"]);
         else
             throw DirtException("Unknown accelerator type %s\n", type.c_str());
     }
@@ -98,6 +107,12 @@ Scene::Scene(const string & filename) :
     // empty
 }
 
+const Prototype * Scene::findPrototype(const string & name) const
+{
+    auto prototype = m_prototypes.find(name);
+    return prototype != m_prototypes.end() ? prototype->second : nullptr;
+}
+
 const Material * Scene::findOrCreateMaterial(const json & j, const Material * defaultMat) const
 {
     if (!j.count("material"))
@@ -123,14 +138,45 @@ void Scene::parseFromJSON(const json & j)
 {
     if (j.empty()) {
         m_accelerator = parseAccelerator(*this, j);
+        Timer timer;
         m_accelerator->build();
+        m_buildTime = timer.elapsed();
         return;
     }
     cout << "parsing..." << endl;
     Parser::get(j, m_imageWidth, "image_width");
     Parser::get(j, m_imageHeight, "image_height");
     Parser::get(j, m_imageSamples, "image_samples");
+    m_imageSamples = max(1, m_imageSamples);
+    if (j.count("adaptive_sampling"))
+    {
+        // either true/false or an object with the settings
+        const json & a = j["adaptive_sampling"];
+        m_adaptiveSampling = a.is_boolean() ? a.get<bool>() : true;
+        if (a.is_object())
+        {
+            Parser::get(a, m_minSamples, "min_samples");
+            Parser::get(a, m_maxSamples, "max_samples");
+            Parser::get(a, m_sampleThreshold, "threshold");
+            Parser::get(a, m_sampleContrast, "contrast");
+        }
+        // the variance needs at least two samples
+        m_minSamples = max(2, m_minSamples);
+        m_maxSamples = max(m_minSamples, m_maxSamples);
+    }
     Parser::get(j, m_background, "background");
+    Parser::get(j, m_renderThreads, "render_threads");
+    Parser::get(j, m_tileSize, "tile_size");
+    m_tileSize = max(1, m_tileSize);
+    Parser::get(j, m_packetSize, "packet_size");
+    setPacketSize(m_packetSize);
+
+    string integrator = "recursive";
+    Parser::get(j, integrator, "integrator");
+    if (integrator == "wavefront")
+        m_wavefront = true;
+    else if (integrator != "recursive")
+        throw DirtException("Unknown integrator type %s\n", integrator.c_str());
 
     // create the scene-wide acceleration structure
     m_accelerator = parseAccelerator(*this, j);
@@ -160,14 +206,9 @@ void Scene::parseFromJSON(const json & j)
                 m_materials[name] = material;
             }
         }
-        else if (it.key() == "surfaces")
+        else if (it.key() == "prototypes" || it.key() == "surfaces")
         {
-            for (auto & s : it.value())
-            {
-                auto surface = parseSurface(*this, s);
-                m_accelerator->addSurface(surface);
-                m_surfaces.push_back(surface);
-            }
+            // handled below, once all materials are known
         }
         else if (it.key() == "lights")
         {
@@ -184,12 +225,17 @@ void Scene::parseFromJSON(const json & j)
         }
         else if (it.key() == "image_samples")
         {
-            m_imageSamples = it.value();
+            m_imageSamples = max(1, it.value().get<int>());
         }
         else if (it.key() == "background")
         {
             Parser::get(j, m_background, "background");
         }
+        else if (it.key() == "render_threads" || it.key() == "tile_size" || it.key() == "packet_size" ||
+                 it.key() == "integrator" || it.key() == "adaptive_sampling")
+        {
+            // already handled above
+        }
         else if (it.key() == "accelerator")
         {
             // already handled above
@@ -198,11 +244,45 @@ void Scene::parseFromJSON(const json & j)
             throw DirtException("unsupported keyword \"%s\"!", it.key());
     }
 
+    // prototypes have to exist before any instance in "surfaces" refers to them
+    if (j.count("prototypes"))
+    {
+        for (auto & p : j["prototypes"])
+        {
+            string name;
+            try
+            {
+                name = p.at("name");
+            }
+            catch (...)
+            {
+                throw DirtException("Missing \"name\" on prototype specification");
+            }
+            if (m_prototypes.count(name))
+                throw DirtException("Prototype \"%s\" declared twice!", name);
+            // a prototype may choose its own accelerator, otherwise it uses the scene's
+            auto blas = parseAccelerator(*this, p.count("accelerator") ? p : j);
+            m_prototypes[name] = new Prototype(parseSurface(*this, p), blas);
+        }
+    }
+
+    if (j.count("surfaces"))
+    {
+        for (auto & s : j["surfaces"])
+        {
+            auto surface = parseSurface(*this, s);
+            m_accelerator->addSurface(surface);
+            m_surfaces.push_back(surface);
+        }
+    }
+
+    Timer timer;
     m_accelerator->build();
+    m_buildTime = timer.elapsed();
     message("done parsing scene.\n");
 }
 
-Scene* create_test_scene_sphere()
+json create_test_scene_sphere()
 {
     std::string test = R"(
     {
@@ -228,11 +308,10 @@ Scene* create_test_scene_sphere()
         "background": [0.1, 0.1, 0.1]
     }
     )";
-    json j = json::parse(test);
-    return new Scene(j);
+    return json::parse(test);
 }
 
-Scene* create_test_scene_sphereplane()
+json create_test_scene_sphereplane()
 {
     std::string test = R"(
     {
@@ -265,11 +344,10 @@ Scene* create_test_scene_sphereplane()
         "background": [0.2, 0.2, 0.2]
     }
     )";
-    json j = json::parse(test);
-    return new Scene(j);
+    return json::parse(test);
 }
 
-Scene* create_test_scene_steinbach_screw()
+json create_test_scene_steinbach_screw()
 {
     json jobj;
     
@@ -351,10 +429,10 @@ Scene* create_test_scene_steinbach_screw()
         }
     }
     
-    return new Scene(jobj);
+    return jobj;
 }
 
-Scene* create_test_scene(int scene_type)
+json create_test_scene_json(int scene_type)
 {
     switch (scene_type)
     {
@@ -363,5 +441,11 @@ Scene* create_test_scene(int scene_type)
     case 2: return create_test_scene_steinbach_screw();
     }
     error("unknown test scene type %d\n", scene_type);
-    return nullptr;
+    return json();
+}
+
+Scene* create_test_scene(int scene_type)
+{
+    json j = create_test_scene_json(scene_type);
+    return j.empty() ? nullptr : new Scene(j);
 }
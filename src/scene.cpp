@@ -19,10 +19,13 @@
 
 #include "scene.h"
 #include "light.h"
+#include "instance.h"
 #include "progress.h"
+#include "parallel.h"
+#include <condition_variable>
+#include <mutex>
 
-uint64_t primitives_intersected = 0;
-uint64_t rays_traced = 0;
+thread_local RayStats rayStats;
 
 Scene::~Scene()
 {
@@ -34,6 +37,9 @@ Scene::~Scene()
     for (auto m: m_materials)
         delete m.second;
     m_materials.clear();
+    for (auto p: m_prototypes)
+        delete p.second;
+    m_prototypes.clear();
 }
 
 // compute the color corresponing to a ray by raytracing
@@ -53,6 +59,185 @@ Color3f Scene::radiance(const Ray3f & ray) const
     //    otherwise, return shade() result of intersection material
 }
 
+// trace the primary rays of the pixels [x0,x1) x [y0,y1) in packets and shade their hits
+void Scene::raytracePackets(Image3f & tile, int x0, int y0, int x1, int y1) const
+{
+    std::vector<Ray3f> rays;
+    rays.reserve(64);
+    Intersection3f its[64];
+    for (int py = y0; py < y1; py += m_packetSize)
+    {
+        for (int px = x0; px < x1; px += m_packetSize)
+        {
+            rays.clear();
+            for (auto y : range(py, min(py + m_packetSize, y1)))
+                for (auto x : range(px, min(px + m_packetSize, x1)))
+                    rays.push_back(m_camera->generateRay((x+0.5f)/m_imageWidth, (y+0.5f)/m_imageHeight));
+
+            uint64_t hits = intersectPacket(rays.data(), int(rays.size()), its);
+
+            int n = 0;
+            for (auto y : range(py, min(py + m_packetSize, y1)))
+                for (auto x : range(px, min(px + m_packetSize, x1)))
+                {
+                    // same as radiance(), with the intersection already done
+                    tile(x - x0, y - y0) = (hits & (uint64_t(1) << n)) ? its[n].mat->shade(rays[n], its[n], *this)
+                                                                        : m_background;
+                    ++n;
+                }
+        }
+    }
+}
+
+// local functions
+namespace
+{
+
+// hash of the pixel coordinates, used to decorrelate the sample patterns of neighboring pixels
+uint32_t hashPixel(uint32_t x, uint32_t y)
+{
+    uint32_t h = x * 0x9e3779b9u ^ (y + 0x7f4a7c15u) * 0x85ebca6bu;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+// the k-th point of the R2 low-discrepancy sequence, shifted by offset (toroidally)
+Vector2f r2Sample(int k, const Vector2f & offset)
+{
+    // 1/g and 1/g^2 for the plastic number g
+    const float a1 = 0.7548776662f, a2 = 0.5698402910f;
+    float u = offset.x() + a1 * k, v = offset.y() + a2 * k;
+    return Vector2f(u - std::floor(u), v - std::floor(v));
+}
+
+} // namespace
+
+uint64_t Scene::raytraceSampled(Image3f & tile, int x0, int y0, int x1, int y1) const
+{
+    uint64_t samples = 0;
+    if (!m_adaptiveSampling)
+    {
+        for (auto y : range(y0, y1))
+            for (auto x : range(x0, x1))
+            {
+                Color3f sum = Color3f::Zero();
+                for (auto j : range(m_imageSamples))
+                    for (auto i : range(m_imageSamples))
+                    {
+                        auto ray = m_camera->generateRay((x + (i + 0.5f) / m_imageSamples) / m_imageWidth,
+                                                         (y + (j + 0.5f) / m_imageSamples) / m_imageHeight);
+                        sum += radiance(ray);
+                    }
+                tile(x - x0, y - y0) = sum / float(m_imageSamples * m_imageSamples);
+                samples += m_imageSamples * m_imageSamples;
+            }
+        return samples;
+    }
+
+    // running mean and sum of squared deviations (Welford) of the colors clamped to
+    // the displayable range, so that highlights do not keep a pixel sampling
+    struct PixelState
+    {
+        Color3f sum = Color3f::Zero(), mean = Color3f::Zero(), m2 = Color3f::Zero();
+        int n = 0;
+        const Surface * surface = nullptr;      // what the first sample hit
+        const Material * material = nullptr;
+        bool edge = false;                      // samples or neighbors hit something else
+    };
+
+    // the tile and a one pixel border, whose first batches are also traced to find edges
+    int bx0 = max(x0 - 1, 0), by0 = max(y0 - 1, 0);
+    int bx1 = min(x1 + 1, m_imageWidth), by1 = min(y1 + 1, m_imageHeight);
+    int stride = bx1 - bx0;
+    std::vector<PixelState> pixels(stride * (by1 - by0));
+    auto pixel = [&](int x, int y) -> PixelState & { return pixels[(y - by0) * stride + x - bx0]; };
+
+    auto takeSamples = [&](int x, int y, int count)
+    {
+        PixelState & p = pixel(x, y);
+        uint32_t h = hashPixel(x, y);
+        Vector2f offset((h & 0xffff) / 65536.0f, (h >> 16) / 65536.0f);
+        for (int s = 0; s < count; ++s)
+        {
+            Vector2f u = r2Sample(p.n, offset);
+            auto ray = m_camera->generateRay((x + u.x()) / m_imageWidth, (y + u.y()) / m_imageHeight);
+
+            // same as radiance(), remembering what the camera ray hit
+            Intersection3f its;
+            bool hit = intersect(ray, its);
+            if (p.n == 0)
+            {
+                p.surface = its.surface;
+                p.material = its.mat;
+            }
+            else if (its.surface != p.surface || its.mat != p.material)
+                p.edge = true;
+            ++p.n;
+
+            Color3f c = hit ? its.mat->shade(ray, its, *this) : m_background;
+            p.sum += c;
+            Color3f clamped = c.cwiseMax(0.0f).cwiseMin(1.0f);
+            Color3f delta = clamped - p.mean;
+            p.mean += delta / float(p.n);
+            p.m2 += delta.cwiseProduct(clamped - p.mean);
+        }
+    };
+
+    // first batch everywhere; the neighboring tiles trace the same samples for
+    // their own pixels, so the border is left out of the ray statistics
+    RayStats before = rayStats;
+    for (auto y : range(by0, by1))
+        for (auto x : range(bx0, bx1))
+            if (x < x0 || x >= x1 || y < y0 || y >= y1)
+                takeSamples(x, y, m_minSamples);
+    rayStats = before;
+    for (auto y : range(y0, y1))
+        for (auto x : range(x0, x1))
+            takeSamples(x, y, m_minSamples);
+
+    // compare the first batches of all neighbors before any pixel takes more samples,
+    // so that the edges do not depend on the tiling
+    std::vector<bool> edges(pixels.size());
+    for (auto y : range(y0, y1))
+        for (auto x : range(x0, x1))
+        {
+            const PixelState & p = pixel(x, y);
+            bool edge = p.edge;
+            for (auto ny : range(max(y - 1, by0), min(y + 2, by1)))
+                for (auto nx : range(max(x - 1, bx0), min(x + 2, bx1)))
+                {
+                    const PixelState & q = pixel(nx, ny);
+                    if (q.surface != p.surface || q.material != p.material ||
+                        (q.mean - p.mean).cwiseAbs().maxCoeff() > m_sampleContrast)
+                        edge = true;
+                }
+            edges[(y - by0) * stride + x - bx0] = edge;
+        }
+
+    for (auto y : range(y0, y1))
+    {
+        for (auto x : range(x0, x1))
+        {
+            PixelState & p = pixel(x, y);
+            p.edge = edges[(y - by0) * stride + x - bx0];
+
+            // the squared standard error of the mean is variance / n
+            while (p.n < m_maxSamples &&
+                   (p.m2.maxCoeff() / float(p.n - 1) > m_sampleThreshold * m_sampleThreshold * p.n ||
+                    (p.edge && p.n < 2 * m_minSamples)))
+                takeSamples(x, y, min(m_minSamples, m_maxSamples - p.n));
+
+            tile(x - x0, y - y0) = p.sum / float(p.n);
+            samples += p.n;
+        }
+    }
+    return samples;
+}
+
 // raytrace an image
 Image3f Scene::raytrace() const
 {
@@ -68,43 +253,161 @@ Image3f Scene::raytrace() const
 				// compute ray-camera parameters (u,v) for the pixel
 				// compute camera ray
 				// set pixel to the color raytraced with the ray
+
+    renderTiles(nullptr, [&](int x0, int y0, const Image3f & tile)
+    {
+        for (auto y : range(tile.height()))
+            std::copy(&tile(0, y), &tile(0, y) + tile.width(), &image(x0, y0 + y));
+    });
     
-    for(auto y:range(image.height())){
-        for(auto x:range(image.width())){
-            
-            auto ray = m_camera->generateRay((x+0.5f)/m_imageWidth, (y+0.5f)/m_imageHeight);
-            image(x,y) = radiance(ray);
+    return image;
+}
+
+bool Scene::raytrace(ImageWriter & writer) const
+{
+    if (writer.width() != m_imageWidth || writer.height() != m_imageHeight)
+        throw DirtException("Cannot write a %dx%d image to a %dx%d file.", m_imageWidth, m_imageHeight,
+                            writer.width(), writer.height());
+
+    // a band is one row of tiles, written and released as soon as its last tile is done
+    struct Band
+    {
+        Image3f rows;
+        int remaining = 0;
+        bool done = false;
+    };
+    int tilesX = (m_imageWidth + m_tileSize - 1) / m_tileSize;
+    int tilesY = (m_imageHeight + m_tileSize - 1) / m_tileSize;
+    std::vector<Band> bands(tilesY);
+
+    // tiles start in order, so threads only get ahead of the oldest unfinished band
+    // while one of them finishes its last tiles; bound how far to bound the memory
+    int maxBands = (m_renderThreads > 0 ? m_renderThreads : numSystemThreads()) + 1;
+    int oldest = 0, open = 0, peak = 0;
+    bool ok = true;
+    std::mutex mutex;
+    std::condition_variable bandDone;
+
+    renderTiles([&](int tileRow)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        bandDone.wait(lock, [&]() { return tileRow < oldest + maxBands; });
+        Band & band = bands[tileRow];
+        if (band.remaining == 0 && !band.done)
+        {
+            band.rows.resize(m_imageWidth, min(m_tileSize, m_imageHeight - tileRow * m_tileSize));
+            band.remaining = tilesX;
+            peak = max(peak, ++open);
         }
+    },
+    [&](int x0, int y0, const Image3f & tile)
+    {
+        // tiles of a band cover different pixels, and the band is not resized while they run
+        Band & band = bands[y0 / m_tileSize];
+        for (auto y : range(tile.height()))
+            std::copy(&tile(0, y), &tile(0, y) + tile.width(), &band.rows(x0, y));
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--band.remaining > 0)
+                return;
+        }
+
+        bool written = writer.writeRows(y0, band.rows);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        ok = ok && written;
+        band.rows = Image3f();
+        band.done = true;
+        --open;
+        while (oldest < tilesY && bands[oldest].done)
+            ++oldest;
+        bandDone.notify_all();
+    });
+
+    message("streamed the image in bands of %d rows, at most %d bands (%s) in memory\n", m_tileSize, peak,
+            memString(size_t(peak) * m_imageWidth * m_tileSize * sizeof(Color3f)));
+    return ok;
+}
+
+void Scene::renderTiles(const std::function<void(int tileRow)> & starting,
+                        const std::function<void(int x0, int y0, const Image3f & tile)> & finished) const
+{
+    int tilesX = (m_imageWidth + m_tileSize - 1) / m_tileSize;
+    int tilesY = (m_imageHeight + m_tileSize - 1) / m_tileSize;
+    int numTiles = tilesX * tilesY;
+
+    // statistics gathered while rendering each tile
+    std::vector<RayStats> tileStats(numTiles);
+    std::vector<uint64_t> tileSamples(numTiles, 0);
+    RayStats startStats = rayStats;
+    bool sampled = m_adaptiveSampling || m_imageSamples > 1;
+
+    ThreadPool pool(m_renderThreads);
+    message("rendering %dx%d tiles of %dx%d pixels using %d threads...\n",
+            tilesX, tilesY, m_tileSize, m_tileSize, pool.numThreads());
+    if (sampled)
+    {
+        if (m_adaptiveSampling)
+            message("adaptive sampling: batches of %d samples per pixel, up to %d, until the standard error is below %g\n",
+                    m_minSamples, m_maxSamples, m_sampleThreshold);
+        else
+            message("sampling each pixel %dx%d times\n", m_imageSamples, m_imageSamples);
+        if (m_wavefront || m_packetSize > 0)
+            message("tracing camera rays one by one, since packets and wavefronts take one sample per pixel\n");
     }
-    
-    // else
-    // foreach image row (go over image height)
-    // foreach pixel in the row (go over image width)
-				// init accumulated color
-				// foreach sample in y (go over m_imageSamples)
-    //foreach sample in x (go over m_imageSamples)
-    // compute ray-camera parameters (u,v) for the sample within the pixel
-    // compute camera ray
-    // accumulate color raytraced with the ray
-				// divide color by the number of samples
-    
-    
-    // done
-    
-    /*for(auto y:range(image.height())){
-     for(auto x:range(image.width())){
-     Color3f Accumulatecolor = Color3f(0.0f,0.0f,0.0f);
-     auto subpixel = m_imageSamples*m_imageSamples;
-     
-     for(int i = 0 ; i < m_imageSamples ; i++){
-     for(int j = 0 ; j < m_imageSamples ; j++){
-     auto ray = m_camera->generateRay((x*m_imageSamples+i+0.5f)/(m_imageWidth*m_imageSamples), (y*m_imageSamples+j+0.5f)/(m_imageHeight*m_imageSamples));
-     Accumulatecolor = Accumulatecolor + radiance(ray);
-     }
-     }
-     image(x,y) = Color3f(Accumulatecolor.x()/(subpixel),Accumulatecolor.y()/(subpixel),Accumulatecolor.z()/(subpixel));
-     }
-     }*/
-     
-    return image;
-}
\ No newline at end of file
+    else if (m_wavefront)
+        message("tracing each tile breadth first\n");
+    else if (m_packetSize > 0)
+        message("tracing primary rays in %dx%d packets\n", m_packetSize, m_packetSize);
+    Progress progress("Rendering", numTiles);
+    std::mutex progressMutex;
+
+    parallelFor(pool, 0, numTiles, [&](int index)
+    {
+        if (starting)
+            starting(index / tilesX);
+
+        RayStats before = rayStats;
+        int x0 = (index % tilesX) * m_tileSize;
+        int y0 = (index / tilesX) * m_tileSize;
+        int x1 = min(x0 + m_tileSize, m_imageWidth);
+        int y1 = min(y0 + m_tileSize, m_imageHeight);
+        Image3f tile(x1 - x0, y1 - y0);
+        if (sampled)
+            tileSamples[index] = raytraceSampled(tile, x0, y0, x1, y1);
+        else if (m_wavefront)
+            raytraceWavefront(tile, x0, y0, x1, y1);
+        else if (m_packetSize > 0)
+            raytracePackets(tile, x0, y0, x1, y1);
+        else
+        {
+            for(auto y:range(y0, y1)){
+                for(auto x:range(x0, x1)){
+
+                    auto ray = m_camera->generateRay((x+0.5f)/m_imageWidth, (y+0.5f)/m_imageHeight);
+                    tile(x - x0, y - y0) = radiance(ray);
+                }
+            }
+        }
+        tileStats[index] = rayStats - before;
+        finished(x0, y0, tile);
+
+        std::lock_guard<std::mutex> lock(progressMutex);
+        ++progress;
+    });
+    progress.done();
+
+    // merge the per-tile statistics into those of the calling thread
+    rayStats = startStats;
+    for (auto & s : tileStats)
+        rayStats += s;
+
+    if (sampled)
+    {
+        uint64_t samples = 0;
+        for (auto s : tileSamples)
+            samples += s;
+        message("traced %d camera rays, %.2f per pixel\n", samples,
+                float(samples) / (m_imageWidth * m_imageHeight));
+    }
+}
\ No newline at end of file
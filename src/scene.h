@@ -25,6 +25,7 @@
 #include "ray.h"
 #include "material.h"
 #include "accelerator.h"
+#include <functional>
 
 
 //! Main scene data structure
@@ -46,6 +47,15 @@ public:
     //! Parser a scene from a json object
     void parseFromJSON(const json & j);
 
+    //! Return the surfaces placed in the scene, e.g. to move them between frames
+    const std::vector<Surface *> & surfaces() const { return m_surfaces; }
+
+    //! Update the acceleration structure after surfaces were moved (see \ref Accelerator::refit())
+    void refitAccelerator() { m_accelerator->refit(); }
+
+    //! Return the milliseconds it took to build the acceleration structure, which are part of parsing the scene
+    double buildTime() const { return m_buildTime; }
+
     //! Return a reference to an array containing all lights
     const std::vector<const Light *> &getLights() const { return m_lights; }
 
@@ -59,6 +69,9 @@ public:
     */
     const Material * findOrCreateMaterial(const json & j, const Material * def = nullptr) const;
 
+    //! Return the prototype declared with the given name, or nullptr
+    const Prototype * findPrototype(const string & name) const;
+
     //! Intersect a ray against all triangles stored in the scene and return detailed intersection information
     /*!
         \param ray
@@ -74,9 +87,54 @@ public:
     bool intersect(const Ray3f & ray, Intersection3f & its) const
     {
         INCREMENT_TRACED_RAYS;
+        // e.g. refraction under total internal reflection; such a ray would
+        // pass every slab test, so reject it before it walks the whole tree
+        if (ray.d.hasNaN())
+            return false;
         return m_accelerator->intersect(ray, its);
     }
 
+    //! Intersect a packet of up to \ref Accelerator::maxPacketRays coherent rays
+    /*!
+        Returns a bit mask of the rays that hit something and fills in their
+        records in \a its, exactly as \ref intersect() would for each ray.
+        Throws a DirtException for packets of more than
+        \ref Accelerator::maxPacketRays rays.
+    */
+    uint64_t intersectPacket(const Ray3f * rays, int n, Intersection3f * its) const
+    {
+        if (n > Accelerator::maxPacketRays)
+            throw DirtException("Packets hold at most %d rays, not %d.", Accelerator::maxPacketRays, n);
+        rayStats.raysTraced += n;
+        for (auto i : range(n))
+        {
+            if (rays[i].d.hasNaN())
+            {
+                // not worth a special case in the packet traversal
+                uint64_t mask = 0;
+                for (auto j : range(n))
+                    if (!rays[j].d.hasNaN() && m_accelerator->intersect(rays[j], its[j]))
+                        mask |= uint64_t(1) << j;
+                return mask;
+            }
+        }
+        return m_accelerator->intersectPacket(rays, n, its);
+    }
+
+    //! Return whether anything blocks the ray within [ray.mint, ray.maxt]
+    /*!
+        An any-hit query for shadow rays: it stops at the first hit and does
+        not compute an intersection record. Counted separately from
+        \ref intersect() in \ref RayStats.
+    */
+    bool occluded(const Ray3f & ray) const
+    {
+        INCREMENT_SHADOW_RAYS;
+        if (ray.d.hasNaN())
+            return false;
+        return m_accelerator->occluded(ray);
+    }
+
     //! Sample the incident radiance along a ray
     /*!
         \param scene
@@ -91,20 +149,125 @@ public:
     Color3f radiance(const Ray3f &ray) const;
 
     //! Generate the entire image by ray tracing.
+    /*!
+        The image is split into square tiles of \ref m_tileSize pixels, which
+        are handed out dynamically to \ref m_renderThreads threads. Every
+        pixel is computed independently, so the result does not depend on
+        the number of threads.
+
+        With "integrator": "wavefront", each tile is traced breadth first
+        instead of recursively, see \ref raytraceWavefront().
+
+        With more than one sample per pixel ("image_samples" > 1 or
+        "adaptive_sampling"), camera rays are traced one at a time, see
+        \ref raytraceSampled().
+    */
     Image3f raytrace() const;
 
+    //! Generate the image by ray tracing, streaming it to \a writer
+    /*!
+        Renders like \ref raytrace(), but keeps only the bands of rows
+        (\ref m_tileSize high) that are being rendered in memory, and writes
+        each band as soon as its last tile is done. Render threads wait
+        before getting more than one band per thread ahead of the oldest
+        unfinished band, so the memory does not depend on the image height.
+
+        \return whether all rows were written successfully
+    */
+    bool raytrace(ImageWriter & writer) const;
+
+    //! Return the width of the rendered image in pixels
+    int imageWidth() const { return m_imageWidth; }
+    //! Return the height of the rendered image in pixels
+    int imageHeight() const { return m_imageHeight; }
+
+    static constexpr int maxPacketSize = 8;     //!< largest packet width, so a packet has at most 64 rays
+    static_assert(maxPacketSize * maxPacketSize <= Accelerator::maxPacketRays, "packets do not fit a hit mask");
+
+    //! Trace primary rays in packets of \a size x \a size pixels (at most \ref maxPacketSize); 0 traces them one by one
+    void setPacketSize(int size)
+    {
+        if (size > maxPacketSize)
+            warning("Packet size %d is too large, using %d.\n", size, maxPacketSize);
+        m_packetSize = clamp(size, 0, maxPacketSize);
+    }
+
 private:
-    std::vector<const Surface *> m_surfaces;
+    //! Render all tiles in row-major order on \ref m_renderThreads threads
+    /*!
+        Before a tile is rendered, \a starting (if set) is called with its
+        row of tiles; afterwards \a finished is called with the position of
+        the tile and its pixels. Both are called from the render threads.
+    */
+    void renderTiles(const std::function<void(int tileRow)> & starting,
+                     const std::function<void(int x0, int y0, const Image3f & tile)> & finished) const;
+
+    //! \name Tile renderers
+    //! Render the pixels [x0,x1) x [y0,y1) of the image into \a tile, whose pixel (0,0) is (x0,y0)
+    //@{
+    //! Trace the camera rays in packets
+    void raytracePackets(Image3f & tile, int x0, int y0, int x1, int y1) const;
+
+    //! Trace breadth first
+    /*!
+        All camera rays of the tile are intersected as one wave, then shaded
+        together. Shading queues the shadow rays, which are sorted by
+        direction octant and Morton code of their origin and tested in bulk,
+        and then the reflected and refracted rays, which are sorted the same
+        way and form the next wave. The colors are combined in the same order
+        as \ref Material::shade(), so the image matches the recursive path.
+    */
+    void raytraceWavefront(Image3f & tile, int x0, int y0, int x1, int y1) const;
+
+    //! Take several samples per pixel
+    /*!
+        Without adaptive sampling, every pixel averages a regular grid of
+        \ref m_imageSamples x \ref m_imageSamples samples.
+
+        With adaptive sampling, every pixel starts with \ref m_minSamples
+        samples and adds batches of as many again until the standard error of
+        its mean color drops below \ref m_sampleThreshold, or it reaches
+        \ref m_maxSamples. Pixels whose samples, or whose neighbors' first
+        samples, hit different surfaces or materials, and pixels whose first
+        batch differs from a neighbor's by more than \ref m_sampleContrast,
+        are edges and take at least two batches, since a few samples easily
+        underestimate the variance at an edge. Tiles also trace the first
+        batch of a one pixel border for this, which is left out of the ray
+        statistics and the returned count since the neighboring tiles trace
+        the same samples again. The samples of a pixel follow
+        a 2D low-discrepancy sequence with a per-pixel random offset derived
+        from the pixel coordinates only, so the image does not depend on the
+        tiling or the number of threads.
+
+        \return the number of camera rays traced for the pixels of the tile
+    */
+    uint64_t raytraceSampled(Image3f & tile, int x0, int y0, int x1, int y1) const;
+    //@}
+
+    std::vector<Surface *> m_surfaces;
     std::map<std::string, const Material *> m_materials;
+    std::map<std::string, const Prototype *> m_prototypes;   //!< shared surfaces for "instance" surfaces
     Camera * m_camera = nullptr;
     Accelerator * m_accelerator = nullptr;
+    double m_buildTime = 0;                      //!< milliseconds spent in m_accelerator->build()
     std::vector<const Light *> m_lights;
     Color3f m_background = Color3f::Ones()*0.2f;
 
     int m_imageWidth = 512;                      //!< image resolution in x
     int m_imageHeight = 512;                     //!< image resolution in y
     int m_imageSamples = 1;                      //!< samples per pixels in each direction
+    bool m_adaptiveSampling = false;             //!< spend more samples on noisy pixels, see \ref raytraceSampled()
+    int m_minSamples = 4;                        //!< samples per pixel in each adaptive batch
+    int m_maxSamples = 64;                       //!< maximum adaptive samples per pixel
+    float m_sampleThreshold = 0.01f;             //!< standard error of a pixel at which adaptive sampling stops
+    float m_sampleContrast = 0.05f;              //!< color difference to a neighbor that marks an adaptive pixel as an edge
+    int m_renderThreads = 0;                     //!< render threads (0: one per core)
+    int m_tileSize = 32;                         //!< width and height of render tiles in pixels
+    int m_packetSize = 0;                        //!< width and height of primary ray packets (0: no packets)
+    bool m_wavefront = false;                    //!< render breadth first instead of recursively
 };
 
 // create test scenes that do not need to be loaded from a file
 Scene* create_test_scene(int scene_type);
+// the specification of a test scene, e.g. to render it with different settings
+json create_test_scene_json(int scene_type);
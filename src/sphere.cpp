@@ -24,6 +24,17 @@ Sphere::Sphere(const Scene & scene, const json & j)
     : Surface(scene, j)
 {
     Parser::get(j, m_radius, "radius");
+    setTransform(m_xform);
+}
+
+void Sphere::setTransform(const Transform & xform)
+{
+    m_xform = xform;
+    m_toLocal = m_xform.inverse();
+
+    m_worldSpace = m_xform.isSimilarity(&m_scale);
+    if (m_worldSpace)
+        m_center = m_xform * Point3f(0,0,0);
 }
 
 Box3f Sphere::localBBox(uint32_t index) const
@@ -32,45 +43,94 @@ Box3f Sphere::localBBox(uint32_t index) const
 }
 
 
-bool Sphere::intersect(uint32_t, const Ray3f & ray, Intersection3f & its) const
+// local functions
+namespace
+{
+
+// find the closest hit of a local-space ray with a sphere of the given radius at the origin
+bool hitSphere(const Ray3f & tray, float radius, float & t)
 {
-    INCREMENT_INTERSECTED_PRIMS;
-    // TODO: Assignment 1: Implement ray-sphere intersection
-    auto tray = m_xform.inverse()*ray;
-    
     auto A = tray.d.dot(tray.d);
     auto B = 2*tray.o.dot(tray.d);
-    auto C = tray.o.dot(tray.o) - m_radius*m_radius;
+    auto C = tray.o.dot(tray.o) - radius*radius;
     auto delta = B*B - 4*A*C;
     if(delta < 0)
         return false;
-    
-    
+
     auto t1 = (-B + sqrt(delta))/(2*A);
     auto t2 = (-B - sqrt(delta))/(2*A);
-    // not hit the surface validly
-    //message("%s and %s,%s\n",tray.maxt,t2,t1);
-    if(t1 < tray.mint || t2 > tray.maxt)
+    // use the near root unless it lies before the ray segment
+    t = (t2 < tray.mint) ? t1 : t2;
+    return t >= tray.mint && t <= tray.maxt;
+}
+
+} // namespace
+
+
+bool Sphere::intersect(uint32_t index, const Ray3f & ray, Intersection3f & its) const
+{
+    HitRecord hit;
+    if (!findHit(index, ray, hit))
+        return false;
+    computeHitDetails(ray, hit, its);
+    return true;
+}
+
+bool Sphere::findHit(uint32_t index, const Ray3f & ray, HitRecord & hit) const
+{
+    INCREMENT_INTERSECTED_PRIMS;
+    // TODO: Assignment 1: Implement ray-sphere intersection
+    float t, length;
+    if (!hitSphere(localRay(ray, length), m_radius, t))
         return false;
-    else if(t2 < tray.mint){
-        auto p1 = tray(t1);
-        auto gp1 = m_xform * p1;
-        Normal3f normal1 = p1 - Point3f::Zero();
-        normal1 = (m_xform * normal1).normalized();
-        its = Intersection3f(t1,gp1, normal1, normal1,
-                             Point2f(gp1.x(),gp1.y()),
-                             m_material, this);
-        return true;
+
+    // keep the local distance, so computeHitDetails finds the same local hit point
+    hit.t = t / length;
+    hit.surface = this;
+    hit.primIndex = index;
+    hit.u = t;
+    return true;
+}
+
+void Sphere::computeHitDetails(const Ray3f & ray, const HitRecord & hit, Intersection3f & its) const
+{
+    float length;
+    auto p = localRay(ray, length)(hit.u);
+    Point3f gp;
+    Normal3f normal;
+    if (m_worldSpace)
+    {
+        // the local frame of localRay() is not rotated, so p is also the world-space normal
+        gp = m_center + m_scale * (p - Point3f::Zero());
+        normal = (p - Point3f::Zero()).normalized();
     }
-    else{
-        auto p2 = tray(t2);
-        auto gp2 = m_xform * p2;
-        Normal3f normal2 = p2 - Point3f::Zero();
-        normal2 = (m_xform * normal2).normalized();
-        its = Intersection3f(t2,gp2, normal2, normal2,
-                             Point2f(gp2.x(),gp2.y()),
-                             m_material, this);
+    else
+    {
+        gp = m_xform * p;
+        normal = (m_xform * Normal3f(p - Point3f::Zero())).normalized();
     }
-    
-    return true;
+    its = Intersection3f(hit.t, gp, normal, normal,
+                         Point2f(gp.x(),gp.y()),
+                         m_material, this);
+}
+
+bool Sphere::occluded(uint32_t, const Ray3f & ray) const
+{
+    INCREMENT_SHADOW_PRIMS;
+    float t, length;
+    return hitSphere(localRay(ray, length), m_radius, t);
+}
+
+Ray3f Sphere::localRay(const Ray3f & ray, float & length) const
+{
+    // a sphere is invariant under rotations and reflections, so a similarity
+    // only needs to undo the translation and scale
+    Ray3f tray = m_worldSpace ?
+                 Ray3f((ray.o - m_center) / m_scale, ray.d / m_scale, ray.mint, ray.maxt) :
+                 m_toLocal.transformSegment(ray);
+
+    // intersect with a unit direction, which keeps the rounding of the hit
+    // point small; t and [mint, maxt] scale with the length of the direction
+    length = tray.d.norm();
+    return Ray3f(tray.o, tray.d / length, ray.mint * length, ray.maxt * length);
 }
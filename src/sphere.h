@@ -22,13 +22,34 @@
 #include "surface.h"
 
 //! A sphere centered at the origin with radius m_radius
+/*!
+    Rays are intersected in the local space of the sphere with a normalized
+    direction. If m_xform is a similarity, that local ray only needs the
+    world-space center and scale instead of the full inverse transform.
+*/
 class Sphere : public Surface
 {
 public:
     Sphere(const Scene & scene, const json & j = json());
     virtual Box3f localBBox(uint32_t index) const;
     virtual bool intersect(uint32_t idx, const Ray3f & ray, Intersection3f & its) const;
+    virtual bool occluded(uint32_t idx, const Ray3f & ray) const;
+    virtual bool findHit(uint32_t idx, const Ray3f & ray, HitRecord & hit) const;
+    virtual void computeHitDetails(const Ray3f & ray, const HitRecord & hit, Intersection3f & its) const;
+    virtual void setTransform(const Transform & xform);
 
 protected:
+    //! Return \a ray in a local frame of the sphere with a unit direction
+    /*!
+        \a length is the length of the direction before normalization. A hit
+        at local distance t is at ray parameter t / length of \a ray.
+    */
+    Ray3f localRay(const Ray3f & ray, float & length) const;
+
     float m_radius = 1.0f;
+
+    bool m_worldSpace = false;      //!< whether to intersect using the world-space center and scale
+    Point3f m_center;               //!< world-space center
+    float m_scale = 1.0f;           //!< uniform scale of m_xform
+    Transform m_toLocal;            //!< inverse of m_xform
 };
@@ -42,12 +42,63 @@ public:
     */
     virtual Box3f worldBBox(uint32_t index) const;
 
+    //! Return the transformation from local to world space
+    const Transform & transform() const { return m_xform; }
+
+    //! Move the surface
+    /*!
+        Surfaces override this to update data derived from the transform.
+        Acceleration structures containing the surface have to be refit
+        afterwards (see \ref Accelerator::refit()).
+    */
+    virtual void setTransform(const Transform & xform) { m_xform = xform; }
+
     const Material * material() const {return m_material;}
     void setMaterial(Material * m) {delete m_material; m_material = m;}
 
     //! Ray-Surface intersection test
     virtual bool intersect(uint32_t index, const Ray3f & ray, Intersection3f & its) const = 0;
 
+    //! Ray-Surface intersection test that only records what is needed to find the closest hit
+    /*!
+        Used by acceleration structures during traversal; the intersection
+        record of the closest hit is computed afterwards with
+        \ref computeHitDetails(). The default implementation falls back to
+        \ref intersect().
+    */
+    virtual bool findHit(uint32_t index, const Ray3f & ray, HitRecord & hit) const
+    {
+        Intersection3f its;
+        if (!intersect(index, ray, its))
+            return false;
+        hit.t = its.t;
+        hit.surface = this;
+        hit.primIndex = index;
+        return true;
+    }
+
+    //! Fill in the full intersection record for a hit found by \ref findHit()
+    /*!
+        The default implementation intersects the primitive again over the
+        segment ending at the hit.
+    */
+    virtual void computeHitDetails(const Ray3f & ray, const HitRecord & hit, Intersection3f & its) const
+    {
+        intersect(hit.primIndex, Ray3f(ray, ray.mint, hit.t), its);
+    }
+
+    //! Return whether the ray hits the given primitive anywhere within [ray.mint, ray.maxt]
+    /*!
+        Used for shadow rays, which need no intersection record. The default
+        implementation falls back to \ref intersect(); surfaces override it
+        to skip computing normals, texture coordinates, etc.
+    */
+    virtual bool occluded(uint32_t index, const Ray3f & ray) const
+    {
+        Intersection3f its;
+        return intersect(index, ray, its);
+    }
+
 protected:
     Transform m_xform = Transform();                //!< transformation
     const Material* m_material = new Material();    //!< material
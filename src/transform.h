@@ -48,6 +48,12 @@
     rotation, translation, uniform or non-uniform scaling, and perspective
     transformations. The inverse of this transformation is also recorded
     here, since it is required when transforming normal vectors.
+
+    Almost all transformations are affine (the last row of the matrix is
+    (0,0,0,1)). For those, points, vectors and boxes are transformed using
+    only the upper 3x4 part of the matrix, and normals with a cached 3x3
+    inverse transpose. Only transformations flagged as projective take the
+    general homogeneous path.
 */
 struct Transform
 {
@@ -55,14 +61,18 @@ public:
     //! Create the identity transform
     Transform() :
         m_transform(Eigen::Matrix4f::Identity()),
-        m_inverse(Eigen::Matrix4f::Identity()) {}
+        m_inverse(Eigen::Matrix4f::Identity()),
+        m_normalMatrix(Eigen::Matrix3f::Identity()) {}
 
     //! Create a new transform instance for the given matrix
     Transform(const Eigen::Matrix4f &trafo);
 
     //! Create a new transform instance for the given matrix and its inverse
     Transform(const Eigen::Matrix4f &trafo, const Eigen::Matrix4f &inv)
-        : m_transform(trafo), m_inverse(inv) {}
+        : m_transform(trafo), m_inverse(inv)
+    {
+        update();
+    }
 
     //! Return the underlying matrix
     const Eigen::Matrix4f & getMatrix() const
@@ -89,48 +99,72 @@ public:
     Vector3f operator*(const Vector3f &v) const
     {
         // TODO: Assignment 0: Implement this method
-        Vector4f v4 = Vector4f(v.x(),v.y(),v.z(),0.0f);
-        Vector4f vresult = m_transform*v4;
-        Vector3f vr= Vector3f(vresult.x(),vresult.y(),vresult.z());
-        
-        return vr;
+        // w = 0, so only the linear part matters, even for projective transforms
+        return Vector3f(linear() * v);
     }
 
     //! Apply the homogeneous transformation to a 3D normal
     Normal3f operator*(const Normal3f &n) const
     {
         // TODO: Assignment 1: Implement this method
-        Vector4f n4 = Vector4f(n.x(),n.y(),n.z(),0.0f);
-        Vector4f nresult = m_inverse.transpose()*n4;
-        Normal3f nr = (Normal3f(nresult.x(),nresult.y(),nresult.z())).normalized();
-        
-        return nr;
+        if (m_projective)
+            return Normal3f(m_inverse.transpose().topLeftCorner<3,3>() * n).normalized();
+        return Normal3f(m_normalMatrix * n).normalized();
     }
 
     //! Transform a point by an arbitrary matrix in homogeneous coordinates
     Point3f operator*(const Point3f &p) const
     {
         // TODO: Assignment 0: Implement this method
-        Point4f p4 = Point4f(p.x(),p.y(),p.z(),1.0f);
-        Point4f presult = m_transform*p4;
-        Point3f pr = Point3f(presult.x(),presult.y(),presult.z());
-        
-        return pr;
+        if (!m_projective)
+            return Point3f(linear() * p + translation());
+        Vector4f r = m_transform * Vector4f(p.x(), p.y(), p.z(), 1.0f);
+        return Point3f(r.head<3>() / r.w());
     }
 
     //! Apply the homogeneous transformation to a ray
     Ray3f operator*(const Ray3f &r) const
     {
         // TODO: Assignment 1: Implement this method
-        Vector4f v4 = Vector4f(r.d.x(),r.d.y(),r.d.z(),0.0f);
-        Vector4f vresult = m_transform*v4;
-        Vector3f v = Vector3f(vresult.x(),vresult.y(),vresult.z());
-        
-        Point4f p4 = Point4f(r.o.x(),r.o.y(),r.o.z(),1.0f);
-        Point4f presult = m_transform*p4;
-        Point3f p = Point3f(presult.x(),presult.y(),presult.z());
-        
-        return Ray3f(p,v.normalized(),r.mint,r.maxt);
+        return Ray3f(operator*(r.o), operator*(r.d).normalized(), r.mint, r.maxt);
+    }
+
+    //! Apply the transformation to a ray without normalizing its direction
+    /*!
+        Unlike \ref operator*(const Ray3f&), a ray parameter t refers to the
+        same point before and after the transformation, so hit distances
+        computed on the returned ray can be used in the original space.
+    */
+    Ray3f transformSegment(const Ray3f &r) const
+    {
+        return Ray3f(operator*(r.o), operator*(r.d), r.mint, r.maxt);
+    }
+
+    //! Return whether the transformation is affine (has no projective part)
+    bool isAffine() const
+    {
+        return !m_projective;
+    }
+
+    //! Return whether the transformation is a similarity
+    /*!
+        A similarity combines rotations, reflections, translation and a
+        uniform \a scale, so it maps spheres to spheres.
+    */
+    bool isSimilarity(float * scale = nullptr, float epsilon = 1e-5f) const
+    {
+        if (m_projective)
+            return false;
+
+        Eigen::Matrix3f m = linear();
+        Eigen::Matrix3f mtm = m.transpose() * m;
+        float s2 = mtm.trace() / 3.0f;
+        if (s2 <= 0.0f || !mtm.isApprox(s2 * Eigen::Matrix3f::Identity(), epsilon))
+            return false;
+
+        if (scale)
+            *scale = std::sqrt(s2);
+        return true;
     }
 
     //! Transform the Box and return the resulting bounding box
@@ -140,6 +174,22 @@ public:
         if (box.isEmpty())
             return box;
 
+        if (!m_projective)
+        {
+            // J. Arvo, "Transforming axis-aligned bounding boxes", Graphics Gems, 1990:
+            // each coordinate of the new box is the translation plus the smaller
+            // (or larger) contribution of every input coordinate
+            Vector3f newMin = translation(), newMax = translation();
+            for (int i = 0; i < 3; ++i)
+            {
+                Vector3f a = m_transform.block<3,1>(0,i) * box.min()[i];
+                Vector3f b = m_transform.block<3,1>(0,i) * box.max()[i];
+                newMin += a.cwiseMin(b);
+                newMax += a.cwiseMax(b);
+            }
+            return Box3f(newMin, newMax);
+        }
+
         // Just in case this is a projection matrix, do things the naive way.
         Point3f pts[8];
 
@@ -160,10 +210,42 @@ public:
         return newBox;
     }
 
+    //! \name Batch transformations
+    //! Transform \a n elements of \a in into \a out, which may be the same array.
+    //! These use SSE when available.
+    //@{
+    void transformPoints(const Point3f * in, Point3f * out, size_t n) const;
+    //! Normals are normalized after transformation
+    void transformNormals(const Normal3f * in, Normal3f * out, size_t n) const;
+    void transformBoxes(const Box3f * in, Box3f * out, size_t n) const;
+    //@}
+
     //! Return a string representation
     std::string toString() const;
 
 private:
+    //! The upper-left 3x3 part of the matrix
+    Eigen::Block<const Eigen::Matrix4f, 3, 3> linear() const
+    {
+        return m_transform.topLeftCorner<3,3>();
+    }
+
+    //! The translation part of the matrix
+    Eigen::Block<const Eigen::Matrix4f, 3, 1> translation() const
+    {
+        return m_transform.block<3,1>(0,3);
+    }
+
+    //! Recompute the cached normal matrix and the projective flag
+    void update()
+    {
+        m_projective = m_transform.row(3) != Eigen::RowVector4f(0, 0, 0, 1);
+        // for affine transforms, the linear part of the inverse is the inverse of the linear part
+        m_normalMatrix = m_inverse.topLeftCorner<3,3>().transpose();
+    }
+
     Eigen::Matrix4f m_transform;
     Eigen::Matrix4f m_inverse;
+    Eigen::Matrix3f m_normalMatrix;     //!< inverse transpose of the linear part
+    bool m_projective = false;          //!< whether the last row is not (0,0,0,1)
 };
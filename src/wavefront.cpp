@@ -0,0 +1,198 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer, used in
+    Dartmouth's COSC 77/177 Computer Graphics course.
+
+    Copyright (c) 2016 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "scene.h"
+#include "light.h"
+#include <algorithm>
+
+// local functions
+namespace
+{
+
+// spread the lower 10 bits of v so that there are two zero bits between each
+inline uint32_t expandBits(uint32_t v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// 30-bit Morton code of a point with coordinates in [0,1]
+inline uint32_t morton3(const Vector3f & p)
+{
+    uint32_t x = uint32_t(clamp(p.x() * 1024.0f, 0.0f, 1023.0f));
+    uint32_t y = uint32_t(clamp(p.y() * 1024.0f, 0.0f, 1023.0f));
+    uint32_t z = uint32_t(clamp(p.z() * 1024.0f, 0.0f, 1023.0f));
+    return (expandBits(x) << 2) | (expandBits(y) << 1) | expandBits(z);
+}
+
+//! A ray waiting in a queue, and the path node it belongs to
+struct QueuedRay
+{
+    Ray3f ray;
+    int depth;                  //!< Ray3f's copy constructor drops the depth, so keep it here
+    int node;
+};
+
+//! Return the order in which to trace \a queue: grouped by direction octant, then along a Morton curve of the origins
+std::vector<uint32_t> sortedOrder(const std::vector<QueuedRay> & queue)
+{
+    Box3f bounds;
+    for (auto & q : queue)
+        bounds.extend(q.ray.o);
+    Vector3f scale = (bounds.max() - bounds.min()).cwiseMax(Vector3f::Constant(Epsilon)).cwiseInverse();
+
+    std::vector<uint64_t> keys(queue.size());
+    for (auto i : range(int(queue.size())))
+    {
+        const Ray3f & r = queue[i].ray;
+        uint64_t octant = (std::signbit(r.d.x()) ? 4 : 0) | (std::signbit(r.d.y()) ? 2 : 0) | (std::signbit(r.d.z()) ? 1 : 0);
+        uint64_t code = morton3((r.o - bounds.min()).cwiseProduct(scale));
+        // 3 octant bits, the top 29 bits of the Morton code and a 32-bit index
+        keys[i] = (octant << 61) | ((code >> 1) << 32) | uint64_t(i);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<uint32_t> order(queue.size());
+    for (auto i : range(int(keys.size())))
+        order[i] = uint32_t(keys[i] & 0xFFFFFFFFu);
+    return order;
+}
+
+} // namespace
+
+
+// trace the pixels [x0,x1) x [y0,y1) breadth first
+void Scene::raytraceWavefront(Image3f & tile, int x0, int y0, int x1, int y1) const
+{
+    // One node per traced ray. The color of a node is its direct lighting
+    // plus the colors of its reflected and refracted children, added in the
+    // same order as Material::shade, so the result matches the recursive path.
+    struct PathNode
+    {
+        Color3f color = Color3f::Zero();
+        const Material * mat = nullptr;     //!< material at the hit, null if the ray missed
+        int reflected = -1;                 //!< node of the reflected ray
+        int refracted = -1;                 //!< node of the refracted ray
+    };
+    std::vector<PathNode> nodes;
+
+    std::vector<QueuedRay> queue, next;
+    for (auto y : range(y0, y1))
+        for (auto x : range(x0, x1))
+        {
+            auto ray = m_camera->generateRay((x+0.5f)/m_imageWidth, (y+0.5f)/m_imageHeight);
+            queue.push_back({ray, ray.depth, int(nodes.size())});
+            nodes.emplace_back();
+        }
+
+    const auto & lights = getLights();
+    std::vector<Intersection3f> its;
+    std::vector<QueuedRay> shadowQueue;
+    std::vector<char> blocked;
+
+    std::vector<char> hit;
+    for (int wave = 0; !queue.empty(); ++wave)
+    {
+        // intersect the whole wave in a coherent order; camera rays already are
+        its.resize(queue.size());
+        hit.resize(queue.size());
+        for (auto & q : queue)
+            q.ray.depth = q.depth;
+        if (wave == 0)
+        {
+            for (auto i : range(int(queue.size())))
+                hit[i] = intersect(queue[i].ray, its[i]);
+        }
+        else
+        {
+            for (auto i : sortedOrder(queue))
+                hit[i] = intersect(queue[i].ray, its[i]);
+        }
+
+        // one shadow ray per hit and light, in the order shade() tests them
+        shadowQueue.clear();
+        for (auto i : range(int(queue.size())))
+        {
+            if (!hit[i])
+                continue;
+            nodes[queue[i].node].mat = its[i].mat;
+            for (auto l : lights)
+                shadowQueue.push_back({Material::shadowRay(its[i], *l), 0, i});
+        }
+
+        blocked.assign(shadowQueue.size(), 0);
+        for (auto s : sortedOrder(shadowQueue))
+            blocked[s] = occluded(shadowQueue[s].ray);
+
+        // direct lighting, then the secondary rays of the next wave
+        next.clear();
+        size_t s = 0;
+        for (auto i : range(int(queue.size())))
+        {
+            if (!hit[i])
+                continue;
+            const Ray3f & ray = queue[i].ray;
+            const Material * mat = its[i].mat;
+            int node = queue[i].node;
+            for (auto l : lights)
+            {
+                if (!blocked[s++])
+                    mat->addLight(ray, its[i], *l, nodes[node].color);
+            }
+
+            Ray3f secondary;
+            if (mat->reflectedRay(ray, its[i], secondary))
+            {
+                nodes[node].reflected = int(nodes.size());
+                next.push_back({secondary, secondary.depth, int(nodes.size())});
+                nodes.emplace_back();
+            }
+            if (mat->refractedRay(ray, its[i], secondary))
+            {
+                nodes[node].refracted = int(nodes.size());
+                next.push_back({secondary, secondary.depth, int(nodes.size())});
+                nodes.emplace_back();
+            }
+        }
+        queue.swap(next);
+    }
+
+    // children are created after their parents, so resolve the nodes back to front
+    for (int i = int(nodes.size()) - 1; i >= 0; --i)
+    {
+        PathNode & node = nodes[i];
+        if (!node.mat)
+        {
+            node.color = m_background;
+            continue;
+        }
+        if (node.reflected >= 0)
+            node.mat->addReflected(nodes[node.reflected].color, node.color);
+        if (node.refracted >= 0)
+            node.mat->addRefracted(nodes[node.refracted].color, node.color);
+    }
+
+    int i = 0;
+    for (auto y : range(y0, y1))
+        for (auto x : range(x0, x1))
+            tile(x - x0, y - y0) = nodes[i++].color;
+}
@@ -0,0 +1,243 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer, used in
+    Dartmouth's COSC 77/177 Computer Graphics course.
+
+    Copyright (c) 2016 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "widebbh.h"
+#include "timer.h"
+
+// local functions
+namespace
+{
+
+inline int intersectChildren(const Box4f & boxes, const PreparedRay & ray, float maxt, float * tNear)
+{
+    return aabbIntersect4(boxes, ray, maxt, tNear);
+}
+
+inline int intersectChildren(const Box8f & boxes, const PreparedRay & ray, float maxt, float * tNear)
+{
+    return aabbIntersect8(boxes, ray, maxt, tNear);
+}
+
+} // namespace
+
+
+template <int N>
+void WideBBH<N>::build()
+{
+    message("building a %d-wide BBH with max %d primitives per leaf...\n", N, maxPrimsInNode);
+
+    if (m_primitives.empty())
+        return;
+
+    buildTree();
+
+    Timer timer;
+    m_wideNodes.clear();
+    m_wideNodes.reserve(totalNodes / (N - 1) + 1);
+    collapse(TreeRoot);
+
+    deleteTree(TreeRoot);
+    TreeRoot = nullptr;
+
+    message("collapsed into %d %d-wide nodes (%s) in %s\n", m_wideNodes.size(), N,
+            memString(m_wideNodes.size() * sizeof(Node)), timer.elapsedString());
+}
+
+template <int N>
+uint32_t WideBBH<N>::collapse(const BBHNode * node)
+{
+    // start with the two children and keep opening the largest interior child
+    std::vector<const BBHNode *> children;
+    if (node->isleaf)
+        children.push_back(node);
+    else
+        children = {node->leftchild, node->rightchild};
+
+    while (int(children.size()) < N)
+    {
+        int largest = -1;
+        float largestArea = -1.0f;
+        for (auto i : range(int(children.size())))
+        {
+            if (!children[i]->isleaf && children[i]->bounds.surfaceArea() > largestArea)
+            {
+                largest = i;
+                largestArea = children[i]->bounds.surfaceArea();
+            }
+        }
+        if (largest < 0)
+            break;
+
+        // keep the children in their spatial order
+        const BBHNode * opened = children[largest];
+        children[largest] = opened->leftchild;
+        children.insert(children.begin() + largest + 1, opened->rightchild);
+    }
+
+    uint32_t index = uint32_t(m_wideNodes.size());
+    m_wideNodes.emplace_back();
+    m_wideNodes[index].numChildren = int(children.size());
+
+    for (auto i : range(N))
+    {
+        // the node array may grow while collapsing the children, so index it every time
+        if (i >= int(children.size()))
+        {
+            m_wideNodes[index].child[i] = 0;
+            m_wideNodes[index].nPrims[i] = 0;
+            continue;
+        }
+
+        const BBHNode * c = children[i];
+        uint32_t child = c->isleaf ? c->primOffset : collapse(c);
+        Node & wide = m_wideNodes[index];
+        wide.bounds.set(i, c->bounds);
+        wide.child[i] = child;
+        wide.nPrims[i] = uint16_t(c->isleaf ? c->nPrims : 0);
+    }
+    return index;
+}
+
+template <int N>
+void WideBBH<N>::refit()
+{
+    Timer timer;
+    Accelerator::refit();
+
+    // children are created after their parent, so a backwards sweep visits them first
+    std::vector<Box3f> nodeBounds(m_wideNodes.size());
+    for (int i = int(m_wideNodes.size()) - 1; i >= 0; --i)
+    {
+        Node & node = m_wideNodes[i];
+        for (auto c : range(node.numChildren))
+        {
+            Box3f bounds;
+            if (node.nPrims[c] > 0)
+            {
+                for (auto p : range(int(node.child[c]), int(node.child[c] + node.nPrims[c])))
+                    bounds.extend(m_primBounds.bounds[p]);
+            }
+            else
+                bounds = nodeBounds[node.child[c]];
+            node.bounds.set(c, bounds);
+            nodeBounds[i].extend(bounds);
+        }
+    }
+
+    message("refit %d-wide BBH in %s\n", N, timer.elapsedString());
+}
+
+template <int N>
+void WideBBH<N>::clear()
+{
+    m_wideNodes.clear();
+    m_wideNodes.shrink_to_fit();
+    BBH::clear();
+}
+
+template <int N>
+bool WideBBH<N>::findHit(const Ray3f & ray, HitRecord & hit) const
+{
+    return traverse<false>(ray, hit);
+}
+
+template <int N>
+bool WideBBH<N>::occluded(const Ray3f & ray) const
+{
+    HitRecord unused;
+    return traverse<true>(ray, unused);
+}
+
+template <int N>
+template <bool AnyHit>
+bool WideBBH<N>::traverse(const Ray3f & _ray, HitRecord & hit) const
+{
+    if (m_wideNodes.empty())
+        return false;
+
+    // copy the ray so we can shrink maxt as closer hits are found
+    Ray3f ray = _ray;
+    PreparedRay pray(ray);
+    bool hitSomething = false;
+
+    // children still to be visited, with the distance at which the ray enters them;
+    // every level leaves at most N-1 entries behind
+    struct Entry
+    {
+        uint32_t index;
+        uint32_t nPrims;
+        float tNear;
+    };
+    Entry todo[maxTreeDepth * (N - 1) + 1];
+    int todoSize = 0;
+    todo[todoSize++] = {0, 0, ray.mint};
+
+    while (todoSize > 0)
+    {
+        const Entry entry = todo[--todoSize];
+
+        // a closer hit was found after this entry was pushed
+        if (entry.tNear > ray.maxt)
+            continue;
+
+        if (entry.nPrims > 0)
+        {
+            for (auto i : range(entry.index, entry.index + entry.nPrims))
+            {
+                if (hitLeafPrimitive<AnyHit>(i, pray, ray, hit))
+                {
+                    if (AnyHit)
+                        return true;
+                    hitSomething = true;
+                }
+            }
+            continue;
+        }
+
+        if (AnyHit)
+            INCREMENT_SHADOW_VISITED_NODES;
+        else
+            INCREMENT_VISITED_NODES;
+        const Node & node = m_wideNodes[entry.index];
+        float tNear[N];
+        int mask = intersectChildren(node.bounds, pray, ray.maxt, tNear);
+
+        // push the hit children sorted by decreasing distance, so the nearest is visited first
+        int first = todoSize;
+        for (auto i : range(node.numChildren))
+        {
+            if (!(mask & (1 << i)))
+                continue;
+
+            Entry child = {node.child[i], node.nPrims[i], tNear[i]};
+            int j = todoSize++;
+            while (j > first && todo[j - 1].tNear < child.tNear)
+            {
+                todo[j] = todo[j - 1];
+                --j;
+            }
+            todo[j] = child;
+        }
+    }
+
+    return hitSomething;
+}
+
+template class WideBBH<4>;
+template class WideBBH<8>;
@@ -0,0 +1,77 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer, used in
+    Dartmouth's COSC 77/177 Computer Graphics course.
+
+    Copyright (c) 2016 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "bbh.h"
+
+//! A BBH with N children per node (N = 4 or 8)
+/*!
+    The binary tree built by \ref BBH is collapsed into N-ary nodes by
+    repeatedly pulling up the children of the largest interior child. The
+    bounds of all children of a node are stored as a structure of arrays, so
+    a single \ref aabbIntersect4 / \ref aabbIntersect8 call tests them all.
+    Hit children are visited front to back, and children that start beyond
+    the closest hit found so far are skipped when they are popped.
+
+    Accepts the same parameters as \ref BBH; "flatten" and "rebuildThreshold"
+    are ignored.
+*/
+template <int N>
+class WideBBH : public BBH
+{
+public:
+    WideBBH(const Scene & scene, const json & j = json()) : BBH(scene, j) {}
+
+    virtual void clear();
+    virtual void build();
+
+    //! Refit the bounds of all wide nodes bottom-up; "rebuildThreshold" is ignored
+    virtual void refit();
+
+    //! Find the closest hit of a ray with all surfaces registered with the Accelerator
+    virtual bool findHit(const Ray3f & ray, HitRecord & hit) const;
+
+    //! Return whether any surface blocks the ray, stopping at the first hit
+    virtual bool occluded(const Ray3f & ray) const;
+
+    //! A node with up to N children
+    /*!
+        A child with nPrims > 0 is a leaf covering nPrims primitives starting at
+        child[i] in m_primitives, otherwise child[i] is the index of another
+        node. Unused slots have an empty box, so they are never hit.
+    */
+    struct alignas(64) Node
+    {
+        BoxN<N> bounds;                     //!< bounds of the children
+        uint32_t child[N];                  //!< node index or first primitive
+        uint16_t nPrims[N];                 //!< number of primitives of leaf children
+        int numChildren = 0;
+    };
+
+    std::vector<Node, AlignedAllocator<Node, 64>> m_wideNodes;
+
+private:
+    //! Closest-hit or (with \a AnyHit) any-hit traversal
+    template <bool AnyHit>
+    bool traverse(const Ray3f & ray, HitRecord & hit) const;
+
+    //! Collapse the binary subtree rooted at \a node into a new wide node and return its index
+    uint32_t collapse(const BBHNode * node);
+};